@@ -12,6 +12,7 @@
 #define _GNU_SOURCE  // for memmem
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,7 +27,7 @@ static FileHeader** realloc_files(MultipartForm* form);
 static FormField* realloc_fields(MultipartForm* form);
 
 static bool insert_header(MultipartForm* form, FileHeader header) {
-    if (form->num_files >= INITIAL_FILE_CAPACITY) {
+    if (form->num_files >= form->files_capacity) {
         if (!realloc_files(form)) {
             fprintf(stderr, "Failed to reallocate files\n");
             return false;
@@ -47,6 +48,151 @@ static bool insert_header(MultipartForm* form, FileHeader header) {
     return true;
 }
 
+// =============== Content-defined chunking ==================
+// FastCDC (Xia et al., USENIX ATC '16) with normalized chunking: the gear hash is rolled over every
+// byte of the file body and a chunk is cut where the hash matches a mask. A harder mask is used
+// below the average chunk size and an easier one above it, which narrows the chunk size distribution.
+// The scan also looks for the closing boundary so that chunking costs no extra pass over the body.
+
+// 256 pseudo-random values generated with splitmix64.
+static const uint64_t cdc_gear[256] = {
+    0x21129ee124d1b3caULL, 0x30fd5aaec68a90efULL, 0x635da9683776305dULL, 0x698472bfc1ef1706ULL,
+    0x9fbb424091b55081ULL, 0x7b2babba72b06216ULL, 0xfe3dd59c09fc93acULL, 0xe86fe9fae6c45fceULL,
+    0xee96f2634b787094ULL, 0x3fc1882b01530016ULL, 0xd89be07960e8c0eeULL, 0x9d7596c0881ea909ULL,
+    0x077c5c03c8b571e0ULL, 0xe7197e98f6af0b07ULL, 0x713918ca72fad6b0ULL, 0x2dbb1c4e661cef65ULL,
+    0x651709a328915b58ULL, 0x667383838a20e5ecULL, 0x7ce34c4a39c3c0b6ULL, 0xfe976bd40c2c1100ULL,
+    0x773aacdceb1b2628ULL, 0xc0ba95bacafec8dbULL, 0x12dd9223a2bd063eULL, 0xab3b479b9828bf3dULL,
+    0xde2b4e1be5a9b889ULL, 0x2147efd245747399ULL, 0xcdb3b0ddabacf532ULL, 0xc8ac80fd3cecafd5ULL,
+    0x155aadae1ba71990ULL, 0xc01cd42f36f39a5fULL, 0xd7ae7cbd1595669bULL, 0x813840c20281262eULL,
+    0x40744842f9bb1178ULL, 0x51a7ea35db9eacc0ULL, 0x308f8501343efe61ULL, 0xe6b4f1359e7919c1ULL,
+    0x7a023bba35849c7bULL, 0xa670bbfc40147fc0ULL, 0x7626bdde61a63145ULL, 0xec534537b092e62bULL,
+    0x76cc3f348311b609ULL, 0x3991e626caecabcdULL, 0x35e14da7cce04dd1ULL, 0xda168a321683cf49ULL,
+    0xd8491cbf6e05235eULL, 0x26284b0b2dde7176ULL, 0x4a523c29c776dc9cULL, 0x7047ff2d44f61e2eULL,
+    0x7c42b43187d8edecULL, 0x097262536613b58aULL, 0x9c32d6edf6977833ULL, 0x8cef4d65902a19b8ULL,
+    0x5e885c92eb5d83f7ULL, 0xee7fa80ebb624667ULL, 0x5f13baca58123e49ULL, 0x6fff79d98233895dULL,
+    0xe9cc5b537790bb10ULL, 0xa176df59d8a20ae8ULL, 0xf731ff5a5d489c92ULL, 0x63bdbac53e04bea8ULL,
+    0xdf4f4f0907136cb3ULL, 0xadc835a1f1e31946ULL, 0xf3ebc28974f7c7cfULL, 0xa2f0a7636f50470fULL,
+    0x6aa4dd718ee772b4ULL, 0x8b7cb379bb2570f2ULL, 0x4c587df4ed25a87cULL, 0xc91cf67e6894aad0ULL,
+    0x8730ae4f0c74362fULL, 0x31f057acffabc608ULL, 0x810420b33cb894d2ULL, 0x94d27e366afc2088ULL,
+    0x5f376d89aa46926cULL, 0xa8bfa680bb82bd38ULL, 0xf3c6795124b73009ULL, 0x756f5b53f00636ebULL,
+    0xbfe89bd8ad3111ceULL, 0x5d1290c93e076cf3ULL, 0x017b44db7dc041beULL, 0xf824d2eb18fc0ca1ULL,
+    0x5cac30fd76eefef2ULL, 0x278b06629356d437ULL, 0xf3cc372c556435e9ULL, 0x7e78b1a2645e2a3eULL,
+    0x7ba13b968eaef2e8ULL, 0x08ff812810b00e6bULL, 0x29a2963276407aefULL, 0x24beafbd516d61e7ULL,
+    0x3cba13aaa1f0bf84ULL, 0xf3450d4ac769e08eULL, 0xc44ddcacbf2ee346ULL, 0xff2b161d8711cf68ULL,
+    0x69d2069b0d5bb076ULL, 0xcf74190d769b7ebaULL, 0x7906072a4dc9f344ULL, 0x923a65ac1a151cc3ULL,
+    0x2666c7f9a7e3d833ULL, 0x372ab55e54f391a9ULL, 0xe1269e0f61affa99ULL, 0xa57e3f9614d95a27ULL,
+    0x7223a41b3822ffa8ULL, 0x50d7c6ce9fbd51dcULL, 0xac971e2d71cbee20ULL, 0xeab0d94992f656d9ULL,
+    0xdceca9ae15a45372ULL, 0xb436c9e88434a30fULL, 0x1dfe4bdda9be03faULL, 0x01f69e5ae70d0e96ULL,
+    0x465e30c278d64354ULL, 0x58bbc8c511005da6ULL, 0x530e940886b97412ULL, 0xe1c5576bada624e9ULL,
+    0xed8eba242959ab5bULL, 0xd7bb21b5bb9bf571ULL, 0x1d84f9f4f54ec8eeULL, 0x7a55548f60b7ecd8ULL,
+    0x0beb68d41bcf22e4ULL, 0x8e438cfb292f367fULL, 0x0a2c6785731edd26ULL, 0x6f5cbe55a0c54047ULL,
+    0x427855ff42353d23ULL, 0x00307cda6d883206ULL, 0x38059ef1f80c8880ULL, 0x34567bdd7e2fc3c6ULL,
+    0x8b5ac932d3427bc9ULL, 0xcff9e899f7c9cb26ULL, 0xc92661d40c87373eULL, 0x252926349b17b297ULL,
+    0xb07a9284d976dcd0ULL, 0xdd90d90bccbe3428ULL, 0x6776dc1eb3398e6aULL, 0xc243bfc15e761792ULL,
+    0xce830a56f725fe48ULL, 0x6a9060d9d96f9a88ULL, 0x0adb4ed75fe1e9a8ULL, 0x7d1508a2ea6e25d9ULL,
+    0xa73161b06e15108aULL, 0x7f1d04b6332d6ea4ULL, 0xb53e5ad285e4d3e3ULL, 0xa904e3530eb73caeULL,
+    0xf26e9202bb70b630ULL, 0xa2313faec1daf734ULL, 0xf7410cfde8a4bc60ULL, 0x5727900c8d85a54dULL,
+    0x735d87fcea34c729ULL, 0x679a8876243ba190ULL, 0x81ff159089f404f6ULL, 0xf894f7808ee8f80fULL,
+    0xfeb54754de2a3105ULL, 0x6f5a5eb82aac463bULL, 0x6ee49c8d8258d744ULL, 0xb977850557c339fdULL,
+    0xf66a2833d51c4e4dULL, 0x4f76e51244a8056aULL, 0x7b1124c0153ffbd3ULL, 0xab03722bafbbb696ULL,
+    0x2419263e07ca8dfdULL, 0x99ca5ec20038b320ULL, 0xec09e83ab1ab04cdULL, 0x48d07e105c5a168cULL,
+    0x0fc989f65c4ef996ULL, 0x83805cc248085195ULL, 0xf4836a099bceef8eULL, 0xd6e87387c6896181ULL,
+    0x4d170c2580510936ULL, 0x1efd1b5b921bd9a1ULL, 0xe2620eb53273eb8eULL, 0xc2a2b18fbf572135ULL,
+    0x15b1071a028c9ae9ULL, 0x7dd63d848136a7d0ULL, 0x41678cb821709cb3ULL, 0x8f8f78c239693fb5ULL,
+    0xb6b1f62e6bd6f4deULL, 0xc3eb94bf6e84422cULL, 0x13756ceeca6bd0cbULL, 0xd50bebeb56cf5546ULL,
+    0x58b3abe4c24c6b1aULL, 0x0185862722e118fcULL, 0xbf4cfea1dc886fd7ULL, 0x7fa3f561973cc071ULL,
+    0x312a37d5eed86711ULL, 0x67ecd9c815a69404ULL, 0xa25100b16f334228ULL, 0x5b6afc2998800681ULL,
+    0xa040f0db74fff012ULL, 0x0d7c4fa1ff186cbfULL, 0x9efa4f694881c696ULL, 0x6652dd4834c83df3ULL,
+    0xa309bfb2e53225d5ULL, 0x3b3206166517b8f9ULL, 0x27a0d9ccf286ca79ULL, 0xaa1aebba0b05b054ULL,
+    0x05524c434e4d93f4ULL, 0x3a7e8651582c6690ULL, 0xf240d6d30c3e3403ULL, 0xd96d6661d8a7ce4dULL,
+    0xc1209d32a45633ebULL, 0x7c2fe50cd5c6d242ULL, 0xeeee07d118cfee11ULL, 0xea0d313db737ad5cULL,
+    0x50daa73450b74241ULL, 0x58cd0cf38effae58ULL, 0x8e3dffe7d3c08698ULL, 0xd618e96af9a4b2c7ULL,
+    0xe9348fca2e5fa59aULL, 0x36e58320649ae6f8ULL, 0x9f6113baf759ff99ULL, 0x7496bbfa87b66153ULL,
+    0xdf6f61abdef9bdf6ULL, 0x433967f7dddc6f1aULL, 0xe7e0aa160a2c3624ULL, 0xc30e8f5e137bb08fULL,
+    0x18e673b61d84bd31ULL, 0xe76d8b8e8b8df5e5ULL, 0x1dd23a66d1f54cf3ULL, 0x548f3f0cd6952b9aULL,
+    0x7a6efdcbb9c22d0dULL, 0xb445b1b6b288c1ecULL, 0x48853959edec7e13ULL, 0xf0081436405a0489ULL,
+    0x17b3d362ee3b1cc4ULL, 0xe0c367f739290c9aULL, 0xd0d39efa9f24e577ULL, 0xfb714736543daed9ULL,
+    0xe20c09a0609dfbb7ULL, 0x7d0a22b4b41143a9ULL, 0xbc6a661f620861baULL, 0xc875c7e1ac55f67bULL,
+    0x410d7eb63407c145ULL, 0xcbeea76f39f521aaULL, 0x4f60e45f3fbf7312ULL, 0x6c021e694148d9a1ULL,
+    0x8bc409ccd5a691d6ULL, 0x97307bf036485677ULL, 0x87d088e9dfa232e4ULL, 0x915232790e05a102ULL,
+    0x3a2fb46cd56dfd7bULL, 0x2c70c9b3f3923cc1ULL, 0x02ad076cd92948d8ULL, 0xb5276445928ba25aULL,
+    0x667dc0a46d7e81f6ULL, 0xff4f0412d2786cf6ULL, 0x220ee1da8620a4a5ULL, 0xf8b94748ed9b936bULL,
+    0xf1a4a2fc684a83d5ULL, 0x75503618c65a0819ULL, 0x54b71e03ebc22bb6ULL, 0x0050cf936849a113ULL,
+    0x8913c213facb62a5ULL, 0x79a6e6939feb91c2ULL, 0xdebd6e2e0309095eULL, 0x3c7ed08ed8f51b32ULL,
+    0x5661a1504393c0d3ULL, 0x35e5005d133f8dedULL, 0x7203fe37eeb98032ULL, 0x4b5461f3adf950a1ULL,
+};
+
+#define CDC_AVG_BITS ((unsigned)__builtin_ctzll(MULTIPART_CDC_AVG_SIZE))
+#define CDC_MASK(bits) (~0ULL << (64 - (bits)))
+
+static bool append_chunk(FileHeader* header, size_t* capacity, const char* data, const unsigned char* start,
+                         size_t size) {
+    if (header->num_chunks >= *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        MultipartChunk* chunks = (MultipartChunk*)realloc(header->chunks, new_capacity * sizeof(MultipartChunk));
+        if (!chunks) {
+            perror("Failed to allocate memory for chunks");
+            return false;
+        }
+        header->chunks = chunks;
+        *capacity = new_capacity;
+    }
+
+    MultipartChunk* chunk = &header->chunks[header->num_chunks++];
+    chunk->offset = (const char*)start - data;
+    chunk->size = size;
+
+    // The chunk is still in cache from the gear hash.
+    return multipart_sha256(start, size, chunk->digest);
+}
+
+// Scans the file body starting at header->offset for the boundary while splitting it into
+// content-defined chunks stored in header->chunks.
+// On success, *endptr is set to the start of the boundary.
+static MultipartCode chunk_file_body(const char* data, size_t size, const char* boundary, size_t boundary_length,
+                                     FileHeader* header, const char** endptr) {
+    const unsigned char* start = (const unsigned char*)data + header->offset;
+    const unsigned char* end = (const unsigned char*)data + size;
+    const unsigned char first = (unsigned char)boundary[0];
+    const uint64_t mask_small = CDC_MASK(CDC_AVG_BITS + 2);
+    const uint64_t mask_large = CDC_MASK(CDC_AVG_BITS - 2);
+
+    const unsigned char* chunk_start = start;
+    size_t capacity = 0;
+    uint64_t fp = 0;
+
+    for (const unsigned char* p = start; p < end; p++) {
+        if (*p == first && (size_t)(end - p) >= boundary_length && memcmp(p, boundary, boundary_length) == 0) {
+            if (p > chunk_start && !append_chunk(header, &capacity, data, chunk_start, p - chunk_start)) {
+                return MEMORY_ALLOC_ERROR;
+            }
+            *endptr = (const char*)p;
+            return MULTIPART_OK;
+        }
+
+        // No need to scan further, the file is already too big.
+        if ((size_t)(p - start) >= MAX_FILE_SIZE) {
+            return MAX_FILE_SIZE_EXCEEDED;
+        }
+
+        fp = (fp << 1) + cdc_gear[*p];
+
+        size_t length = p - chunk_start + 1;
+        if (length < MULTIPART_CDC_MIN_SIZE)
+            continue;
+
+        uint64_t mask = length < MULTIPART_CDC_AVG_SIZE ? mask_small : mask_large;
+        if ((fp & mask) == 0 || length >= MULTIPART_CDC_MAX_SIZE) {
+            if (!append_chunk(header, &capacity, data, chunk_start, length)) {
+                return MEMORY_ALLOC_ERROR;
+            }
+            chunk_start = p + 1;
+            fp = 0;
+        }
+    }
+    return INVALID_FORM_BOUNDARY;
+}
+
 /**
  * Parse a multipart form from the request body.
  * @param data: Request body (with out headers). Its not assumed to be null-terminated.
@@ -62,10 +208,58 @@ static bool insert_header(MultipartForm* form, FileHeader header) {
  * is not MULTIPART_OK.
  * */
 MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary, MultipartForm* form) {
+    return multipart_parse_form_ex(data, size, boundary, form, NULL);
+}
+
+// Reports whether the n bytes of s start at p, without reading past end.
+static inline bool starts_with(const char* p, const char* end, const char* s, size_t n) {
+    return (size_t)(end - p) >= n && memcmp(p, s, n) == 0;
+}
+
+// Skips to the first byte after the next newline. Returns NULL if the body ends first.
+static inline const char* next_line(const char* p, const char* end) {
+    const char* nl = memchr(p, '\n', end - p);
+    return nl ? nl + 1 : NULL;
+}
+
+// State for reporting the matches in one part to MultipartOptions.on_match.
+typedef struct PartInspection {
+    const MultipartOptions* options;
+    MultipartMatch match;
+    size_t part_offset;
+} PartInspection;
+
+static bool report_match(size_t pattern, size_t offset, void* userdata) {
+    PartInspection* inspection = (PartInspection*)userdata;
+    inspection->match.pattern = pattern;
+    inspection->match.offset = inspection->part_offset + offset;
+    const MultipartOptions* options = inspection->options;
+    return !options->on_match || options->on_match(&inspection->match, options->userdata);
+}
+
+// Runs options->matcher over the bytes of a part. Returns false if on_match stopped parsing.
+static bool inspect_part(const MultipartOptions* options, const char* data, size_t offset, size_t length,
+                         const char* name, bool is_file, size_t part_index) {
+    if (!options->matcher)
+        return true;
+
+    PartInspection inspection = {
+        .options = options,
+        .match = {.part_index = part_index, .name = name, .is_file = is_file},
+        .part_offset = offset,
+    };
+    return multipart_matcher_scan(options->matcher, data + offset, length, report_match, &inspection);
+}
+
+// The FSM shared by multipart_parse_form_ex and multipart_validate. With form set to NULL
+// nothing is allocated or stored, parts are only counted in summary.
+static MultipartCode parse_form(const char* data, size_t size, const char* boundary, MultipartForm* form,
+                                const MultipartOptions* options, MultipartSummary* summary) {
     size_t boundary_length = strlen(boundary);
 
     // Temporary variables to store state of the FSM.
     const char* ptr = data;
+    const char* const end = data + size;
 
     const char* key_start = NULL;
     const char* value_start = NULL;
@@ -77,49 +271,58 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
     // Initial state
     State state = STATE_BOUNDARY;
 
-    // Allocate initial memory for files and fields.
-    form->files = (FileHeader**)malloc(INITIAL_FILE_CAPACITY * sizeof(FileHeader*));
-    if (!form->files) {
-        fprintf(stderr, "Failed to allocate memory for files\n");
-        return MEMORY_ALLOC_ERROR;
-    }
-    // zero out the memory
-    memset(form->files, 0, INITIAL_FILE_CAPACITY * sizeof(FileHeader*));
-
-    // Initialize the number of files and fields to 0.
-    form->num_files = 0;
-
     // Current file in State transitions
     FileHeader header = {0};
 
-    // Allocate memory for fields
-    form->fields = (FormField*)malloc(INITIAL_FIELD_CAPACITY * sizeof(FormField));
-    if (!form->fields) {
-        fprintf(stderr, "Failed to allocate memory for fields\n");
-        return MEMORY_ALLOC_ERROR;
-    }
+    if (form) {
+        // Parsing into a form that was parsed before reuses its arrays, only missing ones are allocated.
+        multipart_reset_form(form);
+
+        if (!form->files || form->files_capacity == 0) {
+            free(form->files);
+            form->files = (FileHeader**)malloc(INITIAL_FILE_CAPACITY * sizeof(FileHeader*));
+            if (!form->files) {
+                fprintf(stderr, "Failed to allocate memory for files\n");
+                form->files_capacity = 0;
+                return MEMORY_ALLOC_ERROR;
+            }
+            // zero out the memory
+            memset(form->files, 0, INITIAL_FILE_CAPACITY * sizeof(FileHeader*));
+            form->files_capacity = INITIAL_FILE_CAPACITY;
+        }
 
-    form->num_fields = 0;
-    memset(form->fields, 0, INITIAL_FIELD_CAPACITY * sizeof(FormField));
+        // Allocate memory for fields
+        if (!form->fields || form->fields_capacity == 0) {
+            free(form->fields);
+            form->fields = (FormField*)malloc(INITIAL_FIELD_CAPACITY * sizeof(FormField));
+            if (!form->fields) {
+                fprintf(stderr, "Failed to allocate memory for fields\n");
+                form->fields_capacity = 0;
+                return MEMORY_ALLOC_ERROR;
+            }
+            form->fields_capacity = INITIAL_FIELD_CAPACITY;
+            memset(form->fields, 0, INITIAL_FIELD_CAPACITY * sizeof(FormField));
+        }
+    }
 
     MultipartCode code = MULTIPART_OK;
 
     // Start parsing the form data
-    while (ptr < data + size) {
+    while (ptr < end) {
         switch (state) {
             case STATE_BOUNDARY:
-                if (strncmp(ptr, boundary, boundary_length) == 0) {
+                if (starts_with(ptr, end, boundary, boundary_length)) {
                     state = STATE_HEADER;
                     ptr += boundary_length;
-                    while (*ptr == '-' || *ptr == '\r' || *ptr == '\n')
+                    while (ptr < end && (*ptr == '-' || *ptr == '\r' || *ptr == '\n'))
                         ptr++;  // Skip extra characters after boundary
                 } else {
                     ptr++;
                 }
                 break;
             case STATE_HEADER:
-                if (strncmp(ptr, "Content-Disposition:", 20) == 0) {
-                    ptr = sstrstr(ptr, "name=\"", size - (ptr - data));
+                if (starts_with(ptr, end, "Content-Disposition:", 20)) {
+                    ptr = sstrstr(ptr, "name=\"", end - ptr);
                     if (!ptr) {
                         code = INVALID_FORM_BOUNDARY;
                         goto cleanup;
@@ -143,25 +346,21 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                     strncpy(key, key_start, key_length);
                     key[key_length] = '\0';
 
-                    if (strncmp(ptr, "\"; filename=\"", 13) == 0) {
+                    if (starts_with(ptr, end, "\"; filename=\"", 13)) {
                         strncpy(header.field_name, key, MAX_FIELD_NAME_SIZE);
-                        ptr = sstrstr(ptr, "\"; filename=\"", size - (ptr - data));
-                        if (!ptr) {
-                            code = INVALID_FORM_BOUNDARY;
-                            goto cleanup;
-                        }
                         ptr += 13;  // Skip "; filename=\""
                         key_start = ptr;
                         state = STATE_FILENAME;
                     } else {
                         // Move to the end of the line
-                        while (*ptr != '\n')
-                            ptr++;
-
-                        ptr++;  // Skip the newline character
+                        ptr = next_line(ptr, end);
+                        if (!ptr) {
+                            code = INVALID_FORM_BOUNDARY;
+                            goto cleanup;
+                        }
 
                         // consume the leading CRLF before value
-                        if (*ptr == '\r' && *(ptr + 1) == '\n')
+                        if (starts_with(ptr, end, "\r\n", 2))
                             ptr += 2;
 
                         value_start = ptr;
@@ -172,7 +371,7 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                 }
                 break;
             case STATE_VALUE:
-                if ((strncmp(ptr, "\r\n--", 4) == 0 || strncmp(ptr, boundary, boundary_length) == 0) &&
+                if ((starts_with(ptr, end, "\r\n--", 4) || starts_with(ptr, end, boundary, boundary_length)) &&
                     value_start != NULL) {
                     size_t value_length = ptr - value_start;
                     if (value_length >= MAX_VALUE_SIZE) {
@@ -180,29 +379,51 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                         goto cleanup;
                     }
 
-                    memset(value, 0, MAX_VALUE_SIZE);
-                    strncpy(value, value_start, value_length);
-                    value[value_length] = '\0';
-
-                    // Check if we have enough capacity for fields
-                    if (form->num_fields >= INITIAL_FIELD_CAPACITY) {
-                        if (!realloc_fields(form)) {
-                            fprintf(stderr, "Failed to reallocate fields\n");
-                            code = MEMORY_ALLOC_ERROR;
+                    if (options->max_parts && summary->num_fields + summary->num_files >= options->max_parts) {
+                        code = TOO_MANY_PARTS;
+                        goto cleanup;
+                    }
+                    summary->num_fields++;
+                    summary->total_value_bytes += value_length;
+
+                    // The value was just scanned for the boundary, its bytes are still in cache.
+                    if (!inspect_part(options, data, value_start - data, value_length, key, false,
+                                      summary->num_fields + summary->num_files - 1)) {
+                        code = CALLBACK_ABORTED;
+                        goto cleanup;
+                    }
+
+                    if (form) {
+                        memset(value, 0, MAX_VALUE_SIZE);
+                        strncpy(value, value_start, value_length);
+                        value[value_length] = '\0';
+
+                        // Check if we have enough capacity for fields
+                        if (form->num_fields >= form->fields_capacity) {
+                            if (!realloc_fields(form)) {
+                                fprintf(stderr, "Failed to reallocate fields\n");
+                                code = MEMORY_ALLOC_ERROR;
+                                goto cleanup;
+                            }
+                        }
+
+                        FormField field = {0};
+                        strncpy(field.name, key, MAX_FIELD_NAME_SIZE);
+                        strncpy(field.value, value, MAX_VALUE_SIZE);
+                        form->fields[form->num_fields++] = field;
+
+                        const FormField* last_field = &form->fields[form->num_fields - 1];
+                        if (options->on_field && !options->on_field(last_field, options->userdata)) {
+                            code = CALLBACK_ABORTED;
                             goto cleanup;
                         }
                     }
 
-                    FormField field = {0};
-                    strncpy(field.name, key, MAX_FIELD_NAME_SIZE);
-                    strncpy(field.value, value, MAX_VALUE_SIZE);
-                    form->fields[form->num_fields++] = field;
-
                     // reset the key and value
                     memset(key, 0, MAX_FIELD_NAME_SIZE);
                     memset(value, 0, MAX_VALUE_SIZE);
 
-                    while (*ptr == '\r' || *ptr == '\n')
+                    while (ptr < end && (*ptr == '\r' || *ptr == '\n'))
                         ptr++;  // Skip CRLF characters
 
                     // Reset state and process the next field if any
@@ -227,14 +448,14 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                     strncpy(header.filename, filename, MAX_FILENAME_SIZE);
 
                     // Move to the end of the line
-                    while (*ptr != '\n')
-                        ptr++;
-
-                    ptr++;  // Skip the newline character
+                    ptr = next_line(ptr, end);
+                    if (!ptr) {
+                        code = INVALID_FORM_BOUNDARY;
+                        goto cleanup;
+                    }
 
                     // consume the leading CRLF before value if available
-                    bool is_look_ahead_in_bounds = (ptr + 1) < (data + size);
-                    if (is_look_ahead_in_bounds && *ptr == '\r' && *(ptr + 1) == '\n')
+                    if (starts_with(ptr, end, "\r\n", 2))
                         ptr += 2;
 
                     // We expect the next line to be Content-Type
@@ -244,12 +465,7 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                 }
             } break;
             case STATE_FILE_MIME_HEADER: {
-                if (strncmp(ptr, "Content-Type: ", 14) == 0) {
-                    ptr = sstrstr(ptr, "Content-Type: ", size - (ptr - data));
-                    if (!ptr) {
-                        code = INVALID_FORM_BOUNDARY;
-                        goto cleanup;
-                    }
+                if (starts_with(ptr, end, "Content-Type: ", 14)) {
                     ptr += 14;  // Skip "Content-Type: "
                     state = STATE_MIMETYPE;
                 } else {
@@ -261,7 +477,7 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                 value_start = ptr;        // store the start of the mimetype
 
                 // Compute the length of the mimetype as we advance the pointer
-                while (*ptr != '\r' && *ptr != '\n') {
+                while (ptr < end && *ptr != '\r' && *ptr != '\n') {
                     mimetype_len++;
                     ptr++;
                 }
@@ -280,19 +496,19 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                 strncpy(header.mimetype, mimetype, MAX_MIMETYPE_SIZE);
 
                 // Move to the end of the line
-                while (*ptr != '\n')
-                    ptr++;
-
-                ptr++;  // Skip the newline character
+                ptr = next_line(ptr, end);
+                if (!ptr) {
+                    code = INVALID_FORM_BOUNDARY;
+                    goto cleanup;
+                }
 
                 // consume the leading CRLF before bytes of the file
-                // Make sure the look ahead is within bounds
-                while (((*ptr == '\r' && ((ptr + 1) < (data + size)) && *(ptr + 1) == '\n'))) {
+                while (starts_with(ptr, end, "\r\n", 2)) {
                     ptr += 2;  // skip CRLF
                 }
 
                 // No file content if the next line is a boundary
-                if (memcmp(ptr, boundary, boundary_length) == 0) {
+                if (starts_with(ptr, end, boundary, boundary_length)) {
                     // If the file was never provided,the filename will be empty
                     // That's not an error.
                     if (strcmp(filename, "") == 0) {
@@ -313,12 +529,19 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                 size_t endpos = 0;
                 size_t haystack_len = size - header.offset;
 
-                // Apparently strstr can't be used with binary data!!
-                // I spen't days here trying to figgit with binary files :)
-                char* endptr = memmem(ptr, haystack_len, boundary, boundary_length);
-                if (endptr == NULL) {
-                    code = INVALID_FORM_BOUNDARY;
-                    goto cleanup;
+                const char* endptr = NULL;
+                if (form && options->chunk_files) {
+                    code = chunk_file_body(data, size, boundary, boundary_length, &header, &endptr);
+                    if (code != MULTIPART_OK)
+                        goto cleanup;
+                } else {
+                    // Apparently strstr can't be used with binary data!!
+                    // I spen't days here trying to figgit with binary files :)
+                    endptr = multipart_search(ptr, haystack_len, boundary, boundary_length);
+                    if (endptr == NULL) {
+                        code = INVALID_FORM_BOUNDARY;
+                        goto cleanup;
+                    }
                 }
 
                 // Compute the end of file contents so we determine file size.
@@ -333,33 +556,52 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
                     goto cleanup;
                 }
 
-                // Set the file size.
-                header.size = file_size;
+                if (options->max_parts && summary->num_fields + summary->num_files >= options->max_parts) {
+                    code = TOO_MANY_PARTS;
+                    goto cleanup;
+                }
+                summary->num_files++;
+                summary->total_file_bytes += file_size;
+                if (file_size > summary->max_file_size)
+                    summary->max_file_size = file_size;
+
+                size_t inspect_size = options->inspect_file_bytes ? options->inspect_file_bytes
+                                                                  : MULTIPART_INSPECT_FILE_BYTES;
+                if (!inspect_part(options, data, header.offset, file_size < inspect_size ? file_size : inspect_size,
+                                  key, true, summary->num_fields + summary->num_files - 1)) {
+                    code = CALLBACK_ABORTED;
+                    goto cleanup;
+                }
+
+                if (form) {
+                    // Set the file size.
+                    header.size = file_size;
 
-                // set the header field name
-                strncpy(header.field_name, key, MAX_FIELD_NAME_SIZE);
+                    // set the header field name
+                    strncpy(header.field_name, key, MAX_FIELD_NAME_SIZE);
 
-                // Check if we have enough capacity for files
-                if (form->num_files >= INITIAL_FILE_CAPACITY) {
-                    if (!realloc_files(form)) {
-                        fprintf(stderr, "Failed to reallocate files\n");
+                    // Insert a new file header into the form
+                    if (!insert_header(form, header)) {
                         code = MEMORY_ALLOC_ERROR;
                         goto cleanup;
                     }
-                }
 
-                // Insert a new file header into the form
-                if (!insert_header(form, header)) {
-                    code = MEMORY_ALLOC_ERROR;
-                    goto cleanup;
+                    if (options->on_file &&
+                        !options->on_file(form->files[form->num_files - 1], data, options->userdata)) {
+                        memset(&header, 0, sizeof(FileHeader));  // Now owned by the form.
+                        code = CALLBACK_ABORTED;
+                        goto cleanup;
+                    }
                 }
 
                 // Reset the header
                 memset(&header, 0, sizeof(FileHeader));
 
+                // Continue from the boundary instead of scanning the file bytes again.
+                ptr = endptr;
+
                 // consume the trailing CRLF before the next boundary
-                // Make sure the look ahead is within bounds
-                while (((*ptr == '\r' && ((ptr + 1) < (data + size)) && *(ptr + 1) == '\n'))) {
+                while (starts_with(ptr, end, "\r\n", 2)) {
                     ptr += 2;
                 }
                 state = STATE_BOUNDARY;
@@ -373,11 +615,36 @@ MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary
     }
 
 cleanup:
-    if (code != MULTIPART_OK)
+    if (code != MULTIPART_OK && form) {
+        free(header.chunks);  // Chunks of a file that was never inserted.
         multipart_free_form(form);
+    }
     return code;
 }
 
+MultipartCode multipart_parse_form_ex(const char* data, size_t size, char* boundary, MultipartForm* form,
+                                      const MultipartOptions* options) {
+    MultipartOptions defaults = {0};
+    MultipartSummary summary = {0};
+    return parse_form(data, size, boundary, form, options ? options : &defaults, &summary);
+}
+
+MultipartCode multipart_validate(const char* data, size_t size, const char* boundary, const MultipartOptions* options,
+                                 MultipartSummary* summary) {
+    // Only the limits and the matcher apply, the other callbacks and chunking need a form.
+    MultipartOptions limits = {0};
+    if (options) {
+        limits.max_parts = options->max_parts;
+        limits.matcher = options->matcher;
+        limits.on_match = options->on_match;
+        limits.inspect_file_bytes = options->inspect_file_bytes;
+        limits.userdata = options->userdata;
+    }
+
+    memset(summary, 0, sizeof(MultipartSummary));
+    return parse_form(data, size, boundary, NULL, &limits, summary);
+}
+
 // A simple implementation of strstr that takes a length parameter.
 // and does not search beyond the length. This avoids dependence on
 // both the haystack and needle being null-terminated.
@@ -427,40 +694,106 @@ bool multipart_parse_boundary(const char* body, char* boundary, size_t size) {
 // Note that this boundary must always be -- shorter than what's in the body, so it's prefixed for you.
 // Returns true if successful, otherwise false(Invalid Content-Type, no boundary).
 bool multipart_parse_boundary_from_header(const char* content_type, char* boundary, size_t size) {
+    return multipart_parse_boundary_for_type(content_type, "multipart/form-data", boundary, size);
+}
+
+bool multipart_parse_boundary_for_type(const char* content_type, const char* type, char* boundary, size_t size) {
     const char* prefix = "--";
     size_t prefix_len = strlen(prefix);
-    size_t total_length = strlen(content_type);
+    size_t type_len = strlen(type);
 
-    if (strncasecmp(content_type, "multipart/form-data", 19) != 0) {
-        fprintf(stderr, "content type is missing multipart/form-data in header\n");
+    // A type ending in '/' accepts any subtype, otherwise the media type must match in full.
+    if (strncasecmp(content_type, type, type_len) != 0 ||
+        (type_len > 0 && type[type_len - 1] != '/' && content_type[type_len] != '\0' &&
+         content_type[type_len] != ';' && content_type[type_len] != ' ' && content_type[type_len] != '\t')) {
+        fprintf(stderr, "content type is missing %s in header\n", type);
         return false;
     }
 
-    char* start = sstrstr(content_type, "boundary=", total_length);
-    size_t length = total_length - ((start + 9) - content_type);
-
-    // Account for prefix and null terminater
-    if (size <= length + prefix_len + 1) {
+    if (size <= prefix_len + 1) {
         fprintf(stderr, "buffer size for boundary is too small\n");
         return false;
     }
 
+    // The boundary may be quoted and followed by other parameters.
+    if (!multipart_header_param(content_type, "boundary", boundary + prefix_len, size - prefix_len) ||
+        boundary[prefix_len] == '\0') {
+        fprintf(stderr, "content type has no boundary or it does not fit the buffer\n");
+        return false;
+    }
     memcpy(boundary, prefix, prefix_len);  // ignore null terminator
-    strncpy(boundary + prefix_len, (start + 9), length);
-    boundary[length + prefix_len] = '\0';
     return true;
 }
 
-void multipart_free_form(MultipartForm* form) {
-    if (!form)
-        return;
+bool multipart_header_param(const char* header, const char* name, char* value, size_t size) {
+    size_t name_length = strlen(name);
+    const char* p = strchr(header, ';');
+
+    while (p) {
+        p++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        const char* key = p;
+        while (*p && *p != '=' && *p != ';')
+            p++;
+        if (*p != '=') {
+            p = *p ? p : NULL;
+            continue;
+        }
+        bool match = (size_t)(p - key) == name_length && strncasecmp(key, name, name_length) == 0;
+        p++;
+
+        // Values of the other parameters are skipped too, a quoted one may contain ';'.
+        size_t length = 0;
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1])
+                    p++;
+                if (match) {
+                    if (length + 1 >= size)
+                        return false;
+                    value[length++] = *p;
+                }
+            }
+            if (*p != '"')
+                return false;
+            p++;
+        } else {
+            for (; *p && *p != ';' && *p != ' ' && *p != '\t'; p++) {
+                if (match) {
+                    if (length + 1 >= size)
+                        return false;
+                    value[length++] = *p;
+                }
+            }
+        }
+        if (match) {
+            value[length] = '\0';
+            return true;
+        }
+        p = strchr(p, ';');
+    }
+    return false;
+}
 
+void multipart_reset_form(MultipartForm* form) {
     if (form->files) {
         for (size_t i = 0; i < form->num_files; i++) {
+            free(form->files[i]->chunks);
             free(form->files[i]);
             form->files[i] = NULL;
         }
+    }
+    form->num_files = 0;
+    form->num_fields = 0;
+}
+
+void multipart_free_form(MultipartForm* form) {
+    if (!form)
+        return;
 
+    multipart_reset_form(form);
+    if (form->files) {
         free(form->files);
         form->files = NULL;
     }
@@ -472,9 +805,55 @@ void multipart_free_form(MultipartForm* form) {
 
     form->num_files = 0;
     form->num_fields = 0;
+    form->files_capacity = 0;
+    form->fields_capacity = 0;
     form = NULL;
 }
 
+MultipartCode multipart_copy_form(const MultipartForm* src, MultipartForm* dst) {
+    memset(dst, 0, sizeof(MultipartForm));
+
+    if (src->num_fields > 0) {
+        dst->fields = (FormField*)malloc(src->num_fields * sizeof(FormField));
+        if (!dst->fields)
+            return MEMORY_ALLOC_ERROR;
+        memcpy(dst->fields, src->fields, src->num_fields * sizeof(FormField));
+        dst->num_fields = src->num_fields;
+        dst->fields_capacity = src->num_fields;
+    }
+
+    if (src->num_files > 0) {
+        dst->files = (FileHeader**)calloc(src->num_files, sizeof(FileHeader*));
+        if (!dst->files) {
+            multipart_free_form(dst);
+            return MEMORY_ALLOC_ERROR;
+        }
+        dst->files_capacity = src->num_files;
+
+        for (size_t i = 0; i < src->num_files; i++) {
+            FileHeader* file = (FileHeader*)malloc(sizeof(FileHeader));
+            if (!file) {
+                multipart_free_form(dst);
+                return MEMORY_ALLOC_ERROR;
+            }
+            *file = *src->files[i];
+            file->chunks = NULL;
+
+            if (file->num_chunks > 0) {
+                file->chunks = (MultipartChunk*)malloc(file->num_chunks * sizeof(MultipartChunk));
+                if (!file->chunks) {
+                    free(file);
+                    multipart_free_form(dst);
+                    return MEMORY_ALLOC_ERROR;
+                }
+                memcpy(file->chunks, src->files[i]->chunks, file->num_chunks * sizeof(MultipartChunk));
+            }
+            dst->files[dst->num_files++] = file;
+        }
+    }
+    return MULTIPART_OK;
+}
+
 // =============== Fields API ========================
 // Get the value of a field by name.
 // Returns NULL if the field is not found.
@@ -572,29 +951,49 @@ const char* multipart_error_message(MultipartCode error) {
             return "Value too long";
         case EMPTY_FILE_CONTENT:
             return "Empty file content";
+        case CALLBACK_ABORTED:
+            return "Aborted by callback";
+        case TOO_MANY_PARTS:
+            return "Too many parts";
+        case OUTPUT_WRITE_FAILED:
+            return "Failed to write output";
+        case DECODE_FAILED:
+            return "Invalid compressed body";
+        case DECODE_LIMIT_EXCEEDED:
+            return "Decompressed body too large";
+        case INVALID_CONTENT_RANGE:
+            return "Invalid Content-Range";
+        case INVALID_CONTENT_ID:
+            return "Invalid Content-ID";
+        case DUPLICATE_CONTENT_ID:
+            return "Duplicate Content-ID";
+        case UNSUPPORTED_ENCODING:
+            return "Unsupported Content-Encoding";
         default:
             return "Multipart OK";
     }
 }
 
 static FileHeader** realloc_files(MultipartForm* form) {
-    size_t new_capacity = form->num_files * 2;
+    size_t new_capacity = form->files_capacity * 2;
     FileHeader** new_files = (FileHeader**)realloc(form->files, new_capacity * sizeof(FileHeader*));
     if (!new_files) {
         perror("Failed to reallocate memory for files");
         return NULL;
     }
     form->files = new_files;
+    form->files_capacity = new_capacity;
     return form->files;
 }
 
 static FormField* realloc_fields(MultipartForm* form) {
-    size_t new_capacity = form->num_fields * 2;
+    size_t new_capacity = form->fields_capacity * 2;
     FormField* new_fields = (FormField*)realloc(form->fields, new_capacity * sizeof(FormField));
     if (!new_fields) {
         perror("Failed to reallocate memory for fields");
         return NULL;
     }
     form->fields = new_fields;
+    form->fields_capacity = new_capacity;
     return form->fields;
 }
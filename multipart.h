@@ -1,8 +1,13 @@
 #ifndef __MULTIPART_H__
 #define __MULTIPART_H__
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 // Constants that can be overriden
 #ifndef INITIAL_FIELD_CAPACITY
@@ -35,6 +40,177 @@
 #define MAX_VALUE_SIZE 2048
 #endif
 
+// Size in bytes of the SHA-256 digests computed by the library.
+#define MULTIPART_DIGEST_SIZE 32
+
+// Size of the leaves of the tree hash. Each chunk is hashed independently.
+#ifndef MULTIPART_TREE_CHUNK_SIZE
+#define MULTIPART_TREE_CHUNK_SIZE (1024 * 1024)
+#endif
+
+// Upper bound on threads used by multipart_tree_hash.
+#ifndef MULTIPART_TREE_MAX_THREADS
+#define MULTIPART_TREE_MAX_THREADS 64
+#endif
+
+// Content-defined chunking parameters (FastCDC). See MultipartOptions.chunk_files.
+// MULTIPART_CDC_AVG_SIZE must be a power of two.
+#ifndef MULTIPART_CDC_MIN_SIZE
+#define MULTIPART_CDC_MIN_SIZE (2 * 1024)
+#endif
+
+#ifndef MULTIPART_CDC_AVG_SIZE
+#define MULTIPART_CDC_AVG_SIZE (8 * 1024)
+#endif
+
+#ifndef MULTIPART_CDC_MAX_SIZE
+#define MULTIPART_CDC_MAX_SIZE (64 * 1024)
+#endif
+
+// AES-256-GCM parameters used by multipart_save_file_encrypted.
+#define MULTIPART_AES_KEY_SIZE 32
+#define MULTIPART_GCM_IV_SIZE 12
+#define MULTIPART_GCM_TAG_SIZE 16
+
+// Size of the blocks encrypted and written at a time.
+#ifndef MULTIPART_CRYPT_BLOCK_SIZE
+#define MULTIPART_CRYPT_BLOCK_SIZE (64 * 1024)
+#endif
+
+// Size of the blocks pushed through a sink pipeline.
+#ifndef MULTIPART_SINK_BLOCK_SIZE
+#define MULTIPART_SINK_BLOCK_SIZE (64 * 1024)
+#endif
+
+// Alignment of buffers, offsets and sizes for O_DIRECT writes. 4096 suits virtually all devices.
+#ifndef MULTIPART_DIRECT_ALIGNMENT
+#define MULTIPART_DIRECT_ALIGNMENT 4096
+#endif
+
+// Size of the writes issued by multipart_save_file_direct. Must be a multiple of MULTIPART_DIRECT_ALIGNMENT.
+#ifndef MULTIPART_DIRECT_BUFFER_SIZE
+#define MULTIPART_DIRECT_BUFFER_SIZE (1024 * 1024)
+#endif
+
+// Granularity of zero detection in multipart_save_file_sparse. Should match the filesystem block size.
+#ifndef MULTIPART_SPARSE_BLOCK_SIZE
+#define MULTIPART_SPARSE_BLOCK_SIZE 4096
+#endif
+
+// Initial capacity of a MultipartBodyBuffer, also the part that stays resident across multipart_body_reset.
+#ifndef MULTIPART_BODY_INITIAL_SIZE
+#define MULTIPART_BODY_INITIAL_SIZE (64 * 1024)
+#endif
+
+// Capacity from which a MultipartBodyBuffer asks for transparent huge pages.
+#ifndef MULTIPART_BODY_HUGEPAGE_THRESHOLD
+#define MULTIPART_BODY_HUGEPAGE_THRESHOLD (2 * 1024 * 1024)
+#endif
+
+// Default limit on decompressed size / compressed size for a MultipartDecoder.
+#ifndef MULTIPART_DECODE_MAX_RATIO
+#define MULTIPART_DECODE_MAX_RATIO 100
+#endif
+
+// Decompressed bytes up to which the ratio limit is not applied.
+#ifndef MULTIPART_DECODE_RATIO_GRACE
+#define MULTIPART_DECODE_RATIO_GRACE (1024 * 1024)
+#endif
+
+// Decompressed bytes produced between two limit checks.
+#ifndef MULTIPART_DECODE_CHUNK_SIZE
+#define MULTIPART_DECODE_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Default size of the parts a MultipartS3Sink uploads. S3 requires at least 5 MiB for all but the last part.
+#ifndef MULTIPART_S3_PART_SIZE
+#define MULTIPART_S3_PART_SIZE (8 * 1024 * 1024)
+#endif
+
+// Smallest part_size a MultipartS3Sink accepts by default: the S3 limit, 5 MiB.
+#ifndef MULTIPART_S3_MIN_PART_SIZE
+#define MULTIPART_S3_MIN_PART_SIZE (5 * 1024 * 1024)
+#endif
+
+// Limits of the S3 sink. S3 allows at most 10000 parts per object.
+#define MULTIPART_S3_MAX_PARALLEL 16
+#define MULTIPART_S3_MAX_PARTS 10000
+#define MULTIPART_S3_ETAG_SIZE 128
+#define MULTIPART_S3_UPLOAD_ID_SIZE 256
+#define MULTIPART_S3_PATH_SIZE 2048
+
+// Seconds an S3 request may stall on the socket before it fails.
+#ifndef MULTIPART_S3_TIMEOUT
+#define MULTIPART_S3_TIMEOUT 60
+#endif
+
+// Default clamd socket, as installed by the Debian and Ubuntu packages.
+#ifndef MULTIPART_CLAMD_SOCKET
+#define MULTIPART_CLAMD_SOCKET "/var/run/clamav/clamd.ctl"
+#endif
+
+// Largest INSTREAM chunk sent to clamd.
+#ifndef MULTIPART_CLAMD_CHUNK_SIZE
+#define MULTIPART_CLAMD_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Seconds a clamd connection may stall before the scan fails.
+#ifndef MULTIPART_CLAMD_TIMEOUT
+#define MULTIPART_CLAMD_TIMEOUT 30
+#endif
+
+#define MULTIPART_CLAMD_PATH_SIZE 108  // sizeof(sockaddr_un.sun_path)
+#define MULTIPART_CLAMD_REPLY_SIZE 256
+
+// Largest write a save scheduler issues for one file before serving other uploads.
+#ifndef MULTIPART_SCHED_SLICE_SIZE
+#define MULTIPART_SCHED_SLICE_SIZE (1024 * 1024)
+#endif
+
+// Limits of the save scheduler.
+#define MULTIPART_SCHED_MAX_WORKERS 64
+#define MULTIPART_SCHED_MAX_DEVICES 16
+#define MULTIPART_SCHED_MAX_BATCH 32
+
+// Longest saved path a retry cache entry records, including the terminator.
+#ifndef MULTIPART_CACHE_PATH_SIZE
+#define MULTIPART_CACHE_PATH_SIZE 256
+#endif
+
+// Bytes at the start of each file searched by MultipartOptions.matcher, unless inspect_file_bytes is set.
+#ifndef MULTIPART_INSPECT_FILE_BYTES
+#define MULTIPART_INSPECT_FILE_BYTES 1024
+#endif
+
+// Bytes of synthetic file data each boundary search kernel is timed on, and times it is run.
+#ifndef MULTIPART_SEARCH_SAMPLE_SIZE
+#define MULTIPART_SEARCH_SAMPLE_SIZE (64 * 1024)
+#endif
+
+#ifndef MULTIPART_SEARCH_TUNE_RUNS
+#define MULTIPART_SEARCH_TUNE_RUNS 5
+#endif
+
+// Longest CSV row a CSV sink buffers, counting one byte per delimiter.
+#ifndef MULTIPART_CSV_MAX_ROW_SIZE
+#define MULTIPART_CSV_MAX_ROW_SIZE (1024 * 1024)
+#endif
+
+// Longest Content-ID of a multipart/related part, without the angle brackets, including the terminator.
+#ifndef MULTIPART_CONTENT_ID_SIZE
+#define MULTIPART_CONTENT_ID_SIZE 256
+#endif
+
+// Default size at which the pack store starts a new segment file.
+#ifndef MULTIPART_STORE_SEGMENT_SIZE
+#define MULTIPART_STORE_SEGMENT_SIZE (256 * 1024 * 1024)
+#endif
+
+// Maximum length of the pack store directory path.
+#ifndef MULTIPART_STORE_DIR_SIZE
+#define MULTIPART_STORE_DIR_SIZE 256
+#endif
+
 typedef enum {
     STATE_BOUNDARY,
     STATE_HEADER,
@@ -46,6 +222,13 @@ typedef enum {
     STATE_FILE_BODY,
 } State;
 
+// A content-defined chunk of a file.
+typedef struct MultipartChunk {
+    size_t offset;                               // Offset from the body of request.
+    size_t size;                                 // Size of the chunk in bytes.
+    unsigned char digest[MULTIPART_DIGEST_SIZE];  // SHA-256 of the chunk.
+} MultipartChunk;
+
 // FileHeader is a representation of a file parsed from the form.
 // It helps us avoid copying file contents but can save the file from
 // it's offset and size.
@@ -56,6 +239,12 @@ typedef struct FileHeader {
     char filename[MAX_FILENAME_SIZE];      // Value of filename in Content-Disposition
     char mimetype[MAX_MIMETYPE_SIZE];      // Content-Type of the file.
     char field_name[MAX_FIELD_NAME_SIZE];  // Name of the field the file is associated with.
+
+    unsigned char tree_hash[MULTIPART_DIGEST_SIZE];  // Root of the tree hash. See multipart_tree_hash_file.
+    bool has_tree_hash;                              // Whether tree_hash has been computed.
+
+    MultipartChunk* chunks;  // Content-defined chunks, NULL unless MultipartOptions.chunk_files is set.
+    size_t num_chunks;       // Number of chunks.
 } FileHeader;
 
 // Represents a field with its value in a form.
@@ -65,13 +254,62 @@ typedef struct FormField {
 } FormField;
 
 typedef struct MultipartForm {
-    FileHeader** files;  // The array of file headers
-    size_t num_files;    // The number of files processed.
+    FileHeader** files;     // The array of file headers
+    size_t num_files;       // The number of files processed.
+    size_t files_capacity;  // Number of slots allocated in files.
 
-    FormField* fields;  // Array of form field structs.
-    size_t num_fields;  // The number of fields.
+    FormField* fields;       // Array of form field structs.
+    size_t num_fields;       // The number of fields.
+    size_t fields_capacity;  // Number of slots allocated in fields.
 } MultipartForm;
 
+// An occurrence of a pattern found while parsing. See MultipartOptions.matcher.
+typedef struct MultipartMatch {
+    size_t pattern;     // Index of the pattern.
+    size_t offset;      // Offset of the occurrence from the body of request.
+    size_t part_index;  // Position of the part in the body, counting fields and files.
+    const char* name;   // Field name of the part.
+    bool is_file;       // Whether the part is a file.
+} MultipartMatch;
+
+// Optional parser features for multipart_parse_form_ex.
+// A zero-initialized struct gives the same behavior as multipart_parse_form.
+typedef struct MultipartOptions {
+    // Split every file part into content-defined chunks (FastCDC with a gear hash) while
+    // scanning for the closing boundary. Chunk boundaries only depend on the content, so
+    // an edit to a large file only changes the chunks around it.
+    bool chunk_files;
+
+    // Called with each field as soon as it is parsed. Returning false stops parsing with CALLBACK_ABORTED.
+    bool (*on_field)(const FormField* field, void* userdata);
+
+    // Called with each file as soon as its size is known. body is the request body being parsed.
+    // Returning false stops parsing with CALLBACK_ABORTED.
+    bool (*on_file)(const FileHeader* file, const char* body, void* userdata);
+
+    void* userdata;  // Passed to the callbacks.
+
+    // Maximum number of parts (fields and files). More fail with TOO_MANY_PARTS. 0 means no limit.
+    size_t max_parts;
+
+    // Signatures searched for in every field value and in the first inspect_file_bytes of every
+    // file (0 means MULTIPART_INSPECT_FILE_BYTES) as the parser reaches them, so inspection does
+    // not read the body again. Each occurrence is passed to on_match, before on_field or on_file
+    // for that part. Returning false stops parsing with CALLBACK_ABORTED.
+    const struct MultipartMatcher* matcher;
+    bool (*on_match)(const MultipartMatch* match, void* userdata);
+    size_t inspect_file_bytes;
+} MultipartOptions;
+
+// Counts gathered by multipart_validate.
+typedef struct MultipartSummary {
+    size_t num_fields;         // Number of fields.
+    size_t num_files;          // Number of files.
+    size_t total_value_bytes;  // Sum of the field value lengths.
+    size_t total_file_bytes;   // Sum of the file sizes.
+    size_t max_file_size;      // Size of the largest file.
+} MultipartSummary;
+
 typedef enum {
     MULTIPART_OK,
     MEMORY_ALLOC_ERROR,
@@ -82,6 +320,15 @@ typedef enum {
     MIMETYPE_TOO_LONG,
     VALUE_TOO_LONG,
     EMPTY_FILE_CONTENT,
+    CALLBACK_ABORTED,
+    TOO_MANY_PARTS,
+    OUTPUT_WRITE_FAILED,
+    DECODE_FAILED,
+    DECODE_LIMIT_EXCEEDED,
+    INVALID_CONTENT_RANGE,
+    INVALID_CONTENT_ID,
+    DUPLICATE_CONTENT_ID,
+    UNSUPPORTED_ENCODING,
 } MultipartCode;
 
 /**
@@ -89,8 +336,9 @@ typedef enum {
  * @param data: Request body (with out headers)
  * @param size: Content-Length(size of data in bytes)
  * @param boundary: Null-terminated string for the form boundary.
- * @param form: Pointer to MultipartForm struct to store the parsed form data. It is assumed
- * to be initialized well and not NULL.
+ * @param form: Pointer to MultipartForm struct to store the parsed form data. Must not be NULL
+ * and must be zero-initialized (MultipartForm form = {0};), freed with multipart_free_form or
+ * hold an earlier parse: its arrays are reset and reused, so an uninitialized form frees garbage.
  * You can use the function multipart_parse_boundary or multipart_parse_boundary_from_header helpers
  * to get the boundary.
  * 
@@ -100,9 +348,30 @@ typedef enum {
  * */
 MultipartCode multipart_parse_form(const char* data, size_t size, char* boundary, MultipartForm* form);
 
+// Same as multipart_parse_form but with optional features enabled by options.
+// options may be NULL.
+MultipartCode multipart_parse_form_ex(const char* data, size_t size, char* boundary, MultipartForm* form,
+                                      const MultipartOptions* options);
+
+// Checks that data is a well-formed form within the limits (MAX_* sizes and options->max_parts)
+// by running the same state machine as multipart_parse_form, without allocating or copying
+// anything. Returns the code multipart_parse_form would return (except MEMORY_ALLOC_ERROR)
+// and fills summary with the counts of the parts. options may be NULL; the matcher runs as
+// in multipart_parse_form_ex, on_field, on_file and chunk_files are ignored.
+MultipartCode multipart_validate(const char* data, size_t size, const char* boundary, const MultipartOptions* options,
+                                 MultipartSummary* summary);
+
 // Free memory allocated by parse_multipart_form
 void multipart_free_form(MultipartForm* form);
 
+// Empties form but keeps its fields and files arrays, so parsing the next request into it does
+// not allocate them again. multipart_parse_form resets a form that still holds a previous result.
+void multipart_reset_form(MultipartForm* form);
+
+// Deep copies src into dst, which must be freed with multipart_free_form.
+// File offsets still refer to the body src was parsed from.
+MultipartCode multipart_copy_form(const MultipartForm* src, MultipartForm* dst);
+
 // Returns the const char* representing the error message.
 const char* multipart_error_message(MultipartCode error);
 
@@ -116,6 +385,15 @@ bool multipart_parse_boundary(const char* body, char* boundary, size_t size);
 // Returns true if successful, otherwise false(Invalid Content-Type, no boundary).
 bool multipart_parse_boundary_from_header(const char* content_type, char* boundary, size_t size);
 
+// Same as multipart_parse_boundary_from_header for a content-type of the given type, e.g.
+// "multipart/byteranges" or "multipart/related". "multipart/" accepts any multipart type.
+bool multipart_parse_boundary_for_type(const char* content_type, const char* type, char* boundary, size_t size);
+
+// Copies the value of parameter name (e.g. "start" in multipart/related; start="<root>") of a
+// header value into value, removing the quotes of a quoted value. Names are case-insensitive.
+// Returns false if the parameter is missing or its value does not fit in size bytes.
+bool multipart_header_param(const char* header, const char* name, char* value, size_t size);
+
 // =============== Fields API ========================
 // Get the value of a field by name.
 // Returns NULL if the field is not found.
@@ -143,6 +421,954 @@ size_t* multipart_get_files(const MultipartForm* form, const char* field_name, s
 // Returns: true on success, false on failure.
 bool multipart_save_file(const FileHeader* file, const char* body, const char* path);
 
+// =============== Digest API ========================
+
+// SHA-256 and HMAC-SHA256 are computed with OpenSSL's EVP digests, which use the SHA extensions
+// or AVX2 when the CPU has them. They only fail if OpenSSL can not allocate its state.
+
+// Incremental SHA-256 state.
+typedef struct MultipartSha256 {
+    void* ctx;  // EVP_MD_CTX, allocated by init and freed by final.
+} MultipartSha256;
+
+// final must be called after a successful init, even if an update failed, to free the state.
+bool multipart_sha256_init(MultipartSha256* ctx);
+bool multipart_sha256_update(MultipartSha256* ctx, const void* data, size_t size);
+bool multipart_sha256_final(MultipartSha256* ctx, unsigned char digest[MULTIPART_DIGEST_SIZE]);
+
+// One-shot SHA-256 of data.
+bool multipart_sha256(const void* data, size_t size, unsigned char digest[MULTIPART_DIGEST_SIZE]);
+
+// HMAC-SHA256 (RFC 2104) of data with key.
+bool multipart_hmac_sha256(const void* key, size_t key_size, const void* data, size_t size,
+                           unsigned char mac[MULTIPART_DIGEST_SIZE]);
+
+// Writes the lowercase hex representation of digest to hex (null-terminated).
+void multipart_digest_to_hex(const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                             char hex[MULTIPART_DIGEST_SIZE * 2 + 1]);
+
+// Computes the tree hash of data into root.
+// Data is split into MULTIPART_TREE_CHUNK_SIZE chunks that are hashed in parallel and combined
+// into a Merkle tree as described in RFC 6962 (leaves prefixed with 0x00, parents with 0x01).
+// The root does not depend on the number of threads.
+// @param: num_threads is the number of threads to hash with. 0 uses one per online CPU.
+//
+// Returns: true on success, false if memory for the leaves could not be allocated.
+bool multipart_tree_hash(const void* data, size_t size, size_t num_threads, unsigned char root[MULTIPART_DIGEST_SIZE]);
+
+// Computes the tree hash of the file's bytes in body and stores it in file->tree_hash.
+// Returns: true on success, false on failure.
+bool multipart_tree_hash_file(FileHeader* file, const char* body, size_t num_threads);
+
+// =============== Boundary search API ===============
+// multipart_parse_form finds the boundary after each file with multipart_search. The kernel it
+// uses is picked per class of boundary lengths (up to 16, up to 48, longer) by timing the
+// kernels this CPU supports on synthetic data, once, before the first search. Set the
+// environment variable MULTIPART_SEARCH_KERNEL to a kernel name (e.g. "memmem") to skip the
+// timing and use that kernel for every length, e.g. for reproducible benchmarks.
+
+typedef enum {
+    MULTIPART_SEARCH_AUTO,    // Pick by timing.
+    MULTIPART_SEARCH_MEMMEM,  // libc memmem.
+    MULTIPART_SEARCH_MEMCHR,  // memchr for the last byte, then memcmp.
+    MULTIPART_SEARCH_SSE2,    // Filter on the first and last byte, 16 positions at a time.
+    MULTIPART_SEARCH_SSE42,   // pcmpestri on the first 16 bytes.
+    MULTIPART_SEARCH_AVX2,    // Filter on the first and last byte, 32 positions at a time.
+    MULTIPART_SEARCH_NUM_KERNELS,
+} MultipartSearchKernel;
+
+#define MULTIPART_SEARCH_NUM_CLASSES 3
+
+// Returns the first occurrence of needle in the length bytes of haystack, or NULL.
+const char* multipart_search(const char* haystack, size_t length, const char* needle, size_t needle_length);
+
+// Times the kernels and selects the fastest for each class, or applies MULTIPART_SEARCH_KERNEL
+// if it is set. Runs by itself before the first search; call it at startup to keep the timing
+// (about a millisecond) off the first request, or again to re-read the environment.
+void multipart_search_autotune(void);
+
+// Uses kernel for every boundary length, MULTIPART_SEARCH_AUTO runs multipart_search_autotune.
+// Returns: false if this CPU does not support kernel.
+bool multipart_search_set_kernel(MultipartSearchKernel kernel);
+
+// Returns the kernel used for boundaries of needle_length bytes, tuning first if needed.
+MultipartSearchKernel multipart_search_kernel(size_t needle_length);
+
+bool multipart_search_kernel_available(MultipartSearchKernel kernel);
+
+// Returns the name accepted by MULTIPART_SEARCH_KERNEL, e.g. "avx2".
+const char* multipart_search_kernel_name(MultipartSearchKernel kernel);
+
+// =============== Match API =========================
+// Aho-Corasick automaton over a set of byte patterns, e.g. WAF signatures. Every occurrence of
+// every pattern is found in a single pass whatever the number of patterns. Bytes that appear in
+// no pattern share a column of the transition table, so it stays small for text signatures.
+
+typedef struct MultipartMatcher {
+    uint8_t byte_class[256];  // Column of each byte in the transition table.
+    size_t num_classes;
+    uint32_t* next;           // num_states * num_classes transitions.
+    uint32_t* output;         // Pattern ending at each state or UINT32_MAX.
+    uint32_t* output_link;    // Next state on the suffix chain with an output, 0 if none.
+    uint32_t* pattern_next;   // Next identical pattern or UINT32_MAX.
+    size_t* lengths;          // Length of each pattern.
+    uint32_t num_states;
+    size_t num_patterns;
+    bool nocase;              // ASCII letters match regardless of case.
+} MultipartMatcher;
+
+// Receives the index of a pattern and the offset where it starts. Returning false stops the scan.
+typedef bool (*MultipartMatchCallback)(size_t pattern, size_t offset, void* userdata);
+
+// Builds the automaton for num_patterns patterns. lengths may be NULL for null-terminated
+// patterns. Empty patterns are rejected.
+// Returns: true on success, false on failure.
+bool multipart_matcher_init(MultipartMatcher* matcher, const char* const* patterns, const size_t* lengths,
+                            size_t num_patterns, bool nocase);
+
+// Reports every occurrence of a pattern in data, in order of their end offset.
+// Returns: false if callback stopped the scan, true otherwise.
+bool multipart_matcher_scan(const MultipartMatcher* matcher, const char* data, size_t size,
+                            MultipartMatchCallback callback, void* userdata);
+
+void multipart_matcher_free(MultipartMatcher* matcher);
+
+// =============== Sink API ==========================
+// A sink is a stage a file's bytes are pushed through. Stages are chained with next and a tee
+// fans out to several branches, e.g. digest -> tee(gzip -> fd, callback). multipart_sink_feed
+// pushes the file one MULTIPART_SINK_BLOCK_SIZE block at a time through the whole chain, so each
+// block is read from the body once and processed by every stage while it is still in cache.
+// Use multipart_sink_on_file as MultipartOptions.on_file to run a pipeline during parsing.
+//
+// Stages are structs embedding MultipartSink as their first member, initialized by their
+// multipart_*_sink_init function. Custom stages implement the three functions below.
+
+typedef struct MultipartSink {
+    // Starts a new file. A stage that fails must not call end on its successors.
+    bool (*begin)(struct MultipartSink* self, const FileHeader* file);
+
+    // Consumes the next bytes of the file.
+    bool (*write)(struct MultipartSink* self, const void* data, size_t size);
+
+    // Finishes the file. Called exactly once after a successful begin, with ok set to false if a
+    // write failed so the stage only releases its resources.
+    bool (*end)(struct MultipartSink* self, bool ok);
+
+    struct MultipartSink* next;  // Next stage or NULL.
+} MultipartSink;
+
+// Helpers for stage implementations that forward to self->next if there is one.
+bool multipart_sink_begin_next(MultipartSink* sink, const FileHeader* file);
+bool multipart_sink_write_next(MultipartSink* sink, const void* data, size_t size);
+bool multipart_sink_end_next(MultipartSink* sink, bool ok);
+
+// Pushes the bytes of file in body through sink.
+// Returns: true if every stage succeeded.
+bool multipart_sink_feed(MultipartSink* sink, const FileHeader* file, const char* body);
+
+// on_file callback for MultipartOptions that feeds each file to the sink passed as userdata.
+bool multipart_sink_on_file(const FileHeader* file, const char* body, void* userdata);
+
+// Computes the SHA-256 of the bytes passing through into digest.
+typedef struct MultipartDigestSink {
+    MultipartSink base;
+    MultipartSha256 ctx;
+    unsigned char digest[MULTIPART_DIGEST_SIZE];  // Valid after end.
+} MultipartDigestSink;
+
+void multipart_digest_sink_init(MultipartDigestSink* sink, MultipartSink* next);
+
+// Writes the bytes to a file descriptor. Terminal stage.
+typedef struct MultipartFdSink {
+    MultipartSink base;
+    int fd;
+    uint64_t written;  // Bytes written for the current file.
+} MultipartFdSink;
+
+void multipart_fd_sink_init(MultipartFdSink* sink, int fd);
+
+// Receives the bytes of file. Returning false fails the pipeline.
+typedef bool (*MultipartChunkCallback)(const FileHeader* file, const void* data, size_t size, void* userdata);
+
+// Hands the bytes to a user callback. Terminal stage.
+typedef struct MultipartCallbackSink {
+    MultipartSink base;
+    MultipartChunkCallback callback;
+    void* userdata;
+    const FileHeader* file;  // File being fed.
+} MultipartCallbackSink;
+
+void multipart_callback_sink_init(MultipartCallbackSink* sink, MultipartChunkCallback callback, void* userdata);
+
+// Forwards the bytes to every sink in sinks. Terminal stage.
+typedef struct MultipartTeeSink {
+    MultipartSink base;
+    MultipartSink** sinks;
+    size_t num_sinks;
+} MultipartTeeSink;
+
+void multipart_tee_sink_init(MultipartTeeSink* sink, MultipartSink** sinks, size_t num_sinks);
+
+// Compresses the bytes into a gzip stream with zlib.
+typedef struct MultipartGzipSink {
+    MultipartSink base;
+    int level;     // zlib compression level.
+    void* stream;  // z_stream of the current file.
+} MultipartGzipSink;
+
+void multipart_gzip_sink_init(MultipartGzipSink* sink, int level, MultipartSink* next);
+
+// =============== S3 API ============================
+
+// Connection settings of an S3-compatible object store, e.g. AWS S3 or MinIO.
+typedef struct MultipartS3Config {
+    const char* host;        // Endpoint host name or address, e.g. "127.0.0.1".
+    const char* port;        // Endpoint port, e.g. "9000".
+    const char* region;      // Region used in signatures, e.g. "us-east-1".
+    const char* access_key;  // Access key id.
+    const char* secret_key;  // Secret access key.
+    const char* bucket;      // Bucket, addressed path style (/bucket/key).
+    size_t part_size;        // Size of the uploaded parts. 0 uses MULTIPART_S3_PART_SIZE.
+    size_t min_part_size;    // Smallest part_size accepted. 0 uses MULTIPART_S3_MIN_PART_SIZE; lower it
+                             // only for stores without the S3 limit, such as test servers.
+    size_t max_parallel;     // Parts uploaded at the same time. 0 uses 4, at most MULTIPART_S3_MAX_PARALLEL.
+} MultipartS3Config;
+
+struct MultipartS3Sink;
+
+// One part upload in flight.
+typedef struct MultipartS3Upload {
+    pthread_t thread;
+    bool active;    // An upload was started and not joined yet.
+    bool threaded;  // The upload runs on thread (it ran inline if the thread could not be created).
+    bool ok;        // Result of the upload.
+    size_t part_number;
+    char* data;  // Part bytes, reused for later parts.
+    size_t size;
+    char etag[MULTIPART_S3_ETAG_SIZE];
+    const struct MultipartS3Sink* sink;
+} MultipartS3Upload;
+
+// Sink stage uploading each file to the object store with the S3 multipart upload protocol.
+// The file is cut into part_size parts as it is written and each part is PUT by a worker
+// thread, so the parts of a large file upload in parallel. Sinks are fed from on_file, once the
+// whole body has been received and the file parsed: uploading starts after the client has sent
+// the body, not while it is still sending it. The object key is key_prefix followed by the file
+// name. This is a final stage, next is not used.
+// A part_size below min_part_size fails begin before anything is uploaded: S3 would only reject
+// the small parts when the upload is completed.
+// On failure the multipart upload is aborted so the store drops the uploaded parts.
+typedef struct MultipartS3Sink {
+    MultipartSink base;
+    const MultipartS3Config* config;
+    const char* key_prefix;
+    size_t part_size;
+    size_t max_parallel;
+    char path[MULTIPART_S3_PATH_SIZE];  // URI-encoded /bucket/key of the current object.
+    char upload_id[MULTIPART_S3_UPLOAD_ID_SIZE];
+    char upload_id_encoded[MULTIPART_S3_UPLOAD_ID_SIZE * 3];
+    char* buffer;     // Part being filled.
+    size_t buffered;  // Bytes in buffer.
+    size_t num_parts;
+    char (*etags)[MULTIPART_S3_ETAG_SIZE];  // ETag of each part, by part number - 1.
+    size_t etags_capacity;
+    bool failed;  // A part upload failed.
+    MultipartS3Upload uploads[MULTIPART_S3_MAX_PARALLEL];
+} MultipartS3Sink;
+
+// Initializes an S3 sink. config and key_prefix (may be NULL) must outlive the sink.
+void multipart_s3_sink_init(MultipartS3Sink* sink, const MultipartS3Config* config, const char* key_prefix);
+
+// =============== Clamd API =========================
+
+typedef enum {
+    MULTIPART_SCAN_CLEAN,
+    MULTIPART_SCAN_INFECTED,
+    MULTIPART_SCAN_ERROR,  // No verdict: the daemon was unreachable, failed or the file was not complete.
+} MultipartScanResult;
+
+// Sink stage that virus-scans each file with clamd (or a daemon speaking its protocol) while
+// passing the bytes on to next, e.g. a MultipartFdSink saving it. The bytes are streamed over a
+// Unix socket with the INSTREAM command as they are written, so the scan overlaps saving the
+// file. Like every sink it is fed from on_file, after the whole body has been received and the
+// file parsed, so the scan does not overlap receiving. A file that is not reported clean fails
+// the pipeline: end returns false and next's end is called with ok set to false, so the saved
+// copy should be discarded.
+typedef struct MultipartClamdSink {
+    MultipartSink base;
+    char socket_path[MULTIPART_CLAMD_PATH_SIZE];  // Path of the daemon's socket.
+    int fd;                                       // Connection for the current file, -1 between files.
+    MultipartScanResult result;                   // Verdict for the last file, valid after end.
+    char signature[MULTIPART_CLAMD_REPLY_SIZE];   // Name of the signature found in an infected file.
+    char reply[MULTIPART_CLAMD_REPLY_SIZE];       // Last reply of the daemon.
+} MultipartClamdSink;
+
+// Initializes a clamd sink. socket_path may be NULL for MULTIPART_CLAMD_SOCKET.
+// Returns: false if socket_path is too long for a Unix socket address.
+bool multipart_clamd_sink_init(MultipartClamdSink* sink, const char* socket_path, MultipartSink* next);
+
+// =============== CSV API ===========================
+
+// A field of a CSV row, without quotes and with escaped quotes ("") turned into one quote.
+// data is not null-terminated and is only valid during the row callback.
+typedef struct MultipartCsvField {
+    const char* data;
+    size_t size;
+} MultipartCsvField;
+
+// Receives one row of file; row counts from 0 and includes any header row.
+// Returning false fails the pipeline.
+typedef bool (*MultipartCsvRowCallback)(const FileHeader* file, const MultipartCsvField* fields, size_t num_fields,
+                                        uint64_t row, void* userdata);
+
+// Sink stage that splits each file into CSV rows (RFC 4180: quoted fields may hold delimiters,
+// quotes and newlines; rows end with LF or CRLF) and calls callback for every row as the bytes
+// are fed to it, then passes the bytes on to next, which may be NULL. Like every sink it is fed
+// from on_file, after the whole body has been received and the file parsed, so rows are produced
+// after the upload, not during it; what it saves is a second read of the saved file. Blank lines are
+// skipped. A row longer than max_row_size or a file ending inside quotes fails the pipeline.
+typedef struct MultipartCsvSink {
+    MultipartSink base;
+    char delimiter;                    // Field delimiter, ',' by default.
+    MultipartCsvRowCallback callback;  // Row callback.
+    void* userdata;                    // Passed to callback.
+    size_t max_row_size;               // Longest row, MULTIPART_CSV_MAX_ROW_SIZE after init.
+    const FileHeader* file;            // File being fed.
+    uint64_t num_rows;                 // Rows passed to callback for the current file.
+
+    char* row;  // Unquoted bytes of the current row.
+    size_t row_size;
+    size_t row_capacity;
+    MultipartCsvField* fields;  // Fields of the current row.
+    size_t num_fields;
+    size_t fields_capacity;
+    bool in_quotes;      // Inside a quoted field.
+    bool after_quote;    // Right after a quote closing a quoted field, or escaping the next one.
+    bool field_quoted;   // The current field started with a quote.
+    bool unquoted_tail;  // The last byte of the row was not quoted.
+} MultipartCsvSink;
+
+// Initializes a CSV sink. delimiter may be 0 for ','.
+void multipart_csv_sink_init(MultipartCsvSink* sink, char delimiter, MultipartCsvRowCallback callback, void* userdata,
+                             MultipartSink* next);
+
+// =============== Encryption API ====================
+
+// Provides the AES-256 key to encrypt file with.
+// Returns: true if key was filled in, false to refuse saving the file.
+typedef bool (*MultipartKeyCallback)(const FileHeader* file, unsigned char key[MULTIPART_AES_KEY_SIZE],
+                                     void* userdata);
+
+// Save file encrypted with AES-256-GCM. Bytes are encrypted in MULTIPART_CRYPT_BLOCK_SIZE blocks
+// on their way from body to disk, so no plaintext copy is ever written.
+// The file is written as a random 12 byte IV, the ciphertext and the 16 byte GCM tag.
+// @param: get_key is called once to get the key for this file. userdata is passed to it.
+//
+// Returns: true on success, false on failure. A partially written file is removed.
+bool multipart_save_file_encrypted(const FileHeader* file, const char* body, const char* path,
+                                   MultipartKeyCallback get_key, void* userdata);
+
+// Encrypts the bytes with AES-256-GCM. The output is laid out as described for
+// multipart_save_file_encrypted.
+typedef struct MultipartEncryptSink {
+    MultipartSink base;
+    MultipartKeyCallback get_key;
+    void* userdata;  // Passed to get_key.
+    void* ctx;       // Cipher context of the current file.
+} MultipartEncryptSink;
+
+void multipart_encrypt_sink_init(MultipartEncryptSink* sink, MultipartKeyCallback get_key, void* userdata,
+                                 MultipartSink* next);
+
+// Reads and decrypts a file saved with multipart_save_file_encrypted.
+// On success, *data is a null-terminated buffer of *size bytes that must be freed by the caller.
+// Returns: false if the file can not be read or fails authentication.
+bool multipart_decrypt_file(const char* path, const unsigned char key[MULTIPART_AES_KEY_SIZE], char** data,
+                            size_t* size);
+
+// =============== Pack store API ====================
+// A pack store appends files into large segment files (segment-NNNNNN.pack) and records where
+// each one lives in an append-only index (index.pack), instead of creating a file per upload.
+// Index records carry a CRC; after a crash the damaged tail of the index is dropped and
+// bytes appended to the segment after the last indexed file are discarded.
+
+// Location and metadata of a stored file.
+typedef struct MultipartStoreEntry {
+    uint64_t id;                                 // Sequential id of the entry.
+    uint32_t segment;                            // Number of the segment file holding the bytes.
+    uint64_t offset;                             // Offset of the bytes in the segment.
+    uint64_t size;                               // Size of the file.
+    unsigned char digest[MULTIPART_DIGEST_SIZE];  // SHA-256 of the file.
+    char mimetype[MAX_MIMETYPE_SIZE];            // Content-Type of the file.
+} MultipartStoreEntry;
+
+typedef struct MultipartStore {
+    char dir[MULTIPART_STORE_DIR_SIZE];  // Directory holding the segments and the index.
+    size_t segment_size;                 // Size after which a new segment is started.
+    size_t sync_every;                   // Number of puts batched into one fsync.
+
+    int index_fd;             // Append-only index file.
+    int segment_fd;           // Segment currently appended to.
+    uint32_t segment;         // Number of the current segment.
+    uint64_t segment_offset;  // End of the last stored file in the current segment.
+
+    MultipartStoreEntry* entries;  // All entries, indexed by id.
+    size_t num_entries;
+    size_t entries_capacity;
+
+    unsigned char* pending;  // Encoded index records not yet written to the index.
+    size_t pending_size;
+    size_t pending_capacity;
+    size_t num_pending;
+
+    uint64_t index_size;  // Length of the index up to the last synced record.
+
+    pthread_mutex_t lock;  // Serializes puts from multiple threads.
+} MultipartStore;
+
+// Opens (or creates) a pack store in dir and recovers its index.
+// @param: segment_size is the segment rollover size, 0 for MULTIPART_STORE_SEGMENT_SIZE.
+// @param: sync_every is the number of puts after which data and index are synced. 0 or 1 syncs every put.
+//
+// Returns: true on success, false on failure.
+bool multipart_store_open(MultipartStore* store, const char* dir, size_t segment_size, size_t sync_every);
+
+// Appends file to the store. If id is not NULL, it is set to the id of the new entry.
+// The file is durable once the batch it belongs to is synced (see sync_every and multipart_store_sync).
+// Safe to call from multiple threads.
+// Returns: false if the file was not stored. Once stored, a failed sync of its batch does not fail
+// the put: the records stay pending and the error is reported by the next multipart_store_sync.
+bool multipart_store_put(MultipartStore* store, const FileHeader* file, const char* body, uint64_t* id);
+
+// Syncs pending puts to disk.
+bool multipart_store_sync(MultipartStore* store);
+
+// Copies the entry with the given id into entry. Returns false if there is no such entry.
+bool multipart_store_get(MultipartStore* store, uint64_t id, MultipartStoreEntry* entry);
+
+// Reads the bytes of entry into buffer, which must hold at least entry->size bytes.
+bool multipart_store_read(const MultipartStore* store, const MultipartStoreEntry* entry, char* buffer);
+
+// Syncs pending puts and releases the resources of the store.
+void multipart_store_close(MultipartStore* store);
+
+// =============== Body buffer API ===================
+
+// Buffer for receiving a request body before parsing it. Grows in place with mremap instead of
+// realloc's copy, uses transparent huge pages once large, and can be reset for the next request.
+typedef struct MultipartBodyBuffer {
+    char* data;       // Received bytes, pass data and size to multipart_parse_form.
+    size_t size;      // Number of bytes received.
+    size_t capacity;  // Size of the mapping.
+} MultipartBodyBuffer;
+
+// Maps a buffer of at least capacity bytes, or MULTIPART_BODY_INITIAL_SIZE if capacity is 0.
+// Pass the Content-Length, when known, to avoid growing.
+//
+// Returns: true on success, false on failure.
+bool multipart_body_init(MultipartBodyBuffer* buffer, size_t capacity);
+
+// Makes room for extra more bytes, e.g. before a recv into the returned pointer.
+// data may move; earlier pointers into the buffer are invalid afterwards. A zeroed or freed
+// buffer is mapped again, so it does not need multipart_body_init.
+//
+// Returns: a pointer to the end of the received bytes, or NULL on failure.
+char* multipart_body_reserve(MultipartBodyBuffer* buffer, size_t extra);
+
+// Adds size bytes written at the pointer returned by multipart_body_reserve to the body.
+void multipart_body_commit(MultipartBodyBuffer* buffer, size_t size);
+
+// Appends size bytes from data to the body.
+//
+// Returns: true on success, false on failure.
+bool multipart_body_append(MultipartBodyBuffer* buffer, const void* data, size_t size);
+
+// Empties the buffer for the next request. The address space is kept, but memory beyond the
+// first MULTIPART_BODY_INITIAL_SIZE bytes is returned to the kernel with MADV_DONTNEED.
+void multipart_body_reset(MultipartBodyBuffer* buffer);
+
+// Unmaps the buffer.
+void multipart_body_free(MultipartBodyBuffer* buffer);
+
+// =============== Decode API ========================
+// Decompresses a body sent with a Content-Encoding into a MultipartBodyBuffer as it is received,
+// so the compressed body is never buffered and the parser gets the decompressed bytes.
+// Every MULTIPART_DECODE_CHUNK_SIZE bytes of output are checked against max_size and against
+// max_ratio times the compressed bytes consumed, so a decompression bomb fails after at most one
+// chunk past the limit instead of after filling memory.
+// zstd is supported when built with MULTIPART_WITH_ZSTD (make WITH_ZSTD=1).
+
+typedef enum {
+    MULTIPART_ENCODING_IDENTITY,
+    MULTIPART_ENCODING_GZIP,
+    MULTIPART_ENCODING_DEFLATE,  // zlib-wrapped, or raw deflate as sent by some clients.
+    MULTIPART_ENCODING_ZSTD,
+    MULTIPART_ENCODING_UNSUPPORTED,
+} MultipartEncoding;
+
+typedef struct MultipartDecoder {
+    MultipartEncoding encoding;
+    MultipartBodyBuffer* body;  // Receives the decompressed bytes.
+    size_t max_ratio;           // Maximum decompressed / compressed size.
+    size_t max_size;            // Maximum decompressed size, 0 for no limit.
+    uint64_t consumed;          // Compressed bytes consumed so far.
+    void* stream;               // z_stream or ZSTD_DStream.
+    bool started;               // Whether the stream has been initialized.
+    unsigned char header[2];    // First bytes of a deflate stream, held until the wrapper is known.
+    size_t header_size;
+    bool finished;              // Whether the compressed stream is complete.
+} MultipartDecoder;
+
+// Maps a Content-Encoding header value (NULL if absent) to an encoding.
+// Several codings applied in a row are reported as MULTIPART_ENCODING_UNSUPPORTED.
+MultipartEncoding multipart_parse_content_encoding(const char* header);
+
+// Prepares decoder to append to body, which must have been initialized with multipart_body_init.
+// max_ratio 0 means MULTIPART_DECODE_MAX_RATIO, max_size 0 means no limit on the size.
+//
+// Returns: true on success, false if the encoding is not supported or on allocation failure.
+bool multipart_decoder_init(MultipartDecoder* decoder, MultipartEncoding encoding, MultipartBodyBuffer* body,
+                            size_t max_ratio, size_t max_size);
+
+// Decompresses the next size bytes of the received body into decoder->body.
+//
+// Returns: MULTIPART_OK, DECODE_FAILED for invalid data, DECODE_LIMIT_EXCEEDED, MEMORY_ALLOC_ERROR or
+// UNSUPPORTED_ENCODING.
+MultipartCode multipart_decoder_write(MultipartDecoder* decoder, const void* data, size_t size);
+
+// Checks that the compressed body was complete once all of it has been written.
+MultipartCode multipart_decoder_finish(MultipartDecoder* decoder);
+
+// Releases the decompression state. The body buffer is left to the caller.
+void multipart_decoder_free(MultipartDecoder* decoder);
+
+// Decompresses a whole body into body according to content_encoding (the header value or NULL).
+// Returns: UNSUPPORTED_ENCODING for a coding that is not supported or not compiled in (answer with
+// 415 Unsupported Media Type), otherwise as multipart_decoder_write and multipart_decoder_finish.
+MultipartCode multipart_decode_body(const char* content_encoding, const void* data, size_t size,
+                                    MultipartBodyBuffer* body, size_t max_ratio, size_t max_size);
+
+// =============== Context pool API ==================
+// A fixed set of parser contexts that threads acquire for a request and release afterwards, so
+// the arrays of the form and the body buffer stay allocated and warm across requests whichever
+// thread serves them. Acquire and release are lock-free. Matchers are read-only while scanning
+// and can be shared by all contexts through MultipartOptions.
+
+typedef struct MultipartContext {
+    _Alignas(64) MultipartForm form;  // Parse into this form. Emptied on release, its arrays are kept.
+    MultipartBodyBuffer body;         // Receive buffer, reset on release. Mapped on first use without body_capacity.
+    void* userdata;                   // Per-context state set up by the pool's init callback, e.g. sinks.
+    _Atomic uint32_t next;            // Free list link, internal.
+} MultipartContext;
+
+// Sets up or tears down the userdata of a context. userdata is the pool's.
+typedef bool (*MultipartContextInit)(MultipartContext* context, void* userdata);
+typedef void (*MultipartContextDestroy)(MultipartContext* context, void* userdata);
+
+typedef struct MultipartContextPool {
+    MultipartContext* contexts;  // All contexts, acquired or not.
+    size_t num_contexts;
+    _Atomic uint64_t head;  // Free list: generation << 32 | index + 1 of the top context, 0 if empty.
+    MultipartContextDestroy destroy;
+    void* userdata;
+} MultipartContextPool;
+
+// Creates num_contexts contexts. With body_capacity > 0 each gets a body buffer of that capacity.
+// init and destroy may be NULL; destroy is called by multipart_context_pool_free on every context
+// init succeeded on.
+// Returns: false on allocation failure or if init failed.
+bool multipart_context_pool_init(MultipartContextPool* pool, size_t num_contexts, size_t body_capacity,
+                                 MultipartContextInit init, MultipartContextDestroy destroy, void* userdata);
+
+// Takes a free context. Safe to call from any thread.
+// Returns: NULL if every context is in use.
+MultipartContext* multipart_context_acquire(MultipartContextPool* pool);
+
+// Returns a context to the pool, from any thread. Do not call multipart_free_form on its form,
+// release empties it and keeps its capacity.
+void multipart_context_release(MultipartContextPool* pool, MultipartContext* context);
+
+// Frees every context. None may be in use.
+void multipart_context_pool_free(MultipartContextPool* pool);
+
+// =============== Retry cache API ===================
+// Clients retrying an upload after a timeout send the same body again. A retry cache keeps
+// the forms of recent bodies, keyed by SHA-256 over the body and boundary, together with
+// where their files were saved, so a retried request is neither parsed nor saved again.
+
+typedef struct MultipartCacheEntry {
+    unsigned char digest[MULTIPART_DIGEST_SIZE];  // Key: SHA-256 of body and boundary.
+    MultipartForm form;                           // Copy of the parsed form.
+    char (*paths)[MULTIPART_CACHE_PATH_SIZE];     // Saved location of each file, empty if not recorded.
+    struct MultipartCacheEntry* hash_next;
+    struct MultipartCacheEntry* lru_prev;
+    struct MultipartCacheEntry* lru_next;
+} MultipartCacheEntry;
+
+typedef struct MultipartRetryCache {
+    pthread_mutex_t lock;
+    MultipartCacheEntry** buckets;  // Hash table, num_buckets is a power of two.
+    size_t num_buckets;
+    MultipartCacheEntry* lru_head;  // Most recently used.
+    MultipartCacheEntry* lru_tail;  // Evicted first.
+    size_t num_entries;
+    size_t max_entries;
+    size_t hits;    // Forms copied out of the cache.
+    size_t misses;  // Forms parsed and cached.
+} MultipartRetryCache;
+
+// Initializes a cache holding at most max_entries forms.
+//
+// Returns: true on success, false on failure.
+bool multipart_cache_init(MultipartRetryCache* cache, size_t max_entries);
+
+// Parses body like multipart_parse_form, unless the same body was parsed before with the same
+// boundary, in which case form is a copy of the earlier result. Successful parses are cached.
+// @param: digest receives the cache key of the body, for multipart_cache_record_path/saved_path.
+// @param: hit is set to true if the form came from the cache.
+MultipartCode multipart_cache_parse(MultipartRetryCache* cache, const char* body, size_t size, char* boundary,
+                                    MultipartForm* form, unsigned char digest[MULTIPART_DIGEST_SIZE], bool* hit);
+
+// Records that file number file_index of the body with this digest was saved at path.
+//
+// Returns: false if the entry has been evicted, file_index is out of range or path is
+// MULTIPART_CACHE_PATH_SIZE or longer.
+bool multipart_cache_record_path(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                                 size_t file_index, const char* path);
+
+// Copies where file number file_index of the body with this digest was saved into path.
+//
+// Returns: true if a location was recorded (and fits in path_size), false otherwise.
+bool multipart_cache_saved_path(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                                size_t file_index, char* path, size_t path_size);
+
+// Frees all entries.
+void multipart_cache_free(MultipartRetryCache* cache);
+
+// =============== Stream API ========================
+
+// Read handle over a file part. The bytes are either in memory (the body buffer) or at an
+// offset in a file descriptor (a spool file or a memfd); readers do not need to know which.
+typedef struct MultipartStream {
+    const char* data;   // The part's bytes when they are in memory, otherwise NULL.
+    int fd;             // File holding the part when data is NULL. Not owned by the stream.
+    off_t base;         // Offset of the part's first byte in fd.
+    size_t size;        // Size of the part.
+    size_t pos;         // Position of multipart_stream_read and the FILE* adapter.
+    void* map;          // Mapping created by multipart_stream_map for fd backed streams.
+    size_t map_size;    // Length of map.
+    size_t map_offset;  // Offset of the part's first byte in map.
+} MultipartStream;
+
+// Opens a stream over a file part in the body buffer. The body must outlive the stream.
+void multipart_stream_from_body(MultipartStream* stream, const FileHeader* file, const char* body);
+
+// Opens a stream over a file part of a body stored at body_offset in fd, e.g. a spool file or a memfd.
+void multipart_stream_from_fd(MultipartStream* stream, const FileHeader* file, int fd, off_t body_offset);
+
+// Reads up to size bytes at the stream position and advances it.
+// Returns: the number of bytes read, 0 at the end of the part or -1 on error.
+ssize_t multipart_stream_read(MultipartStream* stream, void* buf, size_t size);
+
+// Reads up to size bytes at offset in the part without moving the stream position.
+// Returns: the number of bytes read, 0 at the end of the part or -1 on error.
+ssize_t multipart_stream_pread(MultipartStream* stream, void* buf, size_t size, size_t offset);
+
+// Returns the part's bytes as one contiguous read-only buffer of stream->size bytes: the body
+// buffer itself, or a mapping of the file that lives until multipart_stream_close.
+// Returns: NULL if the file can not be mapped.
+const char* multipart_stream_map(MultipartStream* stream);
+
+// Returns a read-only, seekable FILE* over the stream for libraries that take one. It shares
+// the stream position. fclose it before closing the stream.
+FILE* multipart_stream_fopen(MultipartStream* stream);
+
+// Releases the mapping made by multipart_stream_map, if any. Does not close fd.
+void multipart_stream_close(MultipartStream* stream);
+
+// =============== Save scheduler API ================
+// Saves files of many concurrent uploads on a pool of workers. Every upload gets its own queue
+// and queues are served by deficit round robin over bytes: large files are written in
+// MULTIPART_SCHED_SLICE_SIZE slices interleaved with other uploads, so a huge file does not
+// delay small forms, while small files of one upload are batched into a single turn. At most
+// max_inflight batches are written to one device (st_dev) at a time.
+
+// Called when a scheduled save has completed, from a worker thread (or from
+// multipart_sched_save for empty files). ok is false if the file could not be written.
+typedef void (*MultipartSaveCallback)(const FileHeader* file, const char* path, bool ok, void* userdata);
+
+struct MultipartSaveQueue;
+
+typedef struct MultipartSaveJob {
+    const FileHeader* file;
+    const char* body;
+    char* path;
+    int fd;
+    dev_t dev;       // Device of the file, for the in-flight limit.
+    size_t claimed;  // Bytes handed to workers.
+    size_t written;  // Bytes whose write has completed.
+    size_t inflight;  // Slices being written.
+    bool failed;
+    MultipartSaveCallback done;
+    void* userdata;
+    struct MultipartSaveQueue* queue;
+    struct MultipartSaveJob* next;
+} MultipartSaveJob;
+
+// Queue of one upload.
+typedef struct MultipartSaveQueue {
+    MultipartSaveJob* head;  // Jobs with bytes not yet claimed.
+    MultipartSaveJob* tail;
+    size_t num_jobs;         // Jobs not completed yet.
+    unsigned int weight;     // Share of the bandwidth relative to other queues.
+    size_t deficit;          // Bytes the queue may still write in this round.
+    bool released;           // Freed once num_jobs drops to zero.
+    struct MultipartSaveQueue* prev;      // Ring of queues with work, NULL when idle.
+    struct MultipartSaveQueue* next;
+    struct MultipartSaveQueue* all_next;  // All queues of the scheduler.
+} MultipartSaveQueue;
+
+typedef struct MultipartSaveScheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // Signalled when work is queued or a device has room.
+    pthread_cond_t idle;  // Signalled when pending drops to zero.
+    pthread_t workers[MULTIPART_SCHED_MAX_WORKERS];
+    size_t num_workers;
+    size_t max_inflight;  // Batches written at once per device.
+    size_t slice_size;
+    MultipartSaveQueue* cursor;  // Next queue in the round.
+    size_t num_active;           // Queues in the ring.
+    MultipartSaveQueue* queues;
+    size_t pending;  // Jobs not completed yet.
+    bool stopping;
+    struct {
+        dev_t dev;
+        size_t inflight;
+    } devices[MULTIPART_SCHED_MAX_DEVICES];
+    size_t num_devices;
+} MultipartSaveScheduler;
+
+// Starts a scheduler with num_workers threads (0 for 4) writing at most max_inflight (0 for 2)
+// batches to the same device at a time.
+//
+// Returns: true on success, false on failure.
+bool multipart_sched_init(MultipartSaveScheduler* sched, size_t num_workers, size_t max_inflight);
+
+// Creates the queue of an upload. A weight of 2 gets twice the bandwidth of a weight of 1 (0 means 1).
+// Returns: the queue, or NULL on failure.
+MultipartSaveQueue* multipart_sched_queue(MultipartSaveScheduler* sched, unsigned int weight);
+
+// Releases a queue. Its queued saves still complete; the queue is freed after the last one.
+void multipart_sched_queue_release(MultipartSaveScheduler* sched, MultipartSaveQueue* queue);
+
+// Queues saving file to path. The file is created right away; file, body and userdata must stay
+// valid until done is called.
+//
+// Returns: true if the save was queued, false if the file could not be created.
+bool multipart_sched_save(MultipartSaveScheduler* sched, MultipartSaveQueue* queue, const FileHeader* file,
+                          const char* body, const char* path, MultipartSaveCallback done, void* userdata);
+
+// Waits until every queued save has completed.
+void multipart_sched_wait(MultipartSaveScheduler* sched);
+
+// Waits for queued saves, stops the workers and frees all queues.
+void multipart_sched_destroy(MultipartSaveScheduler* sched);
+
+// =============== Pipe API ==========================
+
+// Writes the file's bytes into pipe_fd, e.g. the stdin of a subprocess. The body's pages are
+// spliced into the pipe with vmsplice instead of copied, so body must not be modified or freed
+// until the reader has consumed the data. Non-blocking pipes are waited on with poll. If pipe_fd
+// is not a pipe, the bytes are written normally. The caller handles SIGPIPE.
+//
+// Returns: true on success, false on failure.
+bool multipart_pipe_file(const FileHeader* file, const char* body, int pipe_fd);
+
+// Like multipart_pipe_file for a body spooled to a file: the bytes at body_offset + file->offset
+// in body_fd are moved into pipe_fd with splice, falling back to pread/write.
+//
+// Returns: true on success, false on failure.
+bool multipart_pipe_file_from_fd(const FileHeader* file, int body_fd, off_t body_offset, int pipe_fd);
+
+// Runs argv (searched in PATH) with the file on its stdin, and waits for it to exit. SIGPIPE is
+// blocked while feeding, so a command that exits early makes this fail instead of killing the caller.
+// @param: exit_status if not NULL receives the waitpid status of the command.
+//
+// Returns: true if the command read the whole file and exited with status 0, false otherwise.
+bool multipart_pipe_file_to_command(const FileHeader* file, const char* body, char* const argv[], int* exit_status);
+
+// =============== Proxy API =========================
+// Forwards a multipart body while dropping or rewriting some of its parts, without parsing it
+// into a form and encoding it again. Only the part framing is parsed; the output uses the same
+// boundary, so the Content-Type of the request does not change (its Content-Length does).
+
+typedef enum {
+    MULTIPART_PROXY_KEEP,     // Forward the part unchanged.
+    MULTIPART_PROXY_DROP,     // Leave the part out.
+    MULTIPART_PROXY_REPLACE,  // Forward the part's headers with new content.
+    MULTIPART_PROXY_ABORT,    // Stop with CALLBACK_ABORTED.
+} MultipartProxyAction;
+
+// A part of the body being proxied.
+typedef struct MultipartProxyPart {
+    const char* name;      // name parameter of Content-Disposition, empty if missing.
+    const char* filename;  // filename parameter of Content-Disposition, NULL for fields.
+    const char* headers;   // Raw header lines of the part in the body, each ending with CRLF.
+    size_t headers_size;   // Size of headers.
+    size_t offset;         // Offset of the content from the body of request.
+    size_t size;           // Size of the content, without the CRLF that precedes the next boundary.
+    size_t index;          // Position of the part in the body.
+} MultipartProxyPart;
+
+// Decides what happens to part. For MULTIPART_PROXY_REPLACE, set *data and *size to the new content,
+// which must stay valid until multipart_proxy_form returns.
+typedef MultipartProxyAction (*MultipartProxyCallback)(const MultipartProxyPart* part, const char** data, size_t* size,
+                                                       void* userdata);
+
+// Writes body to out_fd with each part kept, dropped or replaced as callback decides. Kept bytes are
+// gathered into writev calls straight from the body. When the body was received into a file, pass its
+// descriptor as body_fd (and the offset at which the body starts) so the content of kept files is moved
+// with splice (out_fd is a pipe) or sendfile (e.g. a socket) instead; otherwise pass -1.
+// Output is written as the body is traversed, so out_fd may have received part of the body when an
+// error is returned.
+//
+// Returns: MULTIPART_OK, INVALID_FORM_BOUNDARY, FIELD_NAME_TOO_LONG, FILENAME_TOO_LONG,
+// CALLBACK_ABORTED or OUTPUT_WRITE_FAILED.
+MultipartCode multipart_proxy_form(const char* body, size_t size, const char* boundary, int out_fd, int body_fd,
+                                   off_t body_offset, MultipartProxyCallback callback, void* userdata);
+
+// =============== Byte ranges API ===================
+// Parses multipart/byteranges responses, as sent for Range requests with several ranges. Get the
+// boundary with multipart_parse_boundary_for_type(content_type, "multipart/byteranges", ...) from the
+// response's Content-Type.
+
+// One range of the response. offset and size locate its bytes in the body like a FileHeader's.
+typedef struct MultipartByteRange {
+    size_t offset;                         // Offset of the range's bytes from the body of the response.
+    size_t size;                           // Number of bytes, last - first + 1.
+    uint64_t first;                        // Position of the first byte in the representation.
+    uint64_t last;                         // Position of the last byte, inclusive.
+    uint64_t complete_length;              // Length of the representation, 0 if the server sent "*".
+    char content_type[MAX_MIMETYPE_SIZE];  // Content-Type of the part, empty if missing.
+} MultipartByteRange;
+
+typedef struct MultipartByteRanges {
+    MultipartByteRange* ranges;  // Ranges in the order of the body.
+    size_t num_ranges;
+    size_t capacity;
+} MultipartByteRanges;
+
+// Parses a multipart/byteranges body into ranges without copying any range bytes. Each part must
+// have a Content-Range header whose length matches its bytes, otherwise INVALID_CONTENT_RANGE.
+// ranges must be freed with multipart_free_byteranges on success.
+MultipartCode multipart_parse_byteranges(const char* data, size_t size, const char* boundary,
+                                         MultipartByteRanges* ranges);
+
+void multipart_free_byteranges(MultipartByteRanges* ranges);
+
+// =============== Related API =======================
+// Parses multipart/related bodies (RFC 2387), e.g. SOAP messages with MTOM/XOP attachments,
+// where the root part refers to the others by Content-ID. Parts are indexed by Content-ID in a
+// hash table, so resolving a reference does not scan the parts. Get the boundary with
+// multipart_parse_boundary_for_type(content_type, "multipart/related", ...).
+
+typedef struct MultipartRelatedPart {
+    size_t offset;                               // Offset of the part's bytes from the body.
+    size_t size;                                 // Number of bytes in the part.
+    size_t headers_offset;                       // Offset of the part's header lines, each ending with CRLF.
+    size_t headers_size;                         // Size of the header lines.
+    char content_id[MULTIPART_CONTENT_ID_SIZE];  // Content-ID without the angle brackets, empty if missing.
+    char content_type[MAX_MIMETYPE_SIZE];        // Content-Type of the part, empty if missing.
+} MultipartRelatedPart;
+
+typedef struct MultipartRelated {
+    MultipartRelatedPart* parts;  // Parts in the order of the body.
+    size_t num_parts;
+    size_t capacity;
+    uint32_t* index;              // Open-addressed table of part index + 1 by Content-ID, 0 is an empty slot.
+    size_t index_size;            // Number of slots, a power of two.
+} MultipartRelated;
+
+// Parses a multipart/related body into parts without copying any part bytes. Content-IDs must
+// be unique, otherwise DUPLICATE_CONTENT_ID. Parts without a Content-ID are kept but not indexed.
+// related must be freed with multipart_free_related on success.
+MultipartCode multipart_parse_related(const char* data, size_t size, const char* boundary, MultipartRelated* related);
+
+// Finds the part with the given Content-ID. content_id may be bare ("id@host"), in angle brackets
+// ("<id@host>") or a cid: URL ("cid:id%40host") as found in XOP Include hrefs.
+// Returns NULL if no part has this Content-ID.
+const MultipartRelatedPart* multipart_related_find(const MultipartRelated* related, const char* content_id);
+
+// Returns the root part: the one named by start, the start parameter of the Content-Type, or the
+// first part if start is NULL or empty. Returns NULL if there is no such part.
+const MultipartRelatedPart* multipart_related_root(const MultipartRelated* related, const char* start);
+
+void multipart_free_related(MultipartRelated* related);
+
+// =============== JSON API ==========================
+
+// Writes the metadata of form as JSON into buf without allocating:
+// {"fields":[{"name":...,"value":...}],"files":[{"field_name":...,"filename":...,"mimetype":...,
+// "offset":...,"size":...}]}, with "tree_hash" in hex added to files that have one.
+// Bytes of names and values that are not valid UTF-8 are written as U+FFFD.
+// Returns the length of the JSON like snprintf: when it is >= size, the output was truncated and
+// a buffer of the returned length + 1 holds it. buf is always null-terminated if size > 0.
+size_t multipart_form_to_json(const MultipartForm* form, char* buf, size_t size);
+
+// =============== Tar API ===========================
+// Writes a form as a ustar archive: each file becomes files/<n>/<filename> and all fields are
+// stored urlencoded in a single "fields" entry at the end of the archive. Filenames longer than
+// the 100 byte ustar name field are recorded in a pax extended header.
+// To archive a form while it is parsed, pass multipart_tar_add_field and multipart_tar_add_file
+// as on_field and on_file in MultipartOptions with the sink as userdata, then call multipart_tar_finish.
+
+typedef struct MultipartTarSink {
+    int fd;             // Archive output.
+    int body_fd;        // File holding the request body or -1 if the body is only in memory.
+    off_t body_offset;  // Offset of the request body in body_fd.
+    time_t mtime;       // Modification time of the entries.
+    uint64_t written;   // Bytes written to fd so far.
+    size_t num_files;   // Files archived so far.
+
+    char* fields;  // urlencoded fields, written by multipart_tar_finish.
+    size_t fields_size;
+    size_t fields_capacity;
+} MultipartTarSink;
+
+// Initializes sink to write to fd.
+// When the body was received into a file, pass its descriptor as body_fd (and the offset at which the body
+// starts) so file bytes are copied with copy_file_range/sendfile instead of write.
+void multipart_tar_open(MultipartTarSink* sink, int fd, int body_fd, off_t body_offset);
+
+// Appends a file entry. userdata is the MultipartTarSink.
+bool multipart_tar_add_file(const FileHeader* file, const char* body, void* userdata);
+
+// Records a field for the fields entry. userdata is the MultipartTarSink.
+bool multipart_tar_add_field(const FormField* field, void* userdata);
+
+// Writes the fields entry and the end of archive marker and releases the sink.
+bool multipart_tar_finish(MultipartTarSink* sink);
+
+// Writes an already parsed form as a tar archive to fd. See multipart_tar_open for body_fd and body_offset.
+bool multipart_tar_write_form(const MultipartForm* form, const char* body, int fd, int body_fd, off_t body_offset);
+
+// Save file like multipart_save_file but bypassing the page cache with O_DIRECT, so saving
+// multi-GB uploads does not evict hot data. Blocks are written straight from the body when the
+// file's bytes are aligned, otherwise through an aligned bounce buffer.
+// If the filesystem does not support O_DIRECT, the file is written buffered instead; with
+// drop_cache set, each written window is then flushed and dropped with posix_fadvise(DONTNEED).
+//
+// Returns: true on success, false on failure.
+bool multipart_save_file_direct(const FileHeader* file, const char* body, const char* path, bool drop_cache);
+
+// Save file like multipart_save_file but skipping MULTIPART_SPARSE_BLOCK_SIZE blocks that are all
+// zeros, which leaves holes in the saved file. Disk and VM images that are mostly zeros then take
+// a fraction of the writes and space.
+// @param: hole_bytes if not NULL receives the number of bytes that were skipped.
+//
+// Returns: true on success, false on failure.
+bool multipart_save_file_sparse(const FileHeader* file, const char* body, const char* path, size_t* hole_bytes);
+
 // A simple implementation of strstr that takes a length parameter.
 // and does not search beyond the length. This avoids dependence on
 // both the haystack and needle being null-terminated.
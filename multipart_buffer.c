@@ -0,0 +1,115 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_buffer.c                                                               #
+// Growable buffer for receiving request bodies. Memory comes straight from mmap and is   #
+// grown with mremap, which moves page table entries instead of copying the bytes.        #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+static size_t round_to_page(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Large bodies are backed by transparent huge pages to cut TLB misses while scanning for boundaries.
+static void advise_hugepages(MultipartBodyBuffer* buffer) {
+#ifdef MADV_HUGEPAGE
+    if (buffer->capacity >= MULTIPART_BODY_HUGEPAGE_THRESHOLD)
+        madvise(buffer->data, buffer->capacity, MADV_HUGEPAGE);
+#else
+    (void)buffer;
+#endif
+}
+
+bool multipart_body_init(MultipartBodyBuffer* buffer, size_t capacity) {
+    memset(buffer, 0, sizeof(MultipartBodyBuffer));
+    if (capacity == 0)
+        capacity = MULTIPART_BODY_INITIAL_SIZE;
+    capacity = round_to_page(capacity);
+
+    void* data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to map body buffer");
+        return false;
+    }
+
+    buffer->data = (char*)data;
+    buffer->capacity = capacity;
+    advise_hugepages(buffer);
+    return true;
+}
+
+char* multipart_body_reserve(MultipartBodyBuffer* buffer, size_t extra) {
+    if (buffer->data && extra <= buffer->capacity - buffer->size)
+        return buffer->data + buffer->size;
+
+    size_t needed = buffer->size + extra;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (needed < buffer->size || needed > SIZE_MAX - page) {
+        fprintf(stderr, "Body buffer size overflow\n");
+        return NULL;
+    }
+
+    // A zeroed or freed buffer starts over at the initial size.
+    size_t capacity = buffer->data ? buffer->capacity : MULTIPART_BODY_INITIAL_SIZE;
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2) {
+            capacity = needed;
+            break;
+        }
+        capacity *= 2;
+    }
+    capacity = round_to_page(capacity);
+
+    void* data;
+    if (buffer->data)
+        data = mremap(buffer->data, buffer->capacity, capacity, MREMAP_MAYMOVE);
+    else
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to grow body buffer");
+        return NULL;
+    }
+
+    buffer->data = (char*)data;
+    buffer->capacity = capacity;
+    advise_hugepages(buffer);
+    return buffer->data + buffer->size;
+}
+
+void multipart_body_commit(MultipartBodyBuffer* buffer, size_t size) {
+    buffer->size += size;
+}
+
+bool multipart_body_append(MultipartBodyBuffer* buffer, const void* data, size_t size) {
+    char* dst = multipart_body_reserve(buffer, size);
+    if (!dst)
+        return false;
+    memcpy(dst, data, size);
+    buffer->size += size;
+    return true;
+}
+
+void multipart_body_reset(MultipartBodyBuffer* buffer) {
+    // Keep the address space for the next body but give its pages back. The first
+    // MULTIPART_BODY_INITIAL_SIZE bytes stay resident since most bodies are small.
+    size_t keep = round_to_page(MULTIPART_BODY_INITIAL_SIZE);
+    if (buffer->capacity > keep)
+        madvise(buffer->data + keep, buffer->capacity - keep, MADV_DONTNEED);
+    buffer->size = 0;
+}
+
+void multipart_body_free(MultipartBodyBuffer* buffer) {
+    if (buffer->data)
+        munmap(buffer->data, buffer->capacity);
+    memset(buffer, 0, sizeof(MultipartBodyBuffer));
+}
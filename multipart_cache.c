@@ -0,0 +1,197 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_cache.c                                                                #
+// Bounded LRU cache of parsed forms keyed by the digest of the request body, so a        #
+// client retrying an identical upload gets the earlier result without the body being     #
+// parsed again or its files being saved twice.                                           #
+//=========================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multipart.h"
+
+// The key covers the boundary too: the same bytes split on another boundary are another form.
+static bool cache_key(const char* body, size_t size, const char* boundary,
+                      unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    MultipartSha256 ctx;
+    if (!multipart_sha256_init(&ctx))
+        return false;
+    bool ok = multipart_sha256_update(&ctx, body, size) && multipart_sha256_update(&ctx, boundary, strlen(boundary));
+    return multipart_sha256_final(&ctx, digest) && ok;
+}
+
+static size_t bucket_of(const MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    return (size_t)(h & (cache->num_buckets - 1));
+}
+
+static MultipartCacheEntry* lookup(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    MultipartCacheEntry* entry = cache->buckets[bucket_of(cache, digest)];
+    while (entry && memcmp(entry->digest, digest, MULTIPART_DIGEST_SIZE) != 0)
+        entry = entry->hash_next;
+    return entry;
+}
+
+static void lru_unlink(MultipartRetryCache* cache, MultipartCacheEntry* entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(MultipartRetryCache* cache, MultipartCacheEntry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail)
+        cache->lru_tail = entry;
+}
+
+static void free_entry(MultipartCacheEntry* entry) {
+    free(entry->paths);
+    multipart_free_form(&entry->form);
+    free(entry);
+}
+
+static void evict(MultipartRetryCache* cache, MultipartCacheEntry* entry) {
+    MultipartCacheEntry** p = &cache->buckets[bucket_of(cache, entry->digest)];
+    while (*p != entry)
+        p = &(*p)->hash_next;
+    *p = entry->hash_next;
+
+    lru_unlink(cache, entry);
+    cache->num_entries--;
+    free_entry(entry);
+}
+
+// Adds a copy of form. Failures only mean the next retry is parsed again. Called with the lock held.
+static void insert(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                   const MultipartForm* form) {
+    // Another thread parsed the same body concurrently.
+    if (lookup(cache, digest))
+        return;
+
+    MultipartCacheEntry* entry = (MultipartCacheEntry*)calloc(1, sizeof(MultipartCacheEntry));
+    if (!entry)
+        return;
+
+    if (multipart_copy_form(form, &entry->form) != MULTIPART_OK) {
+        free(entry);
+        return;
+    }
+
+    if (form->num_files > 0) {
+        entry->paths = calloc(form->num_files, MULTIPART_CACHE_PATH_SIZE);
+        if (!entry->paths) {
+            free_entry(entry);
+            return;
+        }
+    }
+
+    while (cache->num_entries >= cache->max_entries && cache->lru_tail)
+        evict(cache, cache->lru_tail);
+
+    memcpy(entry->digest, digest, MULTIPART_DIGEST_SIZE);
+    size_t bucket = bucket_of(cache, digest);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push_front(cache, entry);
+    cache->num_entries++;
+}
+
+bool multipart_cache_init(MultipartRetryCache* cache, size_t max_entries) {
+    memset(cache, 0, sizeof(MultipartRetryCache));
+    cache->max_entries = max_entries ? max_entries : 1;
+
+    // Power of two with a load factor of at most one half.
+    cache->num_buckets = 16;
+    while (cache->num_buckets < cache->max_entries * 2)
+        cache->num_buckets *= 2;
+
+    cache->buckets = (MultipartCacheEntry**)calloc(cache->num_buckets, sizeof(MultipartCacheEntry*));
+    if (!cache->buckets) {
+        perror("Failed to allocate memory for retry cache");
+        return false;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return true;
+}
+
+MultipartCode multipart_cache_parse(MultipartRetryCache* cache, const char* body, size_t size, char* boundary,
+                                    MultipartForm* form, unsigned char digest[MULTIPART_DIGEST_SIZE], bool* hit) {
+    if (!cache_key(body, size, boundary, digest)) {
+        *hit = false;
+        return MEMORY_ALLOC_ERROR;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    MultipartCacheEntry* entry = lookup(cache, digest);
+    if (entry) {
+        lru_unlink(cache, entry);
+        lru_push_front(cache, entry);
+        MultipartCode code = multipart_copy_form(&entry->form, form);
+        if (code == MULTIPART_OK)
+            cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+
+        // File offsets in the cached form are valid for this body, it is the same bytes.
+        *hit = code == MULTIPART_OK;
+        return code;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    *hit = false;
+    MultipartCode code = multipart_parse_form(body, size, boundary, form);
+    if (code != MULTIPART_OK)
+        return code;
+
+    pthread_mutex_lock(&cache->lock);
+    insert(cache, digest, form);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return code;
+}
+
+bool multipart_cache_record_path(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                                 size_t file_index, const char* path) {
+    if (strlen(path) >= MULTIPART_CACHE_PATH_SIZE)
+        return false;
+
+    pthread_mutex_lock(&cache->lock);
+    MultipartCacheEntry* entry = lookup(cache, digest);
+    bool ok = entry && file_index < entry->form.num_files;
+    if (ok)
+        strcpy(entry->paths[file_index], path);
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
+}
+
+bool multipart_cache_saved_path(MultipartRetryCache* cache, const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                                size_t file_index, char* path, size_t path_size) {
+    pthread_mutex_lock(&cache->lock);
+    MultipartCacheEntry* entry = lookup(cache, digest);
+    const char* saved = entry && file_index < entry->form.num_files ? entry->paths[file_index] : NULL;
+    bool ok = saved && saved[0] && strlen(saved) < path_size;
+    if (ok)
+        strcpy(path, saved);
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
+}
+
+void multipart_cache_free(MultipartRetryCache* cache) {
+    while (cache->lru_tail)
+        evict(cache, cache->lru_tail);
+    free(cache->buckets);
+    cache->buckets = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
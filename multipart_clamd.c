@@ -0,0 +1,180 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_clamd.c                                                                #
+// Sink stage that virus-scans files with clamd while they pass through to the next      #
+// stage. Bytes are streamed to the daemon with the INSTREAM command as they are written, #
+// so the scan runs alongside saving and the verdict is ready when the file is saved.     #
+//=========================================================================================
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+static bool send_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// Reads the null-terminated reply of the daemon into sink->reply.
+static bool read_reply(MultipartClamdSink* self, int flags) {
+    size_t size = 0;
+    while (size < sizeof(self->reply) - 1) {
+        ssize_t n = recv(self->fd, self->reply + size, sizeof(self->reply) - 1 - size, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size += n;
+        if (memchr(self->reply + size - n, '\0', n))
+            break;
+    }
+    self->reply[size] = '\0';
+    return size > 0;
+}
+
+static void disconnect(MultipartClamdSink* self) {
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = -1;
+}
+
+static bool clamd_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartClamdSink* self = (MultipartClamdSink*)sink;
+    self->result = MULTIPART_SCAN_ERROR;
+    self->reply[0] = '\0';
+    self->signature[0] = '\0';
+
+    self->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (self->fd < 0) {
+        perror("Failed to create clamd socket");
+        return false;
+    }
+
+    struct timeval timeout = {.tv_sec = MULTIPART_CLAMD_TIMEOUT};
+    setsockopt(self->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(self->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    memcpy(addr.sun_path, self->socket_path, sizeof(addr.sun_path));
+    if (connect(self->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("Failed to connect to clamd");
+        disconnect(self);
+        return false;
+    }
+
+    // The z prefix asks for null-terminated replies.
+    struct iovec iov = {.iov_base = "zINSTREAM", .iov_len = 10};
+    if (!send_all(self->fd, &iov, 1)) {
+        perror("Failed to send INSTREAM to clamd");
+        disconnect(self);
+        return false;
+    }
+
+    if (!multipart_sink_begin_next(sink, file)) {
+        disconnect(self);
+        return false;
+    }
+    return true;
+}
+
+static bool clamd_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartClamdSink* self = (MultipartClamdSink*)sink;
+    const char* p = (const char*)data;
+    size_t remaining = size;
+
+    // Each chunk is a 4 byte big-endian length followed by the bytes.
+    while (remaining > 0) {
+        size_t n = remaining > MULTIPART_CLAMD_CHUNK_SIZE ? MULTIPART_CLAMD_CHUNK_SIZE : remaining;
+        uint32_t length = htonl((uint32_t)n);
+        struct iovec iov[2] = {
+            {.iov_base = &length, .iov_len = sizeof(length)},
+            {.iov_base = (void*)p, .iov_len = n},
+        };
+        if (!send_all(self->fd, iov, 2)) {
+            // clamd closes the stream early when it exceeds StreamMaxLength, keep its reason.
+            perror("Failed to stream file to clamd");
+            read_reply(self, MSG_DONTWAIT);
+            return false;
+        }
+        p += n;
+        remaining -= n;
+    }
+    return multipart_sink_write_next(sink, data, size);
+}
+
+static bool clamd_end(MultipartSink* sink, bool ok) {
+    MultipartClamdSink* self = (MultipartClamdSink*)sink;
+
+    if (ok) {
+        uint32_t terminator = 0;
+        struct iovec iov = {.iov_base = &terminator, .iov_len = sizeof(terminator)};
+        if (!send_all(self->fd, &iov, 1) || !read_reply(self, 0)) {
+            perror("Failed to read clamd reply");
+        } else {
+            // "stream: OK", "stream: <signature> FOUND" or "<reason> ERROR".
+            size_t length = strlen(self->reply);
+            const char* verdict = strncmp(self->reply, "stream: ", 8) == 0 ? self->reply + 8 : NULL;
+            if (verdict && strcmp(verdict, "OK") == 0) {
+                self->result = MULTIPART_SCAN_CLEAN;
+            } else if (verdict && length > 14 && strcmp(self->reply + length - 6, " FOUND") == 0) {
+                self->result = MULTIPART_SCAN_INFECTED;
+                size_t sig_length = length - 6 - 8;
+                if (sig_length >= sizeof(self->signature))
+                    sig_length = sizeof(self->signature) - 1;
+                memcpy(self->signature, verdict, sig_length);
+                self->signature[sig_length] = '\0';
+            } else {
+                fprintf(stderr, "clamd scan failed: %s\n", self->reply);
+            }
+        }
+    }
+    disconnect(self);
+
+    // Files that are not known to be clean fail the pipeline, so they are not kept.
+    bool clean = self->result == MULTIPART_SCAN_CLEAN;
+    return multipart_sink_end_next(sink, ok && clean) && ok && clean;
+}
+
+bool multipart_clamd_sink_init(MultipartClamdSink* sink, const char* socket_path, MultipartSink* next) {
+    memset(sink, 0, sizeof(MultipartClamdSink));
+    sink->base.begin = clamd_begin;
+    sink->base.write = clamd_write;
+    sink->base.end = clamd_end;
+    sink->base.next = next;
+    sink->fd = -1;
+    sink->result = MULTIPART_SCAN_ERROR;
+
+    if (!socket_path)
+        socket_path = MULTIPART_CLAMD_SOCKET;
+    if (strlen(socket_path) >= sizeof(sink->socket_path)) {
+        fprintf(stderr, "clamd socket path too long: %s\n", socket_path);
+        return false;
+    }
+    strcpy(sink->socket_path, socket_path);
+    return true;
+}
@@ -0,0 +1,248 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_crypt.c                                                                #
+// Saves file parts encrypted with AES-256-GCM as they are written, so encryption at      #
+// rest does not need a second pass over the saved file.                                  #
+// OpenSSL's EVP layer picks the AES-NI/VAES + PCLMULQDQ code paths when the CPU has them.#
+//=========================================================================================
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+// Layout of an encrypted stream:
+//   [12 byte IV][ciphertext, same size as the file][16 byte GCM tag]
+
+static bool encrypt_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartEncryptSink* self = (MultipartEncryptSink*)sink;
+    unsigned char key[MULTIPART_AES_KEY_SIZE];
+    unsigned char iv[MULTIPART_GCM_IV_SIZE];
+
+    if (!self->get_key(file, key, self->userdata)) {
+        fprintf(stderr, "No encryption key for file %s\n", file->filename);
+        return false;
+    }
+
+    // A fresh random IV per file means a key can safely be reused across files.
+    if (RAND_bytes(iv, sizeof(iv)) != 1) {
+        fprintf(stderr, "Failed to generate IV\n");
+        OPENSSL_cleanse(key, sizeof(key));
+        return false;
+    }
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        fprintf(stderr, "Failed to allocate cipher context\n");
+        OPENSSL_cleanse(key, sizeof(key));
+        return false;
+    }
+
+    int ret = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (ret != 1) {
+        fprintf(stderr, "Failed to initialize AES-GCM\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+
+    if (!multipart_sink_begin_next(sink, file)) {
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+
+    if (!multipart_sink_write_next(sink, iv, sizeof(iv))) {
+        EVP_CIPHER_CTX_free(ctx);
+        multipart_sink_end_next(sink, false);
+        return false;
+    }
+
+    self->ctx = ctx;
+    return true;
+}
+
+static bool encrypt_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartEncryptSink* self = (MultipartEncryptSink*)sink;
+    unsigned char out[MULTIPART_CRYPT_BLOCK_SIZE];
+    const unsigned char* src = (const unsigned char*)data;
+
+    while (size > 0) {
+        int n = size > sizeof(out) ? (int)sizeof(out) : (int)size;
+        int outlen = 0;
+        if (EVP_EncryptUpdate((EVP_CIPHER_CTX*)self->ctx, out, &outlen, src, n) != 1) {
+            fprintf(stderr, "Failed to encrypt file\n");
+            return false;
+        }
+
+        if (!multipart_sink_write_next(sink, out, outlen))
+            return false;
+        src += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool encrypt_end(MultipartSink* sink, bool ok) {
+    MultipartEncryptSink* self = (MultipartEncryptSink*)sink;
+    EVP_CIPHER_CTX* ctx = (EVP_CIPHER_CTX*)self->ctx;
+    unsigned char tag[MULTIPART_GCM_TAG_SIZE];
+    unsigned char out[MULTIPART_GCM_TAG_SIZE];
+
+    // GCM is a stream mode, final never produces output.
+    int outlen = 0;
+    if (ok && (EVP_EncryptFinal_ex(ctx, out, &outlen) != 1 ||
+               EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof(tag), tag) != 1)) {
+        fprintf(stderr, "Failed to finalize AES-GCM\n");
+        ok = false;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    self->ctx = NULL;
+
+    if (ok)
+        ok = multipart_sink_write_next(sink, tag, sizeof(tag));
+    return multipart_sink_end_next(sink, ok) && ok;
+}
+
+void multipart_encrypt_sink_init(MultipartEncryptSink* sink, MultipartKeyCallback get_key, void* userdata,
+                                 MultipartSink* next) {
+    memset(sink, 0, sizeof(MultipartEncryptSink));
+    sink->base.begin = encrypt_begin;
+    sink->base.write = encrypt_write;
+    sink->base.end = encrypt_end;
+    sink->base.next = next;
+    sink->get_key = get_key;
+    sink->userdata = userdata;
+}
+
+// Hands the key fetched by multipart_save_file_encrypted to the encrypt sink.
+static bool fetched_key(const FileHeader* file, unsigned char key[MULTIPART_AES_KEY_SIZE], void* userdata) {
+    (void)file;
+    memcpy(key, userdata, MULTIPART_AES_KEY_SIZE);
+    return true;
+}
+
+bool multipart_save_file_encrypted(const FileHeader* file, const char* body, const char* path,
+                                   MultipartKeyCallback get_key, void* userdata) {
+    // The key comes first, so a refused key leaves an existing file at path untouched.
+    unsigned char key[MULTIPART_AES_KEY_SIZE];
+    if (!get_key(file, key, userdata)) {
+        fprintf(stderr, "No encryption key for file %s\n", file->filename);
+        return false;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to open file for writing");
+        OPENSSL_cleanse(key, sizeof(key));
+        return false;
+    }
+
+    MultipartFdSink output;
+    MultipartEncryptSink encrypt;
+    multipart_fd_sink_init(&output, fd);
+    multipart_encrypt_sink_init(&encrypt, fetched_key, key, &output.base);
+
+    bool ok = multipart_sink_feed(&encrypt.base, file, body);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (close(fd) != 0) {
+        perror("Failed to close file");
+        ok = false;
+    }
+
+    // Don't leave a truncated ciphertext behind.
+    if (!ok)
+        remove(path);
+    return ok;
+}
+
+bool multipart_decrypt_file(const char* path, const unsigned char key[MULTIPART_AES_KEY_SIZE], char** data,
+                            size_t* size) {
+    unsigned char iv[MULTIPART_GCM_IV_SIZE];
+    unsigned char tag[MULTIPART_GCM_TAG_SIZE];
+    char* plaintext = NULL;
+    bool ok = false;
+
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror("Failed to open file for reading");
+        return false;
+    }
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        fprintf(stderr, "Failed to allocate cipher context\n");
+        fclose(f);
+        return false;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0) {
+        perror("fseek");
+        goto cleanup;
+    }
+
+    long file_size = ftell(f);
+    if (file_size < (long)(sizeof(iv) + sizeof(tag))) {
+        fprintf(stderr, "%s is too small to be an encrypted file\n", path);
+        goto cleanup;
+    }
+
+    size_t ciphertext_size = (size_t)file_size - sizeof(iv) - sizeof(tag);
+    plaintext = (char*)malloc(ciphertext_size + 1);
+    if (!plaintext) {
+        perror("Failed to allocate memory for plaintext");
+        goto cleanup;
+    }
+
+    if (fseek(f, 0, SEEK_SET) != 0 || fread(iv, 1, sizeof(iv), f) != sizeof(iv) ||
+        fread(plaintext, 1, ciphertext_size, f) != ciphertext_size || fread(tag, 1, sizeof(tag), f) != sizeof(tag)) {
+        perror("Failed to read encrypted file");
+        goto cleanup;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) != 1) {
+        fprintf(stderr, "Failed to decrypt %s\n", path);
+        goto cleanup;
+    }
+
+    // Decrypt in place, in pieces that fit the int length of EVP_DecryptUpdate.
+    size_t done = 0;
+    while (done < ciphertext_size) {
+        size_t n = ciphertext_size - done < INT_MAX ? ciphertext_size - done : INT_MAX;
+        int outlen = 0;
+        if (EVP_DecryptUpdate(ctx, (unsigned char*)plaintext + done, &outlen, (unsigned char*)plaintext + done,
+                              (int)n) != 1) {
+            fprintf(stderr, "Failed to decrypt %s\n", path);
+            goto cleanup;
+        }
+        done += n;
+    }
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, sizeof(tag), tag) != 1) {
+        fprintf(stderr, "Failed to decrypt %s\n", path);
+        goto cleanup;
+    }
+
+    int finallen = 0;
+    if (EVP_DecryptFinal_ex(ctx, (unsigned char*)plaintext + done, &finallen) != 1) {
+        fprintf(stderr, "Authentication failed for %s\n", path);
+        goto cleanup;
+    }
+
+    plaintext[ciphertext_size] = '\0';
+    *data = plaintext;
+    *size = ciphertext_size;
+    plaintext = NULL;
+    ok = true;
+
+cleanup:
+    free(plaintext);
+    EVP_CIPHER_CTX_free(ctx);
+    fclose(f);
+    return ok;
+}
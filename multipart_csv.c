@@ -0,0 +1,223 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_csv.c                                                                  #
+// Sink stage that splits a CSV file part (RFC 4180) into rows while it passes through,   #
+// so an import needs no second read of the saved file. Rows come after the body has      #
+// been received and parsed. Unquoted text is scanned 16 bytes at a time for delimiters,  #
+// quotes and newlines and copied into the row in whole runs.                             #
+//=========================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "multipart.h"
+
+// Returns the number of bytes at the start of p before the first delimiter, quote or newline.
+static size_t text_prefix(const char* p, size_t n, char delimiter) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i delim = _mm_set1_epi8(delimiter);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, delim), _mm_cmpeq_epi8(v, quote)),
+                                       _mm_cmpeq_epi8(v, newline));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == delimiter || p[i] == '"' || p[i] == '\n')
+            break;
+    }
+    return i;
+}
+
+// Appends bytes to the current field. Delimiters count towards max_row_size so rows of empty
+// fields are bounded too.
+static bool append(MultipartCsvSink* self, const char* data, size_t size) {
+    if (self->row_size + size + self->num_fields > self->max_row_size) {
+        fprintf(stderr, "CSV row %llu is longer than %zu bytes\n", (unsigned long long)self->num_rows,
+                self->max_row_size);
+        return false;
+    }
+    if (self->row_size + size > self->row_capacity) {
+        size_t capacity = self->row_capacity ? self->row_capacity : 256;
+        while (capacity < self->row_size + size)
+            capacity *= 2;
+        char* row = (char*)realloc(self->row, capacity);
+        if (!row) {
+            perror("Failed to allocate memory for CSV row");
+            return false;
+        }
+        self->row = row;
+        self->row_capacity = capacity;
+    }
+    memcpy(self->row + self->row_size, data, size);
+    self->row_size += size;
+    return true;
+}
+
+// Ends the current field. Until the row is emitted, a field's size holds its end offset in the row.
+static bool end_field(MultipartCsvSink* self) {
+    if (self->row_size + self->num_fields > self->max_row_size) {
+        fprintf(stderr, "CSV row %llu is longer than %zu bytes\n", (unsigned long long)self->num_rows,
+                self->max_row_size);
+        return false;
+    }
+    if (self->num_fields == self->fields_capacity) {
+        size_t capacity = self->fields_capacity ? self->fields_capacity * 2 : 16;
+        MultipartCsvField* fields = (MultipartCsvField*)realloc(self->fields, capacity * sizeof(MultipartCsvField));
+        if (!fields) {
+            perror("Failed to allocate memory for CSV fields");
+            return false;
+        }
+        self->fields = fields;
+        self->fields_capacity = capacity;
+    }
+    self->fields[self->num_fields++] = (MultipartCsvField){.data = NULL, .size = self->row_size};
+    self->field_quoted = false;
+    self->unquoted_tail = false;
+    return true;
+}
+
+static bool emit_row(MultipartCsvSink* self) {
+    // A CR before the newline belongs to the line ending unless it was quoted.
+    if (self->unquoted_tail && self->row_size > 0 && self->row[self->row_size - 1] == '\r')
+        self->row_size--;
+    bool quoted = self->field_quoted;
+    if (!end_field(self))
+        return false;
+
+    bool ok = true;
+    // Blank lines are skipped.
+    if (self->num_fields > 1 || self->row_size > 0 || quoted) {
+        size_t start = 0;
+        for (size_t i = 0; i < self->num_fields; i++) {
+            size_t end = self->fields[i].size;
+            self->fields[i].data = self->row + start;
+            self->fields[i].size = end - start;
+            start = end;
+        }
+        ok = self->callback(self->file, self->fields, self->num_fields, self->num_rows, self->userdata);
+        self->num_rows++;
+    }
+    self->row_size = 0;
+    self->num_fields = 0;
+    return ok;
+}
+
+static bool csv_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartCsvSink* self = (MultipartCsvSink*)sink;
+    self->file = file;
+    self->num_rows = 0;
+    self->row_size = 0;
+    self->num_fields = 0;
+    self->in_quotes = false;
+    self->after_quote = false;
+    self->field_quoted = false;
+    self->unquoted_tail = false;
+    return multipart_sink_begin_next(sink, file);
+}
+
+static bool csv_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartCsvSink* self = (MultipartCsvSink*)sink;
+    const char* p = (const char*)data;
+    const char* const end = p + size;
+
+    while (p < end) {
+        if (self->in_quotes) {
+            const char* quote = memchr(p, '"', end - p);
+            if (!append(self, p, (quote ? quote : end) - p))
+                return false;
+            if (!quote)
+                break;
+            p = quote + 1;
+            self->in_quotes = false;
+            self->after_quote = true;
+            self->unquoted_tail = false;
+            continue;
+        }
+
+        // A quote right after a closing quote is an escaped quote.
+        if (self->after_quote) {
+            self->after_quote = false;
+            if (*p == '"') {
+                if (!append(self, "\"", 1))
+                    return false;
+                self->in_quotes = true;
+                p++;
+                continue;
+            }
+        }
+
+        size_t n = text_prefix(p, end - p, self->delimiter);
+        if (n > 0) {
+            if (!append(self, p, n))
+                return false;
+            self->unquoted_tail = true;
+            p += n;
+            if (p == end)
+                break;
+        }
+
+        char c = *p++;
+        if (c == self->delimiter) {
+            if (!end_field(self))
+                return false;
+        } else if (c == '\n') {
+            if (!emit_row(self))
+                return false;
+        } else if (self->row_size == (self->num_fields ? self->fields[self->num_fields - 1].size : 0) &&
+                   !self->field_quoted) {
+            // A quote opening a field.
+            self->in_quotes = true;
+            self->field_quoted = true;
+        } else {
+            // A stray quote inside unquoted text is kept as is.
+            if (!append(self, "\"", 1))
+                return false;
+            self->unquoted_tail = true;
+        }
+    }
+    return multipart_sink_write_next(sink, data, size);
+}
+
+static bool csv_end(MultipartSink* sink, bool ok) {
+    MultipartCsvSink* self = (MultipartCsvSink*)sink;
+    if (ok && self->in_quotes) {
+        fprintf(stderr, "CSV file ends inside a quoted field\n");
+        ok = false;
+    }
+    // The last row may not end with a newline.
+    if (ok && (self->row_size > 0 || self->num_fields > 0 || self->field_quoted))
+        ok = emit_row(self);
+
+    free(self->row);
+    free(self->fields);
+    self->row = NULL;
+    self->fields = NULL;
+    self->row_capacity = 0;
+    self->fields_capacity = 0;
+    self->file = NULL;
+    return multipart_sink_end_next(sink, ok) && ok;
+}
+
+void multipart_csv_sink_init(MultipartCsvSink* sink, char delimiter, MultipartCsvRowCallback callback, void* userdata,
+                             MultipartSink* next) {
+    memset(sink, 0, sizeof(MultipartCsvSink));
+    sink->base.begin = csv_begin;
+    sink->base.write = csv_write;
+    sink->base.end = csv_end;
+    sink->base.next = next;
+    sink->delimiter = delimiter ? delimiter : ',';
+    sink->callback = callback;
+    sink->userdata = userdata;
+    sink->max_row_size = MULTIPART_CSV_MAX_ROW_SIZE;
+}
@@ -0,0 +1,304 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_decode.c                                                               #
+// Decompresses request bodies sent with Content-Encoding gzip, deflate or zstd as they   #
+// are received. Output goes straight into a body buffer and is checked against a size    #
+// and a ratio limit after every chunk, so decompression bombs are stopped early.         #
+//=========================================================================================
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#ifdef MULTIPART_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "multipart.h"
+
+MultipartEncoding multipart_parse_content_encoding(const char* header) {
+    if (!header)
+        return MULTIPART_ENCODING_IDENTITY;
+
+    while (isspace((unsigned char)*header))
+        header++;
+    size_t length = strlen(header);
+    while (length > 0 && isspace((unsigned char)header[length - 1]))
+        length--;
+
+    // Several codings applied in a row (e.g. "gzip, zstd") are not supported.
+    if (length == 0 || (length == 8 && strncasecmp(header, "identity", 8) == 0))
+        return MULTIPART_ENCODING_IDENTITY;
+    if ((length == 4 && strncasecmp(header, "gzip", 4) == 0) || (length == 6 && strncasecmp(header, "x-gzip", 6) == 0))
+        return MULTIPART_ENCODING_GZIP;
+    if (length == 7 && strncasecmp(header, "deflate", 7) == 0)
+        return MULTIPART_ENCODING_DEFLATE;
+    if (length == 4 && strncasecmp(header, "zstd", 4) == 0)
+        return MULTIPART_ENCODING_ZSTD;
+    return MULTIPART_ENCODING_UNSUPPORTED;
+}
+
+bool multipart_decoder_init(MultipartDecoder* decoder, MultipartEncoding encoding, MultipartBodyBuffer* body,
+                            size_t max_ratio, size_t max_size) {
+    memset(decoder, 0, sizeof(MultipartDecoder));
+    decoder->encoding = encoding;
+    decoder->body = body;
+    decoder->max_ratio = max_ratio ? max_ratio : MULTIPART_DECODE_MAX_RATIO;
+    decoder->max_size = max_size;
+
+    switch (encoding) {
+        case MULTIPART_ENCODING_IDENTITY:
+            return true;
+        case MULTIPART_ENCODING_GZIP:
+        case MULTIPART_ENCODING_DEFLATE: {
+            // The stream is initialized on the first write, once the deflate wrapper can be detected.
+            z_stream* zs = (z_stream*)calloc(1, sizeof(z_stream));
+            if (!zs) {
+                perror("Failed to allocate memory for inflate stream");
+                return false;
+            }
+            decoder->stream = zs;
+            return true;
+        }
+        case MULTIPART_ENCODING_ZSTD:
+#ifdef MULTIPART_WITH_ZSTD
+            decoder->stream = ZSTD_createDStream();
+            if (!decoder->stream) {
+                fprintf(stderr, "Failed to create zstd stream\n");
+                return false;
+            }
+            return true;
+#else
+            fprintf(stderr, "zstd support is not compiled in, build with MULTIPART_WITH_ZSTD\n");
+            return false;
+#endif
+        default:
+            fprintf(stderr, "Unsupported Content-Encoding\n");
+            return false;
+    }
+}
+
+// Checks the limits after each decompressed chunk. Small bodies are exempt from the ratio,
+// a few KB of any repetitive text compress far beyond it.
+static MultipartCode check_limits(MultipartDecoder* decoder) {
+    size_t produced = decoder->body->size;
+    if (decoder->max_size && produced > decoder->max_size) {
+        fprintf(stderr, "Decompressed body exceeds %zu bytes\n", decoder->max_size);
+        return DECODE_LIMIT_EXCEEDED;
+    }
+    if (produced > MULTIPART_DECODE_RATIO_GRACE && produced / decoder->max_ratio > decoder->consumed) {
+        fprintf(stderr, "Decompression ratio exceeds %zu after %zu bytes\n", decoder->max_ratio, produced);
+        return DECODE_LIMIT_EXCEEDED;
+    }
+    return MULTIPART_OK;
+}
+
+// HTTP deflate is meant to be zlib-wrapped but some clients send raw deflate. A zlib stream
+// starts with CM=8 and a header checksum that is a multiple of 31.
+static bool has_zlib_header(const unsigned char first[2]) {
+    if ((first[0] & 0x0f) != 8 || (first[0] >> 4) > 7)
+        return false;
+    return ((first[0] << 8) | first[1]) % 31 == 0;
+}
+
+static MultipartCode inflate_feed(MultipartDecoder* decoder, const unsigned char* data, size_t size) {
+    z_stream* zs = (z_stream*)decoder->stream;
+    zs->next_in = (unsigned char*)data;
+    zs->avail_in = (unsigned int)size;
+    bool output_full = false;
+
+    // inflate may hold back output when the chunk fills up, so it runs until the input is
+    // consumed and a chunk is left with room.
+    while (zs->avail_in > 0 || (output_full && !decoder->finished)) {
+        if (decoder->finished) {
+            // Concatenated gzip members form one body.
+            if (decoder->encoding != MULTIPART_ENCODING_GZIP) {
+                fprintf(stderr, "Data after the end of the deflate stream\n");
+                return DECODE_FAILED;
+            }
+            inflateReset(zs);
+            decoder->finished = false;
+        }
+
+        char* out = multipart_body_reserve(decoder->body, MULTIPART_DECODE_CHUNK_SIZE);
+        if (!out)
+            return MEMORY_ALLOC_ERROR;
+        zs->next_out = (unsigned char*)out;
+        zs->avail_out = MULTIPART_DECODE_CHUNK_SIZE;
+
+        unsigned int avail_in = zs->avail_in;
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "inflate failed: %s\n", zs->msg ? zs->msg : "invalid data");
+            return DECODE_FAILED;
+        }
+        size_t produced = MULTIPART_DECODE_CHUNK_SIZE - zs->avail_out;
+        decoder->consumed += avail_in - zs->avail_in;
+        multipart_body_commit(decoder->body, produced);
+        if (ret == Z_STREAM_END)
+            decoder->finished = true;
+        output_full = zs->avail_out == 0;
+
+        MultipartCode code = check_limits(decoder);
+        if (code != MULTIPART_OK)
+            return code;
+
+        // Waiting for more input.
+        if (ret == Z_BUF_ERROR && produced == 0 && avail_in == zs->avail_in) {
+            if (zs->avail_in == 0)
+                break;
+            fprintf(stderr, "inflate made no progress\n");
+            return DECODE_FAILED;
+        }
+    }
+    return MULTIPART_OK;
+}
+
+static MultipartCode inflate_write(MultipartDecoder* decoder, const unsigned char* data, size_t size) {
+    if (!decoder->started) {
+        int window_bits = 15 + 16;
+        if (decoder->encoding == MULTIPART_ENCODING_DEFLATE) {
+            // The wrapper is told by the first two bytes, which may arrive in separate writes.
+            if (decoder->header_size + size < sizeof(decoder->header)) {
+                memcpy(decoder->header + decoder->header_size, data, size);
+                decoder->header_size += size;
+                return MULTIPART_OK;
+            }
+            unsigned char first[2];
+            memcpy(first, decoder->header, decoder->header_size);
+            memcpy(first + decoder->header_size, data, sizeof(first) - decoder->header_size);
+            window_bits = has_zlib_header(first) ? 15 : -15;
+        }
+        if (inflateInit2((z_stream*)decoder->stream, window_bits) != Z_OK) {
+            fprintf(stderr, "inflateInit2 failed\n");
+            return MEMORY_ALLOC_ERROR;
+        }
+        decoder->started = true;
+
+        if (decoder->header_size > 0) {
+            size_t header_size = decoder->header_size;
+            decoder->header_size = 0;
+            MultipartCode code = inflate_feed(decoder, decoder->header, header_size);
+            if (code != MULTIPART_OK)
+                return code;
+        }
+    }
+    return inflate_feed(decoder, data, size);
+}
+
+#ifdef MULTIPART_WITH_ZSTD
+static MultipartCode zstd_write(MultipartDecoder* decoder, const void* data, size_t size) {
+    ZSTD_inBuffer in = {data, size, 0};
+    bool output_full = false;
+    while (in.pos < in.size || output_full) {
+        char* out = multipart_body_reserve(decoder->body, MULTIPART_DECODE_CHUNK_SIZE);
+        if (!out)
+            return MEMORY_ALLOC_ERROR;
+        ZSTD_outBuffer buf = {out, MULTIPART_DECODE_CHUNK_SIZE, 0};
+
+        size_t pos = in.pos;
+        size_t ret = ZSTD_decompressStream((ZSTD_DStream*)decoder->stream, &buf, &in);
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "zstd decompression failed: %s\n", ZSTD_getErrorName(ret));
+            return DECODE_FAILED;
+        }
+        decoder->consumed += in.pos - pos;
+        multipart_body_commit(decoder->body, buf.pos);
+        // 0 means a frame is complete, another frame may follow.
+        decoder->finished = ret == 0;
+        output_full = buf.pos == buf.size;
+
+        MultipartCode code = check_limits(decoder);
+        if (code != MULTIPART_OK)
+            return code;
+    }
+    return MULTIPART_OK;
+}
+#endif
+
+MultipartCode multipart_decoder_write(MultipartDecoder* decoder, const void* data, size_t size) {
+    if (size == 0)
+        return MULTIPART_OK;
+
+    switch (decoder->encoding) {
+        case MULTIPART_ENCODING_IDENTITY:
+            decoder->consumed += size;
+            if (!multipart_body_append(decoder->body, data, size))
+                return MEMORY_ALLOC_ERROR;
+            decoder->finished = true;
+            if (decoder->max_size && decoder->body->size > decoder->max_size)
+                return DECODE_LIMIT_EXCEEDED;
+            return MULTIPART_OK;
+        case MULTIPART_ENCODING_GZIP:
+        case MULTIPART_ENCODING_DEFLATE: {
+            // zlib counts input in unsigned int.
+            const unsigned char* p = (const unsigned char*)data;
+            while (size > 0) {
+                size_t n = size > (1u << 30) ? (1u << 30) : size;
+                MultipartCode code = inflate_write(decoder, p, n);
+                if (code != MULTIPART_OK)
+                    return code;
+                p += n;
+                size -= n;
+            }
+            return MULTIPART_OK;
+        }
+#ifdef MULTIPART_WITH_ZSTD
+        case MULTIPART_ENCODING_ZSTD:
+            return zstd_write(decoder, data, size);
+#endif
+        default:
+            return UNSUPPORTED_ENCODING;
+    }
+}
+
+MultipartCode multipart_decoder_finish(MultipartDecoder* decoder) {
+    if (decoder->encoding == MULTIPART_ENCODING_IDENTITY || decoder->finished)
+        return MULTIPART_OK;
+    fprintf(stderr, "Compressed body is truncated\n");
+    return DECODE_FAILED;
+}
+
+void multipart_decoder_free(MultipartDecoder* decoder) {
+    switch (decoder->encoding) {
+        case MULTIPART_ENCODING_GZIP:
+        case MULTIPART_ENCODING_DEFLATE:
+            if (decoder->stream && decoder->started)
+                inflateEnd((z_stream*)decoder->stream);
+            free(decoder->stream);
+            break;
+#ifdef MULTIPART_WITH_ZSTD
+        case MULTIPART_ENCODING_ZSTD:
+            ZSTD_freeDStream((ZSTD_DStream*)decoder->stream);
+            break;
+#endif
+        default:
+            break;
+    }
+    decoder->stream = NULL;
+}
+
+MultipartCode multipart_decode_body(const char* content_encoding, const void* data, size_t size,
+                                    MultipartBodyBuffer* body, size_t max_ratio, size_t max_size) {
+    MultipartEncoding encoding = multipart_parse_content_encoding(content_encoding);
+#ifndef MULTIPART_WITH_ZSTD
+    if (encoding == MULTIPART_ENCODING_ZSTD)
+        encoding = MULTIPART_ENCODING_UNSUPPORTED;
+#endif
+    if (encoding == MULTIPART_ENCODING_UNSUPPORTED) {
+        fprintf(stderr, "Unsupported Content-Encoding: %s\n", content_encoding);
+        return UNSUPPORTED_ENCODING;
+    }
+
+    MultipartDecoder decoder;
+    if (!multipart_decoder_init(&decoder, encoding, body, max_ratio, max_size))
+        return MEMORY_ALLOC_ERROR;
+
+    MultipartCode code = multipart_decoder_write(&decoder, data, size);
+    if (code == MULTIPART_OK)
+        code = multipart_decoder_finish(&decoder);
+    multipart_decoder_free(&decoder);
+    return code;
+}
@@ -0,0 +1,206 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_digest.c                                                               #
+// SHA-256 on top of OpenSSL and a chunked Merkle tree hash for file parts.               #
+// The tree hash splits a file part into fixed size chunks that are hashed in parallel    #
+// and combined into a single root, so one huge part no longer hashes on a single core.   #
+//=========================================================================================
+#include <limits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+// =============== SHA-256 ===========================
+// Every SHA-256 in the library goes through OpenSSL's EVP digests, which use the SHA
+// extensions or AVX2 when the CPU has them.
+
+bool multipart_sha256_init(MultipartSha256* ctx) {
+    EVP_MD_CTX* md = EVP_MD_CTX_new();
+    if (!md || EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1) {
+        fprintf(stderr, "Failed to initialize SHA-256\n");
+        EVP_MD_CTX_free(md);
+        ctx->ctx = NULL;
+        return false;
+    }
+    ctx->ctx = md;
+    return true;
+}
+
+bool multipart_sha256_update(MultipartSha256* ctx, const void* data, size_t size) {
+    return EVP_DigestUpdate((EVP_MD_CTX*)ctx->ctx, data, size) == 1;
+}
+
+bool multipart_sha256_final(MultipartSha256* ctx, unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    EVP_MD_CTX* md = (EVP_MD_CTX*)ctx->ctx;
+    bool ok = EVP_DigestFinal_ex(md, digest, NULL) == 1;
+    EVP_MD_CTX_free(md);
+    ctx->ctx = NULL;
+    return ok;
+}
+
+bool multipart_sha256(const void* data, size_t size, unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    if (EVP_Digest(data, size, digest, NULL, EVP_sha256(), NULL) != 1) {
+        fprintf(stderr, "Failed to compute SHA-256\n");
+        return false;
+    }
+    return true;
+}
+
+bool multipart_hmac_sha256(const void* key, size_t key_size, const void* data, size_t size,
+                           unsigned char mac[MULTIPART_DIGEST_SIZE]) {
+    if (key_size > INT_MAX ||
+        !HMAC(EVP_sha256(), key, (int)key_size, (const unsigned char*)data, size, mac, NULL)) {
+        fprintf(stderr, "Failed to compute HMAC-SHA256\n");
+        return false;
+    }
+    return true;
+}
+
+void multipart_digest_to_hex(const unsigned char digest[MULTIPART_DIGEST_SIZE],
+                             char hex[MULTIPART_DIGEST_SIZE * 2 + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < MULTIPART_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[MULTIPART_DIGEST_SIZE * 2] = '\0';
+}
+
+// =============== Tree hash =========================
+// The tree follows the Merkle Tree Hash of RFC 6962 with file chunks as leaves:
+//   leaf   = SHA-256(0x00 || chunk)
+//   parent = SHA-256(0x01 || left || right)
+// where the left subtree always holds the largest power of two leaves smaller than the total.
+// The shape only depends on the file size, so the root is the same for any number of threads.
+
+typedef struct TreeHashJob {
+    const unsigned char* data;  // Start of the file part in the body.
+    size_t size;                // Size of the file part.
+    size_t num_chunks;          // Number of leaves.
+    unsigned char* leaves;      // num_chunks * MULTIPART_DIGEST_SIZE output digests.
+    atomic_size_t next_chunk;   // Next leaf to be claimed by a worker.
+    atomic_bool failed;         // Set by a worker that could not hash its leaf.
+} TreeHashJob;
+
+static bool hash_leaf(const unsigned char* chunk, size_t size, unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    static const unsigned char prefix = 0x00;
+    MultipartSha256 ctx;
+    if (!multipart_sha256_init(&ctx))
+        return false;
+    bool ok = multipart_sha256_update(&ctx, &prefix, 1) && multipart_sha256_update(&ctx, chunk, size);
+    return multipart_sha256_final(&ctx, digest) && ok;
+}
+
+static bool hash_parent(const unsigned char left[MULTIPART_DIGEST_SIZE],
+                        const unsigned char right[MULTIPART_DIGEST_SIZE], unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    static const unsigned char prefix = 0x01;
+    MultipartSha256 ctx;
+    if (!multipart_sha256_init(&ctx))
+        return false;
+    bool ok = multipart_sha256_update(&ctx, &prefix, 1) && multipart_sha256_update(&ctx, left, MULTIPART_DIGEST_SIZE) &&
+              multipart_sha256_update(&ctx, right, MULTIPART_DIGEST_SIZE);
+    return multipart_sha256_final(&ctx, digest) && ok;
+}
+
+// Workers claim chunks one at a time so that a slow core does not hold up the others.
+static void* tree_hash_worker(void* arg) {
+    TreeHashJob* job = (TreeHashJob*)arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&job->next_chunk, 1)) < job->num_chunks) {
+        size_t start = i * MULTIPART_TREE_CHUNK_SIZE;
+        size_t length = job->size - start;
+        if (length > MULTIPART_TREE_CHUNK_SIZE)
+            length = MULTIPART_TREE_CHUNK_SIZE;
+
+        if (!hash_leaf(job->data + start, length, job->leaves + i * MULTIPART_DIGEST_SIZE))
+            atomic_store(&job->failed, true);
+    }
+    return NULL;
+}
+
+// Computes the root of the subtree made of the first count leaves.
+static bool tree_hash_root(const unsigned char* leaves, size_t count, unsigned char digest[MULTIPART_DIGEST_SIZE]) {
+    if (count == 1) {
+        memcpy(digest, leaves, MULTIPART_DIGEST_SIZE);
+        return true;
+    }
+
+    size_t split = 1;
+    while (split * 2 < count)
+        split *= 2;
+
+    unsigned char left[MULTIPART_DIGEST_SIZE];
+    unsigned char right[MULTIPART_DIGEST_SIZE];
+    return tree_hash_root(leaves, split, left) &&
+           tree_hash_root(leaves + split * MULTIPART_DIGEST_SIZE, count - split, right) &&
+           hash_parent(left, right, digest);
+}
+
+bool multipart_tree_hash(const void* data, size_t size, size_t num_threads, unsigned char root[MULTIPART_DIGEST_SIZE]) {
+    // An empty file has no leaves, RFC 6962 defines its hash as the hash of the empty string.
+    if (size == 0)
+        return multipart_sha256("", 0, root);
+
+    TreeHashJob job = {
+        .data = (const unsigned char*)data,
+        .size = size,
+        .num_chunks = (size + MULTIPART_TREE_CHUNK_SIZE - 1) / MULTIPART_TREE_CHUNK_SIZE,
+    };
+    atomic_init(&job.next_chunk, 0);
+    atomic_init(&job.failed, false);
+
+    job.leaves = (unsigned char*)malloc(job.num_chunks * MULTIPART_DIGEST_SIZE);
+    if (!job.leaves) {
+        perror("Failed to allocate memory for tree hash leaves");
+        return false;
+    }
+
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t)online : 1;
+    }
+
+    if (num_threads > MULTIPART_TREE_MAX_THREADS)
+        num_threads = MULTIPART_TREE_MAX_THREADS;
+
+    if (num_threads > job.num_chunks)
+        num_threads = job.num_chunks;
+
+    // The calling thread is one of the workers.
+    pthread_t threads[MULTIPART_TREE_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, tree_hash_worker, &job) != 0) {
+            // Not fatal, the remaining workers pick up the chunks.
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    tree_hash_worker(&job);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool ok = !atomic_load(&job.failed) && tree_hash_root(job.leaves, job.num_chunks, root);
+    free(job.leaves);
+    return ok;
+}
+
+bool multipart_tree_hash_file(FileHeader* file, const char* body, size_t num_threads) {
+    if (!multipart_tree_hash(body + file->offset, file->size, num_threads, file->tree_hash)) {
+        return false;
+    }
+    file->has_tree_hash = true;
+    return true;
+}
@@ -0,0 +1,230 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_io.c                                                                   #
+// Alternative ways of writing file parts to disk for large uploads.                      #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "multipart.h"
+
+static bool pwrite_all(int fd, const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// =============== Direct I/O ========================
+
+// Buffered write that keeps the page cache clean by writing back and dropping each window
+// once it is written. POSIX_FADV_DONTNEED ignores dirty pages, hence the sync_file_range.
+static bool save_buffered_dontneed(int fd, const char* data, size_t size, bool drop_cache) {
+    off_t offset = 0;
+    while ((size_t)offset < size) {
+        size_t n = size - offset;
+        if (n > MULTIPART_DIRECT_BUFFER_SIZE)
+            n = MULTIPART_DIRECT_BUFFER_SIZE;
+
+        if (!pwrite_all(fd, data + offset, n, offset))
+            return false;
+
+        if (drop_cache) {
+            sync_file_range(fd, offset, n,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+        }
+        offset += n;
+    }
+    return true;
+}
+
+// Writes data with O_DIRECT. Blocks are written straight from data when it is suitably aligned,
+// otherwise through an aligned bounce buffer. The last partial block is padded with zeros and
+// the file is truncated back to size afterwards.
+static bool save_direct(int fd, const char* data, size_t size) {
+    const size_t align = MULTIPART_DIRECT_ALIGNMENT;
+    bool aligned_source = ((uintptr_t)data % align) == 0;
+    char* bounce = NULL;
+
+    // posix_memalign returns its error instead of setting errno, the caller checks errno.
+    int ret = posix_memalign((void**)&bounce, align, MULTIPART_DIRECT_BUFFER_SIZE);
+    if (ret != 0) {
+        errno = ret;
+        perror("Failed to allocate aligned buffer");
+        errno = ret;
+        return false;
+    }
+
+    bool ok = true;
+    size_t whole = size - size % align;
+    off_t offset = 0;
+
+    // Aligned middle, zero-copy if the source allows it.
+    while (ok && (size_t)offset < whole) {
+        size_t n = whole - offset;
+        if (n > MULTIPART_DIRECT_BUFFER_SIZE)
+            n = MULTIPART_DIRECT_BUFFER_SIZE;
+
+        if (aligned_source) {
+            ok = pwrite_all(fd, data + offset, n, offset);
+        } else {
+            memcpy(bounce, data + offset, n);
+            ok = pwrite_all(fd, bounce, n, offset);
+        }
+        offset += n;
+    }
+
+    // Unaligned tail.
+    size_t tail = size - whole;
+    if (ok && tail > 0) {
+        memcpy(bounce, data + whole, tail);
+        memset(bounce + tail, 0, align - tail);
+        ok = pwrite_all(fd, bounce, align, (off_t)whole) && ftruncate(fd, (off_t)size) == 0;
+    }
+
+    free(bounce);
+    return ok;
+}
+
+bool multipart_save_file_direct(const FileHeader* file, const char* body, const char* path, bool drop_cache) {
+    const char* data = body + file->offset;
+    bool ok;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (fd >= 0) {
+        ok = save_direct(fd, data, file->size);
+
+        // The device needs a larger alignment than MULTIPART_DIRECT_ALIGNMENT, start over buffered.
+        if (!ok && errno == EINVAL) {
+            int flags = fcntl(fd, F_GETFL);
+            ok = flags != -1 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0 && ftruncate(fd, 0) == 0 &&
+                 save_buffered_dontneed(fd, data, file->size, drop_cache);
+        }
+    } else if (errno == EINVAL) {
+        // The filesystem does not support O_DIRECT (tmpfs, some FUSE and network filesystems).
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("Failed to open file for writing");
+            return false;
+        }
+        ok = save_buffered_dontneed(fd, data, file->size, drop_cache);
+    } else {
+        perror("Failed to open file for writing");
+        return false;
+    }
+
+    if (!ok)
+        perror("Failed to write file to disk");
+
+    if (close(fd) != 0) {
+        perror("Failed to close file");
+        ok = false;
+    }
+    return ok;
+}
+
+// =============== Sparse files ======================
+
+// Reports whether the n bytes at p are all zero. Bails out on the first non-zero cache line,
+// so data blocks cost little more than their first few bytes.
+static bool is_zero_block(const char* p, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= n; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(p + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff)
+            return false;
+    }
+#else
+    for (; i + 32 <= n; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) != 0)
+            return false;
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+bool multipart_save_file_sparse(const FileHeader* file, const char* body, const char* path, size_t* hole_bytes) {
+    const char* data = body + file->offset;
+    size_t size = file->size;
+    size_t holes = 0;
+
+    // The file starts out empty, so every range that is not written reads back as zeros.
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to open file for writing");
+        return false;
+    }
+
+    bool ok = true;
+    size_t run_start = 0;  // Start of the pending run of data blocks.
+    size_t pos = 0;
+    while (ok && pos < size) {
+        size_t n = size - pos;
+        if (n > MULTIPART_SPARSE_BLOCK_SIZE)
+            n = MULTIPART_SPARSE_BLOCK_SIZE;
+
+        if (is_zero_block(data + pos, n)) {
+            // Flush the data run before the hole.
+            if (pos > run_start)
+                ok = pwrite_all(fd, data + run_start, pos - run_start, (off_t)run_start);
+            holes += n;
+            run_start = pos + n;
+        } else if (pos + n - run_start >= MULTIPART_DIRECT_BUFFER_SIZE) {
+            // Keep writes reasonably sized.
+            ok = pwrite_all(fd, data + run_start, pos + n - run_start, (off_t)run_start);
+            run_start = pos + n;
+        }
+        pos += n;
+    }
+
+    if (ok && size > run_start)
+        ok = pwrite_all(fd, data + run_start, size - run_start, (off_t)run_start);
+
+    // Extends the file over a trailing hole.
+    if (ok)
+        ok = ftruncate(fd, (off_t)size) == 0;
+
+    if (!ok)
+        perror("Failed to write file to disk");
+
+    if (close(fd) != 0) {
+        perror("Failed to close file");
+        ok = false;
+    }
+
+    if (ok && hole_bytes)
+        *hole_bytes = holes;
+    return ok;
+}
@@ -0,0 +1,196 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_json.c                                                                 #
+// Serializes the metadata of a parsed form as JSON straight into a caller buffer. String #
+// escaping scans 16 bytes at a time for quotes, backslashes, control and non-ASCII bytes, #
+// so plain ASCII values are copied with memcpy.                                          #
+//=========================================================================================
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "multipart.h"
+
+// Output that counts every byte but only stores what fits, like snprintf.
+typedef struct JsonWriter {
+    char* buf;
+    size_t size;
+    size_t length;
+} JsonWriter;
+
+static void put(JsonWriter* w, const char* data, size_t n) {
+    if (w->length < w->size) {
+        size_t room = w->size - w->length;
+        memcpy(w->buf + w->length, data, n < room ? n : room);
+    }
+    w->length += n;
+}
+
+static void put_str(JsonWriter* w, const char* s) {
+    put(w, s, strlen(s));
+}
+
+static void put_number(JsonWriter* w, uint64_t value) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    put(w, digits + i, sizeof(digits) - i);
+}
+
+// Returns the number of bytes at the start of s that can be copied without escaping.
+static size_t plain_prefix(const unsigned char* s, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Bytes >= 0x80 are negative as signed bytes, so one compare finds control and non-ASCII bytes.
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                       _mm_cmplt_epi8(v, space));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] == '"' || s[i] == '\\' || s[i] < 0x20 || s[i] >= 0x80)
+            break;
+    }
+    return i;
+}
+
+// Returns the length of the well-formed UTF-8 sequence at s, or 0 if it is not one.
+static size_t utf8_length(const unsigned char* s, size_t n) {
+    size_t length;
+    uint32_t cp, min;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        length = 2, cp = s[0] & 0x1f, min = 0x80;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        length = 3, cp = s[0] & 0x0f, min = 0x800;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        length = 4, cp = s[0] & 0x07, min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (n < length)
+        return 0;
+    for (size_t i = 1; i < length; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    // Overlong forms, surrogates and code points past U+10FFFF.
+    if (cp < min || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+        return 0;
+    return length;
+}
+
+// Writes s as a quoted JSON string. Bytes that are not valid UTF-8 become U+FFFD.
+static void put_string(JsonWriter* w, const char* str) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* s = (const unsigned char*)str;
+    size_t n = strlen(str);
+
+    put(w, "\"", 1);
+    while (n > 0) {
+        size_t plain = plain_prefix(s, n);
+        put(w, (const char*)s, plain);
+        s += plain;
+        n -= plain;
+        if (n == 0)
+            break;
+
+        size_t length = 1;
+        switch (*s) {
+            case '"':
+                put(w, "\\\"", 2);
+                break;
+            case '\\':
+                put(w, "\\\\", 2);
+                break;
+            case '\b':
+                put(w, "\\b", 2);
+                break;
+            case '\f':
+                put(w, "\\f", 2);
+                break;
+            case '\n':
+                put(w, "\\n", 2);
+                break;
+            case '\r':
+                put(w, "\\r", 2);
+                break;
+            case '\t':
+                put(w, "\\t", 2);
+                break;
+            default:
+                if (*s < 0x20) {
+                    char escape[6] = {'\\', 'u', '0', '0', hex[*s >> 4], hex[*s & 0xf]};
+                    put(w, escape, sizeof(escape));
+                } else if ((length = utf8_length(s, n)) != 0) {
+                    put(w, (const char*)s, length);
+                } else {
+                    length = 1;
+                    put(w, "\\ufffd", 6);
+                }
+                break;
+        }
+        s += length;
+        n -= length;
+    }
+    put(w, "\"", 1);
+}
+
+size_t multipart_form_to_json(const MultipartForm* form, char* buf, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    JsonWriter w = {.buf = buf, .size = size};
+
+    put_str(&w, "{\"fields\":[");
+    for (size_t i = 0; i < form->num_fields; i++) {
+        const FormField* field = &form->fields[i];
+        put_str(&w, i ? ",{\"name\":" : "{\"name\":");
+        put_string(&w, field->name);
+        put_str(&w, ",\"value\":");
+        put_string(&w, field->value);
+        put(&w, "}", 1);
+    }
+
+    put_str(&w, "],\"files\":[");
+    for (size_t i = 0; i < form->num_files; i++) {
+        const FileHeader* file = form->files[i];
+        put_str(&w, i ? ",{\"field_name\":" : "{\"field_name\":");
+        put_string(&w, file->field_name);
+        put_str(&w, ",\"filename\":");
+        put_string(&w, file->filename);
+        put_str(&w, ",\"mimetype\":");
+        put_string(&w, file->mimetype);
+        put_str(&w, ",\"offset\":");
+        put_number(&w, file->offset);
+        put_str(&w, ",\"size\":");
+        put_number(&w, file->size);
+        if (file->has_tree_hash) {
+            char digest[MULTIPART_DIGEST_SIZE * 2];
+            for (size_t j = 0; j < MULTIPART_DIGEST_SIZE; j++) {
+                digest[2 * j] = hex[file->tree_hash[j] >> 4];
+                digest[2 * j + 1] = hex[file->tree_hash[j] & 0xf];
+            }
+            put_str(&w, ",\"tree_hash\":\"");
+            put(&w, digest, sizeof(digest));
+            put(&w, "\"", 1);
+        }
+        put(&w, "}", 1);
+    }
+    put_str(&w, "]}");
+
+    if (size > 0)
+        buf[w.length < size ? w.length : size - 1] = '\0';
+    return w.length;
+}
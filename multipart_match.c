@@ -0,0 +1,150 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_match.c                                                                #
+// Aho-Corasick automaton for finding many signatures in one pass over the bytes. The     #
+// parser runs it over field values and the head of each file while it walks the body.   #
+//=========================================================================================
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multipart.h"
+
+#define NO_PATTERN UINT32_MAX
+
+bool multipart_matcher_init(MultipartMatcher* matcher, const char* const* patterns, const size_t* lengths,
+                            size_t num_patterns, bool nocase) {
+    memset(matcher, 0, sizeof(MultipartMatcher));
+    matcher->nocase = nocase;
+
+    // Bytes that occur in no pattern share one class, which keeps the transition table narrow.
+    bool used[256] = {false};
+    size_t total = 0;
+    for (size_t i = 0; i < num_patterns; i++) {
+        size_t len = lengths ? lengths[i] : strlen(patterns[i]);
+        if (len == 0 || total + len >= NO_PATTERN) {
+            fprintf(stderr, "Invalid matcher pattern %zu\n", i);
+            return false;
+        }
+        total += len;
+        for (size_t j = 0; j < len; j++) {
+            unsigned char c = (unsigned char)patterns[i][j];
+            used[nocase ? tolower(c) : c] = true;
+        }
+    }
+
+    matcher->num_classes = 1;
+    for (int c = 0; c < 256; c++) {
+        if (used[c])
+            matcher->byte_class[c] = (uint8_t)matcher->num_classes++;
+    }
+    if (nocase) {
+        for (int c = 'A'; c <= 'Z'; c++)
+            matcher->byte_class[c] = matcher->byte_class[tolower(c)];
+    }
+
+    size_t max_states = total + 1;
+    size_t width = matcher->num_classes;
+    matcher->next = (uint32_t*)calloc(max_states * width, sizeof(uint32_t));
+    matcher->output = (uint32_t*)malloc(max_states * sizeof(uint32_t));
+    matcher->output_link = (uint32_t*)calloc(max_states, sizeof(uint32_t));
+    matcher->pattern_next = (uint32_t*)malloc(num_patterns * sizeof(uint32_t));
+    matcher->lengths = (size_t*)malloc(num_patterns * sizeof(size_t));
+    uint32_t* fail = (uint32_t*)calloc(max_states, sizeof(uint32_t));
+    uint32_t* queue = (uint32_t*)malloc(max_states * sizeof(uint32_t));
+    if (!matcher->next || !matcher->output || !matcher->output_link || !matcher->pattern_next || !matcher->lengths ||
+        !fail || !queue) {
+        perror("Failed to allocate memory for matcher");
+        free(fail);
+        free(queue);
+        multipart_matcher_free(matcher);
+        return false;
+    }
+    for (size_t s = 0; s < max_states; s++)
+        matcher->output[s] = NO_PATTERN;
+
+    // Build the trie. State 0 is the root, so a zero transition means there is no child yet.
+    uint32_t num_states = 1;
+    for (size_t i = 0; i < num_patterns; i++) {
+        size_t len = lengths ? lengths[i] : strlen(patterns[i]);
+        uint32_t s = 0;
+        for (size_t j = 0; j < len; j++) {
+            uint32_t* t = &matcher->next[s * width + matcher->byte_class[(unsigned char)patterns[i][j]]];
+            if (*t == 0)
+                *t = num_states++;
+            s = *t;
+        }
+        // Identical patterns end in the same state and are chained.
+        matcher->pattern_next[i] = matcher->output[s];
+        matcher->output[s] = (uint32_t)i;
+        matcher->lengths[i] = len;
+    }
+
+    // Breadth first, turn the trie into a complete automaton: missing transitions take the one of
+    // the longest proper suffix (the failure state), and each state links to the next state along
+    // its suffix chain that ends a pattern.
+    size_t head = 0, tail = 0;
+    for (size_t c = 0; c < width; c++) {
+        if (matcher->next[c])
+            queue[tail++] = matcher->next[c];
+    }
+    while (head < tail) {
+        uint32_t r = queue[head++];
+        for (size_t c = 0; c < width; c++) {
+            uint32_t* t = &matcher->next[r * width + c];
+            uint32_t via_fail = matcher->next[fail[r] * width + c];
+            if (*t == 0) {
+                *t = via_fail;
+                continue;
+            }
+            uint32_t s = *t;
+            fail[s] = via_fail;
+            matcher->output_link[s] =
+                matcher->output[via_fail] != NO_PATTERN ? via_fail : matcher->output_link[via_fail];
+            queue[tail++] = s;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    matcher->num_states = num_states;
+    matcher->num_patterns = num_patterns;
+    return true;
+}
+
+bool multipart_matcher_scan(const MultipartMatcher* matcher, const char* data, size_t size,
+                            MultipartMatchCallback callback, void* userdata) {
+    if (matcher->num_patterns == 0)
+        return true;
+
+    const uint32_t* next = matcher->next;
+    const uint8_t* byte_class = matcher->byte_class;
+    size_t width = matcher->num_classes;
+    uint32_t s = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        s = next[s * width + byte_class[(unsigned char)data[i]]];
+        if (matcher->output[s] == NO_PATTERN && matcher->output_link[s] == 0)
+            continue;
+
+        // Report every pattern ending here, longest first.
+        for (uint32_t t = matcher->output[s] != NO_PATTERN ? s : matcher->output_link[s]; t != 0;
+             t = matcher->output_link[t]) {
+            for (uint32_t p = matcher->output[t]; p != NO_PATTERN; p = matcher->pattern_next[p]) {
+                if (!callback(p, i + 1 - matcher->lengths[p], userdata))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+void multipart_matcher_free(MultipartMatcher* matcher) {
+    free(matcher->next);
+    free(matcher->output);
+    free(matcher->output_link);
+    free(matcher->pattern_next);
+    free(matcher->lengths);
+    memset(matcher, 0, sizeof(MultipartMatcher));
+}
@@ -0,0 +1,115 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_parts.c                                                                #
+// Walks the parts of a multipart body: boundary, header lines, then the span of the      #
+// part's bytes up to the next delimiter. Boundaries are found with multipart_search.     #
+// The header lines of a part are split into name and value slices.                       #
+//=========================================================================================
+#define _GNU_SOURCE  // for memmem
+
+#include <string.h>
+#include <strings.h>
+
+#include "multipart_parts.h"
+
+// Finds the CRLF and boundary that end the part whose bytes start at p.
+static const char* find_delimiter(const MultipartPartIterator* it, const char* p) {
+    const char* q = p;
+    while ((q = multipart_search(q, it->end - q, it->boundary, it->boundary_length)) != NULL) {
+        if (q - p >= 2 && q[-2] == '\r' && q[-1] == '\n')
+            return q - 2;
+        q++;
+    }
+    return NULL;
+}
+
+bool multipart_parts_begin(MultipartPartIterator* it, const char* data, size_t size, const char* boundary) {
+    it->data = data;
+    it->end = data + size;
+    it->boundary = boundary;
+    it->boundary_length = strlen(boundary);
+    it->code = MULTIPART_OK;
+    it->part = it->boundary_length > 0 ? multipart_search(data, size, boundary, it->boundary_length) : NULL;
+    if (!it->part) {
+        it->code = INVALID_FORM_BOUNDARY;
+        return false;
+    }
+    return true;
+}
+
+bool multipart_parts_next(MultipartPartIterator* it, MultipartPartSpan* span) {
+    if (it->code != MULTIPART_OK)
+        return false;
+
+    const char* p = it->part + it->boundary_length;
+    if (it->end - p >= 2 && memcmp(p, "--", 2) == 0)
+        return false;  // Closing boundary.
+    if (it->end - p < 2 || memcmp(p, "\r\n", 2) != 0)
+        goto broken;
+
+    const char* headers = p + 2;
+    const char* next = find_delimiter(it, headers);
+    if (!next)
+        goto broken;
+
+    // The blank line ending the headers may share its CRLF with the delimiter if the part is empty.
+    const char* headers_end = memmem(headers, next + 2 - headers, "\r\n\r\n", 4);
+    if (!headers_end)
+        goto broken;
+    const char* content = headers_end + 4 < next ? headers_end + 4 : next;
+
+    span->start = it->part;
+    span->headers = headers;
+    span->headers_size = headers_end + 2 - headers;
+    span->content = content;
+    span->size = next - content;
+    span->next = next;
+    it->part = next + 2;
+    return true;
+
+broken:
+    it->code = INVALID_FORM_BOUNDARY;
+    return false;
+}
+
+void multipart_headers_begin(MultipartHeaderIterator* it, const MultipartPartSpan* span) {
+    it->line = span->headers;
+    it->end = span->headers + span->headers_size;
+}
+
+bool multipart_headers_next(MultipartHeaderIterator* it, MultipartHeaderLine* header) {
+    // Each line ends with CRLF, the last one included.
+    while (it->line < it->end) {
+        const char* line = it->line;
+        const char* eol = memmem(line, it->end - line, "\r\n", 2);
+        it->line = eol + 2;
+
+        const char* colon = memchr(line, ':', eol - line);
+        if (!colon)
+            continue;
+        const char* value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+
+        header->name = line;
+        header->name_length = colon - line;
+        header->value = value;
+        header->value_length = eol - value;
+        return true;
+    }
+    return false;
+}
+
+bool multipart_header_is(const MultipartHeaderLine* header, const char* name) {
+    size_t length = strlen(name);
+    return header->name_length == length && strncasecmp(header->name, name, length) == 0;
+}
+
+MultipartCode multipart_header_copy_content_type(const MultipartHeaderLine* header,
+                                                 char content_type[MAX_MIMETYPE_SIZE]) {
+    if (header->value_length >= MAX_MIMETYPE_SIZE)
+        return MIMETYPE_TOO_LONG;
+    memcpy(content_type, header->value, header->value_length);
+    content_type[header->value_length] = '\0';
+    return MULTIPART_OK;
+}
@@ -0,0 +1,66 @@
+#ifndef __MULTIPART_PARTS_H__
+#define __MULTIPART_PARTS_H__
+
+// Internal to the library: walks the framing of a multipart body and the header lines of its
+// parts without interpreting them. Shared by the proxy and the byteranges and related parsers,
+// which only need the span of each part and a few of its headers. Not installed with multipart.h.
+
+#include "multipart.h"
+
+typedef struct MultipartPartIterator {
+    const char* data;  // Whole body.
+    const char* end;
+    const char* boundary;
+    size_t boundary_length;
+    const char* part;    // Boundary line of the next part, or the closing boundary once done.
+    MultipartCode code;  // INVALID_FORM_BOUNDARY once the framing turned out broken.
+} MultipartPartIterator;
+
+// One part, as pointers into the body.
+typedef struct MultipartPartSpan {
+    const char* start;    // The boundary opening the part.
+    const char* headers;  // First header line.
+    size_t headers_size;  // Header lines, each with its CRLF, without the blank line.
+    const char* content;  // First byte of the part's body.
+    size_t size;          // Bytes of the part's body.
+    const char* next;     // CRLF and boundary ending the part.
+} MultipartPartSpan;
+
+// Starts at the first boundary of data; anything before it is a preamble.
+// Returns: false if data holds no boundary.
+bool multipart_parts_begin(MultipartPartIterator* it, const char* data, size_t size, const char* boundary);
+
+// Moves to the next part.
+// Returns: true with the part in span, false at the closing boundary or if the framing is broken,
+// which leaves it->code set to INVALID_FORM_BOUNDARY.
+bool multipart_parts_next(MultipartPartIterator* it, MultipartPartSpan* span);
+
+typedef struct MultipartHeaderIterator {
+    const char* line;  // Next header line.
+    const char* end;   // End of the header lines of the part.
+} MultipartHeaderIterator;
+
+// One "Name: value" header line, as slices of the part's headers.
+typedef struct MultipartHeaderLine {
+    const char* name;
+    size_t name_length;
+    const char* value;    // Value without the whitespace after the colon.
+    size_t value_length;  // Up to the CRLF ending the line.
+} MultipartHeaderLine;
+
+// Starts at the first header line of span.
+void multipart_headers_begin(MultipartHeaderIterator* it, const MultipartPartSpan* span);
+
+// Moves to the next header line, skipping lines without a colon.
+// Returns: false once all header lines have been read.
+bool multipart_headers_next(MultipartHeaderIterator* it, MultipartHeaderLine* header);
+
+// Returns: true if the header is called name, compared case-insensitively.
+bool multipart_header_is(const MultipartHeaderLine* header, const char* name);
+
+// Copies the value of a Content-Type header into content_type.
+// Returns: MIMETYPE_TOO_LONG if it does not fit.
+MultipartCode multipart_header_copy_content_type(const MultipartHeaderLine* header,
+                                                 char content_type[MAX_MIMETYPE_SIZE]);
+
+#endif /* __MULTIPART_PARTS_H__ */
@@ -0,0 +1,175 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_pipe.c                                                                 #
+// Feeds file parts into pipes, e.g. the stdin of a transcoder, without an intermediate   #
+// file. Pages of the body are handed to the pipe with vmsplice, or moved from a spooled  #
+// body file with splice, so the bytes are not copied through user space.                 #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+// Waits until a non-blocking pipe has room again.
+static bool wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+// Plain write loop for when fd is not a pipe.
+static bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_writable(fd))
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool multipart_pipe_file(const FileHeader* file, const char* body, int pipe_fd) {
+    const char* p = body + file->offset;
+    size_t remaining = file->size;
+
+    while (remaining > 0) {
+        struct iovec iov = {.iov_base = (void*)p, .iov_len = remaining};
+        ssize_t n = vmsplice(pipe_fd, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_writable(pipe_fd))
+                continue;
+
+            // Not a pipe, fall back to copying.
+            if (errno == EBADF || errno == EINVAL || errno == ENOSYS) {
+                if (write_all(pipe_fd, p, remaining))
+                    return true;
+            }
+            perror("Failed to write file to pipe");
+            return false;
+        }
+        p += n;
+        remaining -= n;
+    }
+    return true;
+}
+
+bool multipart_pipe_file_from_fd(const FileHeader* file, int body_fd, off_t body_offset, int pipe_fd) {
+    off_t offset = body_offset + (off_t)file->offset;
+    size_t remaining = file->size;
+    bool use_splice = true;
+    char buf[MULTIPART_SINK_BLOCK_SIZE];
+
+    while (remaining > 0) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(body_fd, &offset, pipe_fd, NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+            // The body file or the output does not support splice.
+            if (n < 0 && errno == EINVAL) {
+                use_splice = false;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN && wait_writable(pipe_fd))
+                continue;
+        } else {
+            n = pread(body_fd, buf, remaining > sizeof(buf) ? sizeof(buf) : remaining, offset);
+            if (n > 0) {
+                if (!write_all(pipe_fd, buf, n)) {
+                    perror("Failed to write file to pipe");
+                    return false;
+                }
+                offset += n;
+            }
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0) {
+            perror("Failed to write file to pipe");
+            return false;
+        }
+
+        if (n == 0) {
+            fprintf(stderr, "Body file ends before the end of %s\n", file->filename);
+            return false;
+        }
+        remaining -= n;
+    }
+    return true;
+}
+
+bool multipart_pipe_file_to_command(const FileHeader* file, const char* body, char* const argv[], int* exit_status) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("Failed to create pipe");
+        return false;
+    }
+
+    // dup2 clears O_CLOEXEC on the child's stdin, both pipe ends are closed on exec.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[0]);
+
+    if (err != 0) {
+        fprintf(stderr, "Failed to start %s: %s\n", argv[0], strerror(err));
+        close(fds[1]);
+        return false;
+    }
+
+    // A command that exits without reading everything must not kill us with SIGPIPE.
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    bool ok = multipart_pipe_file(file, body, fds[1]);
+    close(fds[1]);
+
+    if (!ok) {
+        const struct timespec zero = {0, 0};
+        while (sigtimedwait(&sigpipe, NULL, &zero) == SIGPIPE) {
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // Waiting for the command also guarantees it is done with the spliced pages of body.
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Failed to wait for command");
+            return false;
+        }
+    }
+
+    if (exit_status)
+        *exit_status = status;
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
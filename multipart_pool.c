@@ -0,0 +1,103 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_pool.c                                                                 #
+// Lock-free pool of parser contexts shared by any number of threads. Free contexts form  #
+// a Treiber stack whose head packs a generation with the top index, so a context that is #
+// popped and pushed back between a load and a CAS cannot corrupt the list (ABA).         #
+//=========================================================================================
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multipart.h"
+
+// The head holds the generation in the high 32 bits and index + 1 of the top context in the
+// low 32 bits, 0 for an empty stack.
+static inline uint64_t make_head(uint64_t old_head, uint32_t top) {
+    return (((old_head >> 32) + 1) << 32) | top;
+}
+
+static void push(MultipartContextPool* pool, MultipartContext* context) {
+    uint32_t top = (uint32_t)(context - pool->contexts) + 1;
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&context->next, (uint32_t)head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, make_head(head, top), memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+bool multipart_context_pool_init(MultipartContextPool* pool, size_t num_contexts, size_t body_capacity,
+                                 MultipartContextInit init, MultipartContextDestroy destroy, void* userdata) {
+    memset(pool, 0, sizeof(MultipartContextPool));
+    if (num_contexts == 0 || num_contexts >= UINT32_MAX) {
+        fprintf(stderr, "Invalid number of parser contexts: %zu\n", num_contexts);
+        return false;
+    }
+
+    // Contexts are cache line aligned, so threads working on neighbours do not share lines.
+    size_t size = num_contexts * sizeof(MultipartContext);
+    pool->contexts = (MultipartContext*)aligned_alloc(_Alignof(MultipartContext), size);
+    if (!pool->contexts) {
+        perror("Failed to allocate memory for parser contexts");
+        return false;
+    }
+    memset(pool->contexts, 0, size);
+    pool->destroy = destroy;
+    pool->userdata = userdata;
+    atomic_init(&pool->head, 0);
+
+    for (size_t i = 0; i < num_contexts; i++) {
+        MultipartContext* context = &pool->contexts[i];
+        atomic_init(&context->next, 0);
+        if ((body_capacity > 0 && !multipart_body_init(&context->body, body_capacity)) ||
+            (init && !init(context, userdata))) {
+            // destroy is only called for the contexts init succeeded on.
+            multipart_body_free(&context->body);
+            multipart_context_pool_free(pool);
+            return false;
+        }
+        pool->num_contexts = i + 1;
+    }
+
+    // Pushed in reverse so the first acquire gets the first context.
+    for (size_t i = num_contexts; i > 0; i--)
+        push(pool, &pool->contexts[i - 1]);
+    return true;
+}
+
+MultipartContext* multipart_context_acquire(MultipartContextPool* pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    for (;;) {
+        uint32_t top = (uint32_t)head;
+        if (top == 0)
+            return NULL;
+
+        // next may be stale if another thread pops this context first, the generation then
+        // makes the CAS fail.
+        MultipartContext* context = &pool->contexts[top - 1];
+        uint32_t next = atomic_load_explicit(&context->next, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&pool->head, &head, make_head(head, next), memory_order_acquire,
+                                                  memory_order_acquire))
+            return context;
+    }
+}
+
+void multipart_context_release(MultipartContextPool* pool, MultipartContext* context) {
+    multipart_reset_form(&context->form);
+    if (context->body.data)
+        multipart_body_reset(&context->body);
+    push(pool, context);
+}
+
+void multipart_context_pool_free(MultipartContextPool* pool) {
+    for (size_t i = 0; i < pool->num_contexts; i++) {
+        MultipartContext* context = &pool->contexts[i];
+        if (pool->destroy)
+            pool->destroy(context, pool->userdata);
+        multipart_free_form(&context->form);
+        multipart_body_free(&context->body);
+    }
+    free(pool->contexts);
+    memset(pool, 0, sizeof(MultipartContextPool));
+}
@@ -0,0 +1,241 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_proxy.c                                                                #
+// Re-frames a multipart body on its way upstream, keeping, dropping or replacing parts.  #
+// Only the part framing is parsed. Kept bytes are written straight from the body with    #
+// writev, or moved from a spooled body file with splice/sendfile.                        #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "multipart_parts.h"
+
+// Number of iovecs gathered before a writev.
+#define PROXY_MAX_IOV 64
+
+typedef struct ProxyWriter {
+    int fd;
+    bool is_pipe;
+    int body_fd;
+    off_t body_offset;
+    struct iovec iov[PROXY_MAX_IOV];
+    int count;
+} ProxyWriter;
+
+static bool wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static bool proxy_flush(ProxyWriter* writer) {
+    struct iovec* iov = writer->iov;
+    int count = writer->count;
+    while (count > 0) {
+        ssize_t n = writev(writer->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_writable(writer->fd))
+                continue;
+            perror("Failed to write proxied body");
+            return false;
+        }
+
+        // Skip what was written, the last iovec may be partially written.
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    writer->count = 0;
+    return true;
+}
+
+// Queues bytes that stay valid until the proxy returns. Adjacent ranges are merged so kept parts
+// in a row become one iovec.
+static bool proxy_write(ProxyWriter* writer, const char* data, size_t size) {
+    if (size == 0)
+        return true;
+
+    if (writer->count > 0) {
+        struct iovec* last = &writer->iov[writer->count - 1];
+        if ((const char*)last->iov_base + last->iov_len == data) {
+            last->iov_len += size;
+            return true;
+        }
+    }
+
+    if (writer->count == PROXY_MAX_IOV && !proxy_flush(writer))
+        return false;
+    writer->iov[writer->count++] = (struct iovec){.iov_base = (void*)data, .iov_len = size};
+    return true;
+}
+
+// Copies bytes of the body from body_fd inside the kernel: splice into pipes, sendfile otherwise.
+static bool proxy_write_from_fd(ProxyWriter* writer, size_t offset, size_t size) {
+    if (!proxy_flush(writer))
+        return false;
+
+    FileHeader range = {.offset = offset, .size = size};
+    if (writer->is_pipe)
+        return multipart_pipe_file_from_fd(&range, writer->body_fd, writer->body_offset, writer->fd);
+
+    off_t pos = writer->body_offset + (off_t)offset;
+    while (size > 0) {
+        ssize_t n = sendfile(writer->fd, writer->body_fd, &pos, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN && wait_writable(writer->fd))
+            continue;
+
+        // sendfile does not support this pair of descriptors, copy what is left.
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            range.offset = (size_t)(pos - writer->body_offset);
+            range.size = size;
+            return multipart_pipe_file_from_fd(&range, writer->body_fd, writer->body_offset, writer->fd);
+        }
+
+        if (n <= 0) {
+            if (n == 0)
+                fprintf(stderr, "Body file ends before the end of the part\n");
+            else
+                perror("Failed to send proxied part");
+            return false;
+        }
+        size -= n;
+    }
+    return true;
+}
+
+// Finds the Content-Disposition header of a part. Like multipart_parse_form, names are only taken
+// from it, so another header carrying name=" can not make the callback see a different part than
+// the upstream parser does.
+static bool find_disposition(const MultipartPartSpan* span, MultipartHeaderLine* disposition) {
+    MultipartHeaderIterator it;
+    multipart_headers_begin(&it, span);
+    while (multipart_headers_next(&it, disposition)) {
+        if (multipart_header_is(disposition, "Content-Disposition"))
+            return true;
+    }
+    return false;
+}
+
+// Finds the quoted value of param (e.g. name=") in a Content-Disposition value. A match must
+// start the value or follow a space or ';', so name=" does not match inside filename=".
+// Returns: the length of the value, or -1 if the parameter is missing.
+static ssize_t disposition_param(const MultipartHeaderLine* disposition, const char* param, const char** value) {
+    size_t param_length = strlen(param);
+    const char* start = disposition->value;
+    const char* end = start + disposition->value_length;
+    const char* p = start;
+
+    while ((p = memmem(p, end - p, param, param_length)) != NULL) {
+        if (p == start || p[-1] == ' ' || p[-1] == ';') {
+            *value = p + param_length;
+            const char* quote = memchr(*value, '"', end - *value);
+            return quote ? quote - *value : -1;
+        }
+        p += param_length;
+    }
+    return -1;
+}
+
+MultipartCode multipart_proxy_form(const char* body, size_t size, const char* boundary, int out_fd, int body_fd,
+                                   off_t body_offset, MultipartProxyCallback callback, void* userdata) {
+    ProxyWriter writer = {.fd = out_fd, .body_fd = body_fd, .body_offset = body_offset};
+    struct stat st;
+    writer.is_pipe = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+
+    // Anything before the first boundary is a preamble and is not forwarded.
+    MultipartPartIterator it;
+    MultipartPartSpan span;
+    if (!multipart_parts_begin(&it, body, size, boundary))
+        return it.code;
+
+    for (size_t index = 0; multipart_parts_next(&it, &span); index++) {
+        const char* part = span.start;
+        const char* content = span.content;
+        const char* next = span.next;
+
+        MultipartHeaderLine disposition;
+        bool has_disposition = find_disposition(&span, &disposition);
+
+        char name[MAX_FIELD_NAME_SIZE] = {0};
+        char filename[MAX_FILENAME_SIZE] = {0};
+        const char* value;
+        ssize_t length = has_disposition ? disposition_param(&disposition, "name=\"", &value) : -1;
+        if (length >= MAX_FIELD_NAME_SIZE)
+            return FIELD_NAME_TOO_LONG;
+        if (length > 0)
+            memcpy(name, value, length);
+
+        length = has_disposition ? disposition_param(&disposition, "filename=\"", &value) : -1;
+        if (length >= MAX_FILENAME_SIZE)
+            return FILENAME_TOO_LONG;
+        if (length > 0)
+            memcpy(filename, value, length);
+
+        MultipartProxyPart info = {
+            .name = name,
+            .filename = length >= 0 ? filename : NULL,
+            .headers = span.headers,
+            .headers_size = span.headers_size,
+            .offset = content - body,
+            .size = span.size,
+            .index = index,
+        };
+
+        const char* replacement = NULL;
+        size_t replacement_size = 0;
+        MultipartProxyAction action = callback(&info, &replacement, &replacement_size, userdata);
+
+        bool ok = true;
+        switch (action) {
+            case MULTIPART_PROXY_KEEP:
+                if (body_fd >= 0 && info.filename) {
+                    ok = proxy_write(&writer, part, content - part) &&
+                         proxy_write_from_fd(&writer, info.offset, info.size) && proxy_write(&writer, next, 2);
+                } else {
+                    // Boundary, headers, content and the CRLF ending it.
+                    ok = proxy_write(&writer, part, next + 2 - part);
+                }
+                break;
+            case MULTIPART_PROXY_REPLACE:
+                ok = proxy_write(&writer, part, content - part) &&
+                     proxy_write(&writer, replacement, replacement_size) && proxy_write(&writer, next, 2);
+                break;
+            case MULTIPART_PROXY_DROP:
+                break;
+            default:
+                return CALLBACK_ABORTED;
+        }
+        if (!ok)
+            return OUTPUT_WRITE_FAILED;
+    }
+    if (it.code != MULTIPART_OK)
+        return it.code;
+
+    // Closing boundary. The epilogue after it is not forwarded either.
+    if (!proxy_write(&writer, it.part, it.boundary_length) || !proxy_write(&writer, "--\r\n", 4) ||
+        !proxy_flush(&writer))
+        return OUTPUT_WRITE_FAILED;
+    return MULTIPART_OK;
+}
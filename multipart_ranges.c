@@ -0,0 +1,133 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_ranges.c                                                               #
+// Parses multipart/byteranges responses (RFC 9110 section 14.6) into descriptors of the  #
+// ranges they carry. Like FileHeader, a descriptor is an offset and size into the body,  #
+// so ranges can be written or spliced into a cache without being copied out first.       #
+//=========================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "multipart_parts.h"
+
+static bool append_range(MultipartByteRanges* ranges, const MultipartByteRange* range) {
+    if (ranges->num_ranges == ranges->capacity) {
+        size_t capacity = ranges->capacity ? ranges->capacity * 2 : 4;
+        MultipartByteRange* grown = (MultipartByteRange*)realloc(ranges->ranges, capacity * sizeof(MultipartByteRange));
+        if (!grown) {
+            perror("Failed to allocate memory for byte ranges");
+            return false;
+        }
+        ranges->ranges = grown;
+        ranges->capacity = capacity;
+    }
+    ranges->ranges[ranges->num_ranges++] = *range;
+    return true;
+}
+
+// Parses the decimal number at *p, which must not run past end.
+static bool parse_number(const char** p, const char* end, uint64_t* value) {
+    const char* s = *p;
+    uint64_t v = 0;
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (v > (UINT64_MAX - 9) / 10)
+            return false;
+        v = v * 10 + (uint64_t)(*s - '0');
+        s++;
+    }
+    if (s == *p)
+        return false;
+    *p = s;
+    *value = v;
+    return true;
+}
+
+// Parses "bytes first-last/complete" where complete may be "*".
+static bool parse_content_range(const char* p, const char* end, MultipartByteRange* range) {
+    while (p < end && *p == ' ')
+        p++;
+    if (end - p < 6 || strncasecmp(p, "bytes ", 6) != 0)
+        return false;
+    p += 6;
+
+    if (!parse_number(&p, end, &range->first) || p == end || *p++ != '-' || !parse_number(&p, end, &range->last) ||
+        p == end || *p++ != '/' || range->last < range->first)
+        return false;
+
+    range->complete_length = 0;
+    if (p < end && *p == '*') {
+        p++;
+    } else if (!parse_number(&p, end, &range->complete_length) || range->last >= range->complete_length) {
+        return false;
+    }
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p == end;
+}
+
+// Reads the Content-Range and Content-Type headers of one part.
+static MultipartCode parse_part_headers(const MultipartPartSpan* span, MultipartByteRange* range) {
+    bool has_range = false;
+    MultipartHeaderIterator it;
+    MultipartHeaderLine header;
+    multipart_headers_begin(&it, span);
+    while (multipart_headers_next(&it, &header)) {
+        if (multipart_header_is(&header, "Content-Range")) {
+            if (!parse_content_range(header.value, header.value + header.value_length, range))
+                return INVALID_CONTENT_RANGE;
+            has_range = true;
+        } else if (multipart_header_is(&header, "Content-Type")) {
+            MultipartCode code = multipart_header_copy_content_type(&header, range->content_type);
+            if (code != MULTIPART_OK)
+                return code;
+        }
+    }
+    return has_range ? MULTIPART_OK : INVALID_CONTENT_RANGE;
+}
+
+MultipartCode multipart_parse_byteranges(const char* data, size_t size, const char* boundary,
+                                         MultipartByteRanges* ranges) {
+    memset(ranges, 0, sizeof(MultipartByteRanges));
+    MultipartCode code = MULTIPART_OK;
+
+    MultipartPartIterator it;
+    MultipartPartSpan span;
+    if (!multipart_parts_begin(&it, data, size, boundary))
+        return it.code;
+
+    while (multipart_parts_next(&it, &span)) {
+        MultipartByteRange range = {0};
+        code = parse_part_headers(&span, &range);
+        if (code != MULTIPART_OK)
+            goto fail;
+
+        // The part must hold exactly the bytes its Content-Range announces.
+        range.offset = span.content - data;
+        range.size = span.size;
+        if (range.last - range.first + 1 != range.size) {
+            code = INVALID_CONTENT_RANGE;
+            goto fail;
+        }
+
+        if (!append_range(ranges, &range)) {
+            code = MEMORY_ALLOC_ERROR;
+            goto fail;
+        }
+    }
+    code = it.code;
+    if (code != MULTIPART_OK)
+        goto fail;
+    return MULTIPART_OK;
+
+fail:
+    multipart_free_byteranges(ranges);
+    return code;
+}
+
+void multipart_free_byteranges(MultipartByteRanges* ranges) {
+    free(ranges->ranges);
+    memset(ranges, 0, sizeof(MultipartByteRanges));
+}
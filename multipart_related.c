@@ -0,0 +1,212 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_related.c                                                              #
+// Parses multipart/related bodies (RFC 2387) such as SOAP MTOM messages. Parts are       #
+// described by offsets into the body like FileHeader, and indexed by Content-ID in an    #
+// open-addressed hash table so the references of the root part resolve in O(1).          #
+//=========================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "multipart_parts.h"
+
+static bool append_part(MultipartRelated* related, const MultipartRelatedPart* part) {
+    if (related->num_parts == related->capacity) {
+        size_t capacity = related->capacity ? related->capacity * 2 : 4;
+        MultipartRelatedPart* grown =
+            (MultipartRelatedPart*)realloc(related->parts, capacity * sizeof(MultipartRelatedPart));
+        if (!grown) {
+            perror("Failed to allocate memory for related parts");
+            return false;
+        }
+        related->parts = grown;
+        related->capacity = capacity;
+    }
+    related->parts[related->num_parts++] = *part;
+    return true;
+}
+
+// FNV-1a.
+static uint64_t hash_id(const char* id, size_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Copies a Content-ID value into id, dropping the angle brackets and surrounding whitespace.
+static bool copy_content_id(const char* value, const char* end, char* id) {
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    if (end - value >= 2 && *value == '<' && end[-1] == '>') {
+        value++;
+        end--;
+    }
+    size_t length = end - value;
+    if (length == 0 || length >= MULTIPART_CONTENT_ID_SIZE)
+        return false;
+    memcpy(id, value, length);
+    id[length] = '\0';
+    return true;
+}
+
+// Reads the Content-ID and Content-Type headers of one part.
+static MultipartCode parse_part_headers(const MultipartPartSpan* span, MultipartRelatedPart* part) {
+    MultipartHeaderIterator it;
+    MultipartHeaderLine header;
+    multipart_headers_begin(&it, span);
+    while (multipart_headers_next(&it, &header)) {
+        if (multipart_header_is(&header, "Content-ID")) {
+            if (!copy_content_id(header.value, header.value + header.value_length, part->content_id))
+                return INVALID_CONTENT_ID;
+        } else if (multipart_header_is(&header, "Content-Type")) {
+            MultipartCode code = multipart_header_copy_content_type(&header, part->content_type);
+            if (code != MULTIPART_OK)
+                return code;
+        }
+    }
+    return MULTIPART_OK;
+}
+
+// Returns the slot holding id, or the empty slot where it would be inserted.
+static uint32_t* find_slot(const MultipartRelated* related, const char* id, size_t length) {
+    size_t mask = related->index_size - 1;
+    size_t i = (size_t)hash_id(id, length) & mask;
+    for (;;) {
+        uint32_t* slot = &related->index[i];
+        if (*slot == 0)
+            return slot;
+        const char* other = related->parts[*slot - 1].content_id;
+        if (strncmp(other, id, length) == 0 && other[length] == '\0')
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+// Builds the index once all parts are known, with at most half of the slots used.
+static MultipartCode build_index(MultipartRelated* related) {
+    size_t index_size = 4;
+    while (index_size < related->num_parts * 2)
+        index_size *= 2;
+    related->index = (uint32_t*)calloc(index_size, sizeof(uint32_t));
+    if (!related->index) {
+        perror("Failed to allocate memory for Content-ID index");
+        return MEMORY_ALLOC_ERROR;
+    }
+    related->index_size = index_size;
+
+    for (size_t i = 0; i < related->num_parts; i++) {
+        const char* id = related->parts[i].content_id;
+        if (id[0] == '\0')
+            continue;
+        uint32_t* slot = find_slot(related, id, strlen(id));
+        if (*slot != 0) {
+            fprintf(stderr, "Duplicate Content-ID: %s\n", id);
+            return DUPLICATE_CONTENT_ID;
+        }
+        *slot = (uint32_t)(i + 1);
+    }
+    return MULTIPART_OK;
+}
+
+MultipartCode multipart_parse_related(const char* data, size_t size, const char* boundary, MultipartRelated* related) {
+    memset(related, 0, sizeof(MultipartRelated));
+    MultipartCode code = MULTIPART_OK;
+
+    MultipartPartIterator it;
+    MultipartPartSpan span;
+    if (!multipart_parts_begin(&it, data, size, boundary))
+        return it.code;
+
+    while (multipart_parts_next(&it, &span)) {
+        // The index holds part numbers + 1 in 32 bits.
+        if (related->num_parts == UINT32_MAX - 1) {
+            code = INVALID_FORM_BOUNDARY;
+            goto fail;
+        }
+
+        MultipartRelatedPart info = {
+            .offset = span.content - data,
+            .size = span.size,
+            .headers_offset = span.headers - data,
+            .headers_size = span.headers_size,
+        };
+        code = parse_part_headers(&span, &info);
+        if (code != MULTIPART_OK)
+            goto fail;
+
+        if (!append_part(related, &info)) {
+            code = MEMORY_ALLOC_ERROR;
+            goto fail;
+        }
+    }
+    code = it.code;
+    if (code != MULTIPART_OK)
+        goto fail;
+
+    code = build_index(related);
+    if (code != MULTIPART_OK)
+        goto fail;
+    return MULTIPART_OK;
+
+fail:
+    multipart_free_related(related);
+    return code;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+const MultipartRelatedPart* multipart_related_find(const MultipartRelated* related, const char* content_id) {
+    if (related->index_size == 0)
+        return NULL;
+
+    char id[MULTIPART_CONTENT_ID_SIZE];
+    size_t length = 0;
+    if (strncasecmp(content_id, "cid:", 4) == 0) {
+        // RFC 2392: the URL is the Content-ID with unsafe characters %-escaped.
+        for (const char* p = content_id + 4; *p; p++) {
+            char c = *p;
+            if (c == '%' && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0) {
+                c = (char)(hex_value(p[1]) * 16 + hex_value(p[2]));
+                p += 2;
+            }
+            if (c == '\0' || length + 1 >= sizeof(id))
+                return NULL;
+            id[length++] = c;
+        }
+        id[length] = '\0';
+    } else if (!copy_content_id(content_id, content_id + strlen(content_id), id)) {
+        return NULL;
+    } else {
+        length = strlen(id);
+    }
+
+    uint32_t* slot = find_slot(related, id, length);
+    return *slot ? &related->parts[*slot - 1] : NULL;
+}
+
+const MultipartRelatedPart* multipart_related_root(const MultipartRelated* related, const char* start) {
+    if (start && start[0] != '\0')
+        return multipart_related_find(related, start);
+    return related->num_parts > 0 ? &related->parts[0] : NULL;
+}
+
+void multipart_free_related(MultipartRelated* related) {
+    free(related->parts);
+    free(related->index);
+    memset(related, 0, sizeof(MultipartRelated));
+}
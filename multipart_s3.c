@@ -0,0 +1,496 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_s3.c                                                                   #
+// Sink stage that streams file parts to an S3-compatible object store (AWS S3, MinIO)    #
+// with the multipart upload protocol. Fixed size parts are PUT by worker threads while   #
+// the sink is still fed the rest of the file. Requests are signed with SigV4 and sent    #
+// over plain HTTP/1.1, one connection per request; terminate TLS in front if needed.     #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+#define S3_RESPONSE_SIZE 16384
+
+typedef struct S3Response {
+    int status;
+    char etag[MULTIPART_S3_ETAG_SIZE];
+    char data[S3_RESPONSE_SIZE];  // Raw response, truncated if longer.
+    size_t size;
+    const char* body;  // Points into data.
+} S3Response;
+
+// Percent-encodes s as SigV4 requires: everything but A-Z a-z 0-9 - _ . ~ (and / in paths).
+static bool uri_encode(const char* s, bool keep_slash, char* out, size_t out_size) {
+    static const char digits[] = "0123456789ABCDEF";
+    size_t n = 0;
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+        if (n + 4 > out_size)
+            return false;
+
+        if ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') || *p == '-' ||
+            *p == '_' || *p == '.' || *p == '~' || (keep_slash && *p == '/')) {
+            out[n++] = (char)*p;
+        } else {
+            out[n++] = '%';
+            out[n++] = digits[*p >> 4];
+            out[n++] = digits[*p & 0x0f];
+        }
+    }
+    out[n] = '\0';
+    return true;
+}
+
+static bool hmac(const void* key, size_t key_size, const char* data, unsigned char mac[MULTIPART_DIGEST_SIZE]) {
+    return multipart_hmac_sha256(key, key_size, data, strlen(data), mac);
+}
+
+static int s3_connect(const MultipartS3Config* config) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res;
+    int err = getaddrinfo(config->host, config->port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", config->host, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        // A stalled store must not hang the upload forever.
+        struct timeval timeout = {.tv_sec = MULTIPART_S3_TIMEOUT, .tv_usec = 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "Failed to connect to %s:%s\n", config->host, config->port);
+    return fd;
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to send S3 request");
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads the response until the server closes the connection and parses the status line and ETag.
+static bool read_response(int fd, S3Response* resp) {
+    resp->size = 0;
+    for (;;) {
+        char discard[4096];
+        char* dst = resp->size < sizeof(resp->data) - 1 ? resp->data + resp->size : discard;
+        size_t room = dst == discard ? sizeof(discard) : sizeof(resp->data) - 1 - resp->size;
+
+        ssize_t n = recv(fd, dst, room, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read S3 response");
+            return false;
+        }
+        if (n == 0)
+            break;
+        if (dst != discard)
+            resp->size += n;
+    }
+    resp->data[resp->size] = '\0';
+
+    if (sscanf(resp->data, "HTTP/%*s %d", &resp->status) != 1) {
+        fprintf(stderr, "Malformed S3 response\n");
+        return false;
+    }
+
+    char* end = strstr(resp->data, "\r\n\r\n");
+    resp->body = end ? end + 4 : resp->data + resp->size;
+
+    resp->etag[0] = '\0';
+    for (char* line = strstr(resp->data, "\r\n"); line && line < resp->body; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "ETag:", 5) == 0) {
+            const char* value = line + 7;
+            while (*value == ' ')
+                value++;
+            size_t len = strcspn(value, "\r\n");
+            if (len >= sizeof(resp->etag))
+                len = sizeof(resp->etag) - 1;
+            memcpy(resp->etag, value, len);
+            resp->etag[len] = '\0';
+            break;
+        }
+    }
+    return true;
+}
+
+// Sends one SigV4 signed request. path must be URI-encoded and query canonical (sorted, encoded).
+static bool s3_request(const MultipartS3Config* config, const char* method, const char* path, const char* query,
+                       const char* payload, size_t payload_size, S3Response* resp) {
+    char amz_date[17];
+    char date[9];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+    strftime(date, sizeof(date), "%Y%m%d", &tm);
+
+    unsigned char digest[MULTIPART_DIGEST_SIZE];
+    char payload_hash[MULTIPART_DIGEST_SIZE * 2 + 1];
+    if (!multipart_sha256(payload, payload_size, digest))
+        return false;
+    multipart_digest_to_hex(digest, payload_hash);
+
+    char host[300];
+    if (strcmp(config->port, "80") == 0)
+        snprintf(host, sizeof(host), "%s", config->host);
+    else
+        snprintf(host, sizeof(host), "%s:%s", config->host, config->port);
+
+    char canonical[MULTIPART_S3_PATH_SIZE * 2];
+    int len = snprintf(canonical, sizeof(canonical),
+                       "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n\n"
+                       "host;x-amz-content-sha256;x-amz-date\n%s",
+                       method, path, query, host, payload_hash, amz_date, payload_hash);
+    if (len < 0 || (size_t)len >= sizeof(canonical)) {
+        fprintf(stderr, "S3 request path too long\n");
+        return false;
+    }
+
+    char scope[128];
+    snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", date, config->region);
+
+    char canonical_hash[MULTIPART_DIGEST_SIZE * 2 + 1];
+    if (!multipart_sha256(canonical, len, digest))
+        return false;
+    multipart_digest_to_hex(digest, canonical_hash);
+
+    char string_to_sign[256];
+    snprintf(string_to_sign, sizeof(string_to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", amz_date, scope,
+             canonical_hash);
+
+    // Signing key: HMAC chain over date, region, service and terminator.
+    char secret[256];
+    snprintf(secret, sizeof(secret), "AWS4%s", config->secret_key);
+    unsigned char key[MULTIPART_DIGEST_SIZE];
+    if (!hmac(secret, strlen(secret), date, key) || !hmac(key, sizeof(key), config->region, key) ||
+        !hmac(key, sizeof(key), "s3", key) || !hmac(key, sizeof(key), "aws4_request", key) ||
+        !hmac(key, sizeof(key), string_to_sign, digest))
+        return false;
+
+    char signature[MULTIPART_DIGEST_SIZE * 2 + 1];
+    multipart_digest_to_hex(digest, signature);
+
+    char header[MULTIPART_S3_PATH_SIZE * 2];
+    len = snprintf(header, sizeof(header),
+                   "%s %s%s%s HTTP/1.1\r\n"
+                   "Host: %s\r\n"
+                   "x-amz-date: %s\r\n"
+                   "x-amz-content-sha256: %s\r\n"
+                   "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+                   "SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=%s\r\n"
+                   "Content-Length: %zu\r\n"
+                   "Connection: close\r\n\r\n",
+                   method, path, query[0] ? "?" : "", query, host, amz_date, payload_hash, config->access_key, scope,
+                   signature, payload_size);
+    if (len < 0 || (size_t)len >= sizeof(header)) {
+        fprintf(stderr, "S3 request header too long\n");
+        return false;
+    }
+
+    int fd = s3_connect(config);
+    if (fd < 0)
+        return false;
+
+    bool ok = send_all(fd, header, len) && send_all(fd, payload, payload_size) && read_response(fd, resp);
+    close(fd);
+    return ok;
+}
+
+// =============== Part uploads ======================
+
+static void* upload_part(void* arg) {
+    MultipartS3Upload* upload = (MultipartS3Upload*)arg;
+    const MultipartS3Sink* sink = upload->sink;
+
+    char query[MULTIPART_S3_UPLOAD_ID_SIZE * 3 + 64];
+    snprintf(query, sizeof(query), "partNumber=%zu&uploadId=%s", upload->part_number, sink->upload_id_encoded);
+
+    S3Response* resp = (S3Response*)malloc(sizeof(S3Response));
+    upload->ok = false;
+    if (!resp) {
+        perror("Failed to allocate S3 response");
+        return NULL;
+    }
+
+    if (s3_request(sink->config, "PUT", sink->path, query, upload->data, upload->size, resp)) {
+        if (resp->status == 200 && resp->etag[0]) {
+            memcpy(upload->etag, resp->etag, sizeof(upload->etag));
+            upload->ok = true;
+        } else {
+            fprintf(stderr, "S3 part %zu upload failed with status %d\n", upload->part_number, resp->status);
+        }
+    }
+    free(resp);
+    return NULL;
+}
+
+// Waits for the upload in a slot and records its ETag.
+static void join_upload(MultipartS3Sink* sink, MultipartS3Upload* upload) {
+    if (!upload->active)
+        return;
+    if (upload->threaded)
+        pthread_join(upload->thread, NULL);
+    upload->active = false;
+
+    if (upload->ok)
+        memcpy(sink->etags[upload->part_number - 1], upload->etag, MULTIPART_S3_ETAG_SIZE);
+    else
+        sink->failed = true;
+}
+
+// Hands the buffered bytes to a worker as the next part.
+static bool dispatch_part(MultipartS3Sink* sink) {
+    size_t part_number = sink->num_parts + 1;
+    if (part_number > MULTIPART_S3_MAX_PARTS) {
+        fprintf(stderr, "S3 object has too many parts, increase part_size\n");
+        return false;
+    }
+
+    if (part_number > sink->etags_capacity) {
+        size_t capacity = sink->etags_capacity ? sink->etags_capacity * 2 : 16;
+        char(*etags)[MULTIPART_S3_ETAG_SIZE] = realloc(sink->etags, capacity * MULTIPART_S3_ETAG_SIZE);
+        if (!etags) {
+            perror("Failed to allocate memory for S3 parts");
+            return false;
+        }
+        sink->etags = etags;
+        sink->etags_capacity = capacity;
+    }
+
+    // Slots are reused round robin, so the slot to reuse holds the oldest upload in flight.
+    MultipartS3Upload* upload = &sink->uploads[sink->num_parts % sink->max_parallel];
+    join_upload(sink, upload);
+    if (sink->failed)
+        return false;
+
+    // Swap buffers: the worker takes the filled one, filling continues in the slot's old one.
+    char* spare = upload->data;
+    if (!spare) {
+        spare = (char*)malloc(sink->part_size);
+        if (!spare) {
+            perror("Failed to allocate memory for S3 part");
+            return false;
+        }
+    }
+    upload->data = sink->buffer;
+    upload->size = sink->buffered;
+    upload->part_number = part_number;
+    upload->sink = sink;
+    upload->active = true;
+    sink->buffer = spare;
+    sink->buffered = 0;
+    sink->num_parts = part_number;
+
+    upload->threaded = pthread_create(&upload->thread, NULL, upload_part, upload) == 0;
+    if (!upload->threaded)
+        upload_part(upload);
+    return true;
+}
+
+// =============== Sink stage ========================
+
+static bool s3_begin(MultipartSink* base, const FileHeader* file) {
+    MultipartS3Sink* sink = (MultipartS3Sink*)base;
+    const MultipartS3Config* config = sink->config;
+
+    size_t min_part_size = config->min_part_size ? config->min_part_size : MULTIPART_S3_MIN_PART_SIZE;
+    if (sink->part_size < min_part_size) {
+        fprintf(stderr, "S3 part size %zu is below the minimum of %zu\n", sink->part_size, min_part_size);
+        return false;
+    }
+
+    char key[MULTIPART_S3_PATH_SIZE];
+    char encoded_key[MULTIPART_S3_PATH_SIZE];
+    int len = snprintf(key, sizeof(key), "%s%s", sink->key_prefix ? sink->key_prefix : "", file->filename);
+    if (len < 0 || (size_t)len >= sizeof(key) || !uri_encode(key, true, encoded_key, sizeof(encoded_key))) {
+        fprintf(stderr, "S3 object key too long\n");
+        return false;
+    }
+    len = snprintf(sink->path, sizeof(sink->path), "/%s/%s", config->bucket, encoded_key);
+    if (len < 0 || (size_t)len >= sizeof(sink->path)) {
+        fprintf(stderr, "S3 object key too long\n");
+        return false;
+    }
+
+    sink->buffer = (char*)malloc(sink->part_size);
+    if (!sink->buffer) {
+        perror("Failed to allocate memory for S3 part");
+        return false;
+    }
+
+    S3Response* resp = (S3Response*)malloc(sizeof(S3Response));
+    if (!resp) {
+        perror("Failed to allocate S3 response");
+        free(sink->buffer);
+        sink->buffer = NULL;
+        return false;
+    }
+
+    bool ok = s3_request(config, "POST", sink->path, "uploads=", "", 0, resp);
+    if (ok && resp->status != 200) {
+        fprintf(stderr, "S3 CreateMultipartUpload failed with status %d\n", resp->status);
+        ok = false;
+    }
+
+    const char* start = ok ? strstr(resp->body, "<UploadId>") : NULL;
+    const char* end = start ? strstr(start, "</UploadId>") : NULL;
+    size_t id_len = end ? (size_t)(end - start) - 10 : 0;
+    if (ok && (!end || id_len == 0 || id_len >= sizeof(sink->upload_id))) {
+        fprintf(stderr, "S3 CreateMultipartUpload returned no upload id\n");
+        ok = false;
+    }
+
+    if (ok) {
+        memcpy(sink->upload_id, start + 10, id_len);
+        sink->upload_id[id_len] = '\0';
+        uri_encode(sink->upload_id, false, sink->upload_id_encoded, sizeof(sink->upload_id_encoded));
+    } else {
+        free(sink->buffer);
+        sink->buffer = NULL;
+    }
+
+    free(resp);
+    sink->buffered = 0;
+    sink->num_parts = 0;
+    sink->failed = false;
+    return ok;
+}
+
+static bool s3_write(MultipartSink* base, const void* data, size_t size) {
+    MultipartS3Sink* sink = (MultipartS3Sink*)base;
+    const char* p = (const char*)data;
+    while (size > 0) {
+        size_t n = sink->part_size - sink->buffered;
+        if (n > size)
+            n = size;
+        memcpy(sink->buffer + sink->buffered, p, n);
+        sink->buffered += n;
+        p += n;
+        size -= n;
+
+        if (sink->buffered == sink->part_size && !dispatch_part(sink))
+            return false;
+    }
+    return !sink->failed;
+}
+
+static bool complete_upload(MultipartS3Sink* sink, S3Response* resp) {
+    // <Part><PartNumber>N</PartNumber><ETag>E</ETag></Part> per part.
+    size_t capacity = 64 + sink->num_parts * (MULTIPART_S3_ETAG_SIZE + 64);
+    char* xml = (char*)malloc(capacity);
+    if (!xml) {
+        perror("Failed to allocate memory for S3 part list");
+        return false;
+    }
+
+    size_t len = (size_t)snprintf(xml, capacity, "<CompleteMultipartUpload>");
+    for (size_t i = 0; i < sink->num_parts; i++)
+        len += snprintf(xml + len, capacity - len, "<Part><PartNumber>%zu</PartNumber><ETag>%s</ETag></Part>", i + 1,
+                        sink->etags[i]);
+    len += snprintf(xml + len, capacity - len, "</CompleteMultipartUpload>");
+
+    char query[MULTIPART_S3_UPLOAD_ID_SIZE * 3 + 16];
+    snprintf(query, sizeof(query), "uploadId=%s", sink->upload_id_encoded);
+    bool ok = s3_request(sink->config, "POST", sink->path, query, xml, len, resp);
+    free(xml);
+
+    // The store can report a failure with a 200 status and an error document.
+    if (ok && (resp->status != 200 || strstr(resp->body, "<Error>"))) {
+        fprintf(stderr, "S3 CompleteMultipartUpload failed with status %d\n", resp->status);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool s3_end(MultipartSink* base, bool ok) {
+    MultipartS3Sink* sink = (MultipartS3Sink*)base;
+
+    // Every object has at least one part, possibly empty.
+    if (ok && !sink->failed && (sink->buffered > 0 || sink->num_parts == 0))
+        ok = dispatch_part(sink);
+
+    for (size_t i = 0; i < sink->max_parallel; i++)
+        join_upload(sink, &sink->uploads[i]);
+    ok = ok && !sink->failed;
+
+    S3Response* resp = (S3Response*)malloc(sizeof(S3Response));
+    if (!resp) {
+        perror("Failed to allocate S3 response");
+        ok = false;
+    } else if (ok) {
+        ok = complete_upload(sink, resp);
+    }
+
+    // Abort so the store drops the parts already uploaded.
+    if (!ok && resp) {
+        char query[MULTIPART_S3_UPLOAD_ID_SIZE * 3 + 16];
+        snprintf(query, sizeof(query), "uploadId=%s", sink->upload_id_encoded);
+        s3_request(sink->config, "DELETE", sink->path, query, "", 0, resp);
+    }
+    free(resp);
+
+    for (size_t i = 0; i < MULTIPART_S3_MAX_PARALLEL; i++) {
+        free(sink->uploads[i].data);
+        sink->uploads[i].data = NULL;
+    }
+    free(sink->buffer);
+    free(sink->etags);
+    sink->buffer = NULL;
+    sink->etags = NULL;
+    sink->etags_capacity = 0;
+    return ok;
+}
+
+void multipart_s3_sink_init(MultipartS3Sink* sink, const MultipartS3Config* config, const char* key_prefix) {
+    memset(sink, 0, sizeof(MultipartS3Sink));
+    sink->base.begin = s3_begin;
+    sink->base.write = s3_write;
+    sink->base.end = s3_end;
+    sink->config = config;
+    sink->key_prefix = key_prefix;
+
+    sink->part_size = config->part_size ? config->part_size : MULTIPART_S3_PART_SIZE;
+    sink->max_parallel = config->max_parallel ? config->max_parallel : 4;
+    if (sink->max_parallel > MULTIPART_S3_MAX_PARALLEL)
+        sink->max_parallel = MULTIPART_S3_MAX_PARALLEL;
+}
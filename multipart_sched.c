@@ -0,0 +1,395 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_sched.c                                                                #
+// Save scheduler shared by concurrent uploads. Each upload gets a queue, queues are      #
+// served by deficit round robin over bytes so a huge file can not starve small forms,    #
+// large files are written in slices, small files are batched, and the number of writes   #
+// in flight per device is bounded.                                                       #
+//=========================================================================================
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+// One piece of work handed to a worker.
+typedef struct SaveSlice {
+    MultipartSaveJob* job;
+    size_t offset;
+    size_t size;
+} SaveSlice;
+
+static bool write_at(int fd, const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Returns the in-flight counter of dev. Devices beyond the table share the last slot.
+static size_t* device_inflight(MultipartSaveScheduler* sched, dev_t dev) {
+    for (size_t i = 0; i < sched->num_devices; i++) {
+        if (sched->devices[i].dev == dev)
+            return &sched->devices[i].inflight;
+    }
+    if (sched->num_devices < MULTIPART_SCHED_MAX_DEVICES) {
+        sched->devices[sched->num_devices].dev = dev;
+        sched->devices[sched->num_devices].inflight = 0;
+        return &sched->devices[sched->num_devices++].inflight;
+    }
+    return &sched->devices[MULTIPART_SCHED_MAX_DEVICES - 1].inflight;
+}
+
+// =============== Active ring =======================
+// Queues with unclaimed work form a circular list that the cursor walks.
+
+static void ring_insert(MultipartSaveScheduler* sched, MultipartSaveQueue* queue) {
+    if (!sched->cursor) {
+        queue->prev = queue->next = queue;
+        sched->cursor = queue;
+    } else {
+        // Join at the back of the round.
+        queue->next = sched->cursor;
+        queue->prev = sched->cursor->prev;
+        queue->prev->next = queue;
+        sched->cursor->prev = queue;
+    }
+    queue->deficit = 0;
+    sched->num_active++;
+}
+
+static void ring_remove(MultipartSaveScheduler* sched, MultipartSaveQueue* queue) {
+    if (queue->next == queue) {
+        sched->cursor = NULL;
+    } else {
+        queue->prev->next = queue->next;
+        queue->next->prev = queue->prev;
+        if (sched->cursor == queue)
+            sched->cursor = queue->next;
+    }
+    queue->prev = queue->next = NULL;
+    // Unused credit is not carried over an idle period.
+    queue->deficit = 0;
+    sched->num_active--;
+}
+
+// Takes up to size bytes of the queue's head job. Pops the job once it is fully claimed.
+static SaveSlice claim(MultipartSaveScheduler* sched, MultipartSaveQueue* queue, size_t size) {
+    MultipartSaveJob* job = queue->head;
+    SaveSlice slice = {job, job->claimed, size};
+    job->claimed += size;
+    job->inflight++;
+    queue->deficit -= size;
+
+    if (job->claimed == job->file->size) {
+        queue->head = job->next;
+        if (!queue->head)
+            queue->tail = NULL;
+    }
+    if (!queue->head)
+        ring_remove(sched, queue);
+    return slice;
+}
+
+// Drops the unclaimed bytes of a failed job and counts them as written, so the job finishes as
+// soon as its slices in flight are back instead of using its share of the device until the end.
+// Only the head of a queue can be partly claimed. Called with the lock held.
+static void drop_unclaimed(MultipartSaveScheduler* sched, MultipartSaveJob* job) {
+    if (job->claimed == job->file->size)
+        return;
+
+    MultipartSaveQueue* queue = job->queue;
+    job->written += job->file->size - job->claimed;
+    job->claimed = job->file->size;
+    queue->head = job->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+        ring_remove(sched, queue);
+    }
+}
+
+// Picks the next batch of slices by deficit round robin. Returns the number of slices, 0 if
+// nothing can be started now. Called with the lock held.
+static size_t pick(MultipartSaveScheduler* sched, SaveSlice* batch, size_t** inflight) {
+    // Each queue is visited at most twice: once to top up its deficit, once to be served.
+    size_t visits = 2 * sched->num_active + 1;
+    while (sched->cursor && visits-- > 0) {
+        MultipartSaveQueue* queue = sched->cursor;
+        MultipartSaveJob* job = queue->head;
+
+        size_t* counter = device_inflight(sched, job->dev);
+        if (*counter >= sched->max_inflight) {
+            sched->cursor = queue->next;
+            continue;
+        }
+
+        size_t size = job->file->size - job->claimed;
+        if (size > sched->slice_size)
+            size = sched->slice_size;
+
+        if (queue->deficit < size) {
+            queue->deficit += sched->slice_size * queue->weight;
+            sched->cursor = queue->next;
+            continue;
+        }
+
+        size_t count = 0;
+        batch[count++] = claim(sched, queue, size);
+
+        // Batch the small files that follow on the same device into the same turn.
+        size_t batched = size;
+        while (queue->head && queue->head->claimed == 0 && queue->head->dev == job->dev &&
+               count < MULTIPART_SCHED_MAX_BATCH) {
+            size_t next = queue->head->file->size;
+            if (batched + next > sched->slice_size || queue->deficit < next)
+                break;
+            batch[count++] = claim(sched, queue, next);
+            batched += next;
+        }
+
+        // Move on so the next pick serves another upload.
+        if (sched->cursor == queue)
+            sched->cursor = queue->next;
+
+        (*counter)++;
+        *inflight = counter;
+        return count;
+    }
+    return 0;
+}
+
+// Frees a queue once it is released and has no jobs left. Called with the lock held.
+static void maybe_free_queue(MultipartSaveScheduler* sched, MultipartSaveQueue* queue) {
+    if (!queue->released || queue->num_jobs > 0)
+        return;
+
+    MultipartSaveQueue** p = &sched->queues;
+    while (*p != queue)
+        p = &(*p)->all_next;
+    *p = queue->all_next;
+    free(queue);
+}
+
+static void finish_job(MultipartSaveJob* job) {
+    bool ok = !job->failed;
+    if (close(job->fd) != 0) {
+        perror("Failed to close file");
+        ok = false;
+    }
+    if (job->done)
+        job->done(job->file, job->path, ok, job->userdata);
+    free(job->path);
+    free(job);
+}
+
+static void* sched_worker(void* arg) {
+    MultipartSaveScheduler* sched = (MultipartSaveScheduler*)arg;
+    SaveSlice batch[MULTIPART_SCHED_MAX_BATCH];
+
+    pthread_mutex_lock(&sched->lock);
+    for (;;) {
+        size_t* inflight = NULL;
+        size_t count = 0;
+        while (!sched->stopping && (count = pick(sched, batch, &inflight)) == 0)
+            pthread_cond_wait(&sched->work, &sched->lock);
+        if (count == 0)
+            break;
+        pthread_mutex_unlock(&sched->lock);
+
+        bool ok[MULTIPART_SCHED_MAX_BATCH];
+        for (size_t i = 0; i < count; i++) {
+            MultipartSaveJob* job = batch[i].job;
+            ok[i] = write_at(job->fd, job->body + job->file->offset + batch[i].offset, batch[i].size,
+                             (off_t)batch[i].offset);
+            if (!ok[i])
+                perror("Failed to write file to disk");
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        (*inflight)--;
+
+        MultipartSaveJob* finished = NULL;
+        for (size_t i = 0; i < count; i++) {
+            MultipartSaveJob* job = batch[i].job;
+            job->written += batch[i].size;
+            job->inflight--;
+            if (!ok[i]) {
+                job->failed = true;
+                drop_unclaimed(sched, job);
+            }
+
+            if (job->written == job->file->size && job->inflight == 0) {
+                job->next = finished;
+                finished = job;
+            }
+        }
+
+        // The device has room again.
+        pthread_cond_broadcast(&sched->work);
+
+        if (finished) {
+            pthread_mutex_unlock(&sched->lock);
+            size_t num_finished = 0;
+            MultipartSaveQueue* queues[MULTIPART_SCHED_MAX_BATCH];
+            while (finished) {
+                MultipartSaveJob* next = finished->next;
+                queues[num_finished++] = finished->queue;
+                finish_job(finished);
+                finished = next;
+            }
+            pthread_mutex_lock(&sched->lock);
+
+            for (size_t i = 0; i < num_finished; i++) {
+                queues[i]->num_jobs--;
+                maybe_free_queue(sched, queues[i]);
+            }
+            sched->pending -= num_finished;
+            if (sched->pending == 0)
+                pthread_cond_broadcast(&sched->idle);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+// =============== Public API ========================
+
+bool multipart_sched_init(MultipartSaveScheduler* sched, size_t num_workers, size_t max_inflight) {
+    memset(sched, 0, sizeof(MultipartSaveScheduler));
+    if (num_workers == 0)
+        num_workers = 4;
+    if (num_workers > MULTIPART_SCHED_MAX_WORKERS)
+        num_workers = MULTIPART_SCHED_MAX_WORKERS;
+
+    sched->max_inflight = max_inflight ? max_inflight : 2;
+    sched->slice_size = MULTIPART_SCHED_SLICE_SIZE;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    for (size_t i = 0; i < num_workers; i++) {
+        if (pthread_create(&sched->workers[i], NULL, sched_worker, sched) != 0) {
+            perror("Failed to start save worker");
+            multipart_sched_destroy(sched);
+            return false;
+        }
+        sched->num_workers++;
+    }
+    return true;
+}
+
+MultipartSaveQueue* multipart_sched_queue(MultipartSaveScheduler* sched, unsigned int weight) {
+    MultipartSaveQueue* queue = (MultipartSaveQueue*)calloc(1, sizeof(MultipartSaveQueue));
+    if (!queue) {
+        perror("Failed to allocate memory for save queue");
+        return NULL;
+    }
+    queue->weight = weight ? weight : 1;
+
+    pthread_mutex_lock(&sched->lock);
+    queue->all_next = sched->queues;
+    sched->queues = queue;
+    pthread_mutex_unlock(&sched->lock);
+    return queue;
+}
+
+void multipart_sched_queue_release(MultipartSaveScheduler* sched, MultipartSaveQueue* queue) {
+    pthread_mutex_lock(&sched->lock);
+    queue->released = true;
+    maybe_free_queue(sched, queue);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+bool multipart_sched_save(MultipartSaveScheduler* sched, MultipartSaveQueue* queue, const FileHeader* file,
+                          const char* body, const char* path, MultipartSaveCallback done, void* userdata) {
+    MultipartSaveJob* job = (MultipartSaveJob*)calloc(1, sizeof(MultipartSaveJob));
+    char* path_copy = strdup(path);
+    if (!job || !path_copy) {
+        perror("Failed to allocate memory for save job");
+        free(job);
+        free(path_copy);
+        return false;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open file for writing");
+        if (fd >= 0)
+            close(fd);
+        free(job);
+        free(path_copy);
+        return false;
+    }
+
+    job->file = file;
+    job->body = body;
+    job->path = path_copy;
+    job->fd = fd;
+    job->dev = st.st_dev;
+    job->done = done;
+    job->userdata = userdata;
+    job->queue = queue;
+
+    // Nothing to write.
+    if (file->size == 0) {
+        finish_job(job);
+        return true;
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    queue->num_jobs++;
+    if (!queue->next)
+        ring_insert(sched, queue);
+    sched->pending++;
+    pthread_cond_signal(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    return true;
+}
+
+void multipart_sched_wait(MultipartSaveScheduler* sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending > 0)
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void multipart_sched_destroy(MultipartSaveScheduler* sched) {
+    multipart_sched_wait(sched);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (size_t i = 0; i < sched->num_workers; i++)
+        pthread_join(sched->workers[i], NULL);
+    sched->num_workers = 0;
+
+    while (sched->queues) {
+        MultipartSaveQueue* next = sched->queues->all_next;
+        free(sched->queues);
+        sched->queues = next;
+    }
+
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work);
+    pthread_cond_destroy(&sched->idle);
+}
@@ -0,0 +1,330 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_search.c                                                               #
+// Boundary search kernels for the file bodies of multipart_parse_form. Which one is      #
+// fastest depends on the CPU and the boundary length, so they are timed on synthetic     #
+// data on first use and the fastest is kept for each class of boundary lengths.          #
+//=========================================================================================
+#define _GNU_SOURCE  // for memmem
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+#include "multipart.h"
+
+// Upper bounds of the boundary length classes, the last class has no bound.
+static const size_t class_limits[MULTIPART_SEARCH_NUM_CLASSES - 1] = {16, 48};
+
+// Boundary length timed for each class.
+static const size_t class_samples[MULTIPART_SEARCH_NUM_CLASSES] = {12, 40, 72};
+
+static const char* const kernel_names[MULTIPART_SEARCH_NUM_KERNELS] = {"auto", "memmem", "memchr", "sse2", "sse4.2",
+                                                                       "avx2"};
+
+// Selected kernel per class, MULTIPART_SEARCH_AUTO until calibrated.
+static atomic_int selected[MULTIPART_SEARCH_NUM_CLASSES];
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+
+static size_t length_class(size_t needle_length) {
+    size_t c = 0;
+    while (c < MULTIPART_SEARCH_NUM_CLASSES - 1 && needle_length > class_limits[c])
+        c++;
+    return c;
+}
+
+// =============== Kernels ===========================
+// Each kernel returns the first occurrence of needle in haystack or NULL. needle_length >= 1.
+
+typedef const char* (*SearchKernel)(const char* haystack, size_t length, const char* needle, size_t needle_length);
+
+static const char* search_memmem(const char* haystack, size_t length, const char* needle, size_t needle_length) {
+    return memmem(haystack, length, needle, needle_length);
+}
+
+// Finds the last byte of the needle with memchr, which is vectorized by libc, then compares the rest.
+static const char* search_memchr(const char* haystack, size_t length, const char* needle, size_t needle_length) {
+    if (length < needle_length)
+        return NULL;
+    const char* end = haystack + length;
+    const char* p = haystack + needle_length - 1;
+    char last = needle[needle_length - 1];
+    while ((p = memchr(p, last, end - p)) != NULL) {
+        const char* start = p - (needle_length - 1);
+        if (memcmp(start, needle, needle_length - 1) == 0)
+            return start;
+        p++;
+    }
+    return NULL;
+}
+
+#if SEARCH_X86
+// Two-byte filter: positions where both the first and the last byte of the needle match are
+// compared in full. Boundaries start with "--" but end with random bytes, so the last byte
+// rejects almost every position.
+__attribute__((target("sse2"))) static const char* search_sse2(const char* haystack, size_t length,
+                                                               const char* needle, size_t needle_length) {
+    if (length < needle_length)
+        return NULL;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0;
+    for (; i + needle_length - 1 + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(haystack + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(haystack + i + needle_length - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(haystack + pos + 1, needle + 1, needle_length - 1) == 0)
+                return haystack + pos;
+            mask &= mask - 1;
+        }
+    }
+    return search_memchr(haystack + i, length - i, needle, needle_length);
+}
+
+__attribute__((target("avx2"))) static const char* search_avx2(const char* haystack, size_t length,
+                                                               const char* needle, size_t needle_length) {
+    if (length < needle_length)
+        return NULL;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0;
+    for (; i + needle_length - 1 + 32 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(haystack + i + needle_length - 1));
+        unsigned mask =
+            (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(haystack + pos + 1, needle + 1, needle_length - 1) == 0)
+                return haystack + pos;
+            mask &= mask - 1;
+        }
+    }
+    return search_sse2(haystack + i, length - i, needle, needle_length);
+}
+
+// pcmpestri finds where the first 16 bytes of the needle start, or a prefix of them runs off
+// the end of the block. Candidates are then compared in full.
+__attribute__((target("sse4.2"))) static const char* search_sse42(const char* haystack, size_t length,
+                                                                  const char* needle, size_t needle_length) {
+    if (length < needle_length)
+        return NULL;
+    char prefix[16] = {0};
+    int prefix_length = needle_length < 16 ? (int)needle_length : 16;
+    memcpy(prefix, needle, prefix_length);
+    const __m128i pattern = _mm_loadu_si128((const __m128i*)prefix);
+
+    size_t i = 0;
+    while (i + 16 <= length) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(haystack + i));
+        int idx = _mm_cmpestri(pattern, prefix_length, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+        if (idx == 16) {
+            i += 16;
+            continue;
+        }
+        size_t pos = i + (size_t)idx;
+        if (pos + needle_length > length)
+            return NULL;  // Later candidates do not fit either.
+        if (memcmp(haystack + pos, needle, needle_length) == 0)
+            return haystack + pos;
+        i = pos + 1;
+    }
+    return search_memchr(haystack + i, length - i, needle, needle_length);
+}
+#endif
+
+static SearchKernel kernel_function(MultipartSearchKernel kernel) {
+    switch (kernel) {
+        case MULTIPART_SEARCH_MEMCHR:
+            return search_memchr;
+#if SEARCH_X86
+        case MULTIPART_SEARCH_SSE2:
+            return search_sse2;
+        case MULTIPART_SEARCH_SSE42:
+            return search_sse42;
+        case MULTIPART_SEARCH_AVX2:
+            return search_avx2;
+#endif
+        default:
+            return search_memmem;
+    }
+}
+
+bool multipart_search_kernel_available(MultipartSearchKernel kernel) {
+    switch (kernel) {
+        case MULTIPART_SEARCH_AUTO:
+        case MULTIPART_SEARCH_MEMMEM:
+        case MULTIPART_SEARCH_MEMCHR:
+            return true;
+#if SEARCH_X86
+        case MULTIPART_SEARCH_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case MULTIPART_SEARCH_SSE42:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2");
+        case MULTIPART_SEARCH_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+const char* multipart_search_kernel_name(MultipartSearchKernel kernel) {
+    if ((unsigned)kernel >= MULTIPART_SEARCH_NUM_KERNELS)
+        return "unknown";
+    return kernel_names[kernel];
+}
+
+// =============== Calibration =======================
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Fills data with file-like bytes: random, with a near miss (CRLF and the needle without its
+// last byte) every few hundred bytes, and the needle itself at the end.
+static void fill_sample(char* data, size_t size, const char* needle, size_t needle_length) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+    for (size_t i = 300; i + needle_length + 2 < size - needle_length; i += 300 + (i & 0xff)) {
+        memcpy(data + i, "\r\n", 2);
+        memcpy(data + i + 2, needle, needle_length - 1);
+        data[i + 1 + needle_length] = (char)(needle[needle_length - 1] ^ 1);
+    }
+    memcpy(data + size - needle_length, needle, needle_length);
+}
+
+// Times each available kernel on every class and keeps the fastest.
+static void calibrate(void) {
+    const size_t sample_size = MULTIPART_SEARCH_SAMPLE_SIZE;
+    char* sample = (char*)malloc(sample_size);
+    if (!sample) {
+        perror("Failed to allocate boundary search sample");
+        for (size_t c = 0; c < MULTIPART_SEARCH_NUM_CLASSES; c++)
+            atomic_store(&selected[c], MULTIPART_SEARCH_MEMMEM);
+        return;
+    }
+
+    for (size_t c = 0; c < MULTIPART_SEARCH_NUM_CLASSES; c++) {
+        char needle[128] = "--";
+        size_t needle_length = class_samples[c];
+        for (size_t i = 2; i < needle_length; i++)
+            needle[i] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"[(i * 37 + c * 11) % 62];
+        fill_sample(sample, sample_size, needle, needle_length);
+
+        MultipartSearchKernel best = MULTIPART_SEARCH_MEMMEM;
+        double best_time = 0;
+        for (int k = MULTIPART_SEARCH_MEMMEM; k < MULTIPART_SEARCH_NUM_KERNELS; k++) {
+            if (!multipart_search_kernel_available((MultipartSearchKernel)k))
+                continue;
+            SearchKernel search = kernel_function((MultipartSearchKernel)k);
+
+            // The fastest of a few runs, to leave out interruptions.
+            double time = 0;
+            for (int run = 0; run < MULTIPART_SEARCH_TUNE_RUNS; run++) {
+                double start = now_seconds();
+                const char* found = search(sample, sample_size, needle, needle_length);
+                double elapsed = now_seconds() - start;
+                if (found != sample + sample_size - needle_length) {
+                    fprintf(stderr, "Boundary search kernel %s failed calibration\n", kernel_names[k]);
+                    time = -1;
+                    break;
+                }
+                if (run == 0 || elapsed < time)
+                    time = elapsed;
+            }
+            if (time >= 0 && (best_time == 0 || time < best_time)) {
+                best = (MultipartSearchKernel)k;
+                best_time = time;
+            }
+        }
+        atomic_store(&selected[c], best);
+    }
+    free(sample);
+}
+
+// Reads MULTIPART_SEARCH_KERNEL. Returns AUTO if it is unset or not usable.
+static MultipartSearchKernel kernel_from_env(void) {
+    const char* name = getenv("MULTIPART_SEARCH_KERNEL");
+    if (!name || name[0] == '\0')
+        return MULTIPART_SEARCH_AUTO;
+    for (int k = MULTIPART_SEARCH_MEMMEM; k < MULTIPART_SEARCH_NUM_KERNELS; k++) {
+        if (strcasecmp(name, kernel_names[k]) == 0) {
+            if (multipart_search_kernel_available((MultipartSearchKernel)k))
+                return (MultipartSearchKernel)k;
+            fprintf(stderr, "MULTIPART_SEARCH_KERNEL=%s is not supported by this CPU\n", name);
+            return MULTIPART_SEARCH_AUTO;
+        }
+    }
+    if (strcasecmp(name, "auto") != 0)
+        fprintf(stderr, "Unknown MULTIPART_SEARCH_KERNEL=%s\n", name);
+    return MULTIPART_SEARCH_AUTO;
+}
+
+void multipart_search_autotune(void) {
+    MultipartSearchKernel kernel = kernel_from_env();
+    if (kernel != MULTIPART_SEARCH_AUTO) {
+        multipart_search_set_kernel(kernel);
+        return;
+    }
+    calibrate();
+}
+
+static void autotune_once(void) {
+    // A kernel set before the first search is kept.
+    for (size_t c = 0; c < MULTIPART_SEARCH_NUM_CLASSES; c++) {
+        if (atomic_load(&selected[c]) == MULTIPART_SEARCH_AUTO) {
+            multipart_search_autotune();
+            return;
+        }
+    }
+}
+
+bool multipart_search_set_kernel(MultipartSearchKernel kernel) {
+    if (!multipart_search_kernel_available(kernel))
+        return false;
+    if (kernel == MULTIPART_SEARCH_AUTO) {
+        multipart_search_autotune();
+        return true;
+    }
+    for (size_t c = 0; c < MULTIPART_SEARCH_NUM_CLASSES; c++)
+        atomic_store(&selected[c], kernel);
+    return true;
+}
+
+MultipartSearchKernel multipart_search_kernel(size_t needle_length) {
+    size_t c = length_class(needle_length);
+    int kernel = atomic_load_explicit(&selected[c], memory_order_relaxed);
+    if (kernel == MULTIPART_SEARCH_AUTO) {
+        pthread_once(&tune_once, autotune_once);
+        kernel = atomic_load_explicit(&selected[c], memory_order_relaxed);
+    }
+    return (MultipartSearchKernel)kernel;
+}
+
+const char* multipart_search(const char* haystack, size_t length, const char* needle, size_t needle_length) {
+    if (needle_length == 0)
+        return haystack;
+    return kernel_function(multipart_search_kernel(needle_length))(haystack, length, needle, needle_length);
+}
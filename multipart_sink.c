@@ -0,0 +1,271 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_sink.c                                                                 #
+// Sink pipelines for file parts. A file's bytes are pushed through a chain of stages     #
+// (digest, compression, encryption, output) one block at a time, so every stage works    #
+// on a block that is still in cache and the body is only read once.                     #
+//=========================================================================================
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "multipart.h"
+
+// =============== Driver ============================
+
+bool multipart_sink_begin_next(MultipartSink* sink, const FileHeader* file) {
+    return !sink->next || sink->next->begin(sink->next, file);
+}
+
+bool multipart_sink_write_next(MultipartSink* sink, const void* data, size_t size) {
+    return !sink->next || size == 0 || sink->next->write(sink->next, data, size);
+}
+
+bool multipart_sink_end_next(MultipartSink* sink, bool ok) {
+    return !sink->next || sink->next->end(sink->next, ok);
+}
+
+bool multipart_sink_feed(MultipartSink* sink, const FileHeader* file, const char* body) {
+    if (!sink->begin(sink, file))
+        return false;
+
+    const char* p = body + file->offset;
+    size_t remaining = file->size;
+    bool ok = true;
+    while (ok && remaining > 0) {
+        size_t n = remaining > MULTIPART_SINK_BLOCK_SIZE ? MULTIPART_SINK_BLOCK_SIZE : remaining;
+        ok = sink->write(sink, p, n);
+        p += n;
+        remaining -= n;
+    }
+
+    // end is always called so stages can release their resources.
+    return sink->end(sink, ok) && ok;
+}
+
+bool multipart_sink_on_file(const FileHeader* file, const char* body, void* userdata) {
+    return multipart_sink_feed((MultipartSink*)userdata, file, body);
+}
+
+// =============== Digest stage ======================
+
+static bool digest_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartDigestSink* self = (MultipartDigestSink*)sink;
+    if (!multipart_sha256_init(&self->ctx))
+        return false;
+    if (!multipart_sink_begin_next(sink, file)) {
+        multipart_sha256_final(&self->ctx, self->digest);
+        return false;
+    }
+    return true;
+}
+
+static bool digest_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartDigestSink* self = (MultipartDigestSink*)sink;
+    return multipart_sha256_update(&self->ctx, data, size) && multipart_sink_write_next(sink, data, size);
+}
+
+static bool digest_end(MultipartSink* sink, bool ok) {
+    MultipartDigestSink* self = (MultipartDigestSink*)sink;
+    ok = multipart_sha256_final(&self->ctx, self->digest) && ok;
+    return multipart_sink_end_next(sink, ok) && ok;
+}
+
+void multipart_digest_sink_init(MultipartDigestSink* sink, MultipartSink* next) {
+    memset(sink, 0, sizeof(MultipartDigestSink));
+    sink->base.begin = digest_begin;
+    sink->base.write = digest_write;
+    sink->base.end = digest_end;
+    sink->base.next = next;
+}
+
+// =============== File descriptor stage =============
+
+static bool fd_begin(MultipartSink* sink, const FileHeader* file) {
+    (void)file;
+    ((MultipartFdSink*)sink)->written = 0;
+    return true;
+}
+
+static bool fd_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartFdSink* self = (MultipartFdSink*)sink;
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(self->fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write to sink fd");
+            return false;
+        }
+        p += n;
+        size -= n;
+        self->written += n;
+    }
+    return true;
+}
+
+static bool fd_end(MultipartSink* sink, bool ok) {
+    (void)sink;
+    return ok;
+}
+
+void multipart_fd_sink_init(MultipartFdSink* sink, int fd) {
+    memset(sink, 0, sizeof(MultipartFdSink));
+    sink->base.begin = fd_begin;
+    sink->base.write = fd_write;
+    sink->base.end = fd_end;
+    sink->fd = fd;
+}
+
+// =============== Callback stage ====================
+
+static bool callback_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartCallbackSink* self = (MultipartCallbackSink*)sink;
+    self->file = file;
+    return true;
+}
+
+static bool callback_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartCallbackSink* self = (MultipartCallbackSink*)sink;
+    return self->callback(self->file, data, size, self->userdata);
+}
+
+static bool callback_end(MultipartSink* sink, bool ok) {
+    MultipartCallbackSink* self = (MultipartCallbackSink*)sink;
+    self->file = NULL;
+    return ok;
+}
+
+void multipart_callback_sink_init(MultipartCallbackSink* sink, MultipartChunkCallback callback, void* userdata) {
+    memset(sink, 0, sizeof(MultipartCallbackSink));
+    sink->base.begin = callback_begin;
+    sink->base.write = callback_write;
+    sink->base.end = callback_end;
+    sink->callback = callback;
+    sink->userdata = userdata;
+}
+
+// =============== Tee stage =========================
+
+static bool tee_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartTeeSink* self = (MultipartTeeSink*)sink;
+    for (size_t i = 0; i < self->num_sinks; i++) {
+        if (!self->sinks[i]->begin(self->sinks[i], file)) {
+            // Release the branches that did start.
+            for (size_t j = 0; j < i; j++)
+                self->sinks[j]->end(self->sinks[j], false);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tee_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartTeeSink* self = (MultipartTeeSink*)sink;
+    for (size_t i = 0; i < self->num_sinks; i++) {
+        if (!self->sinks[i]->write(self->sinks[i], data, size))
+            return false;
+    }
+    return true;
+}
+
+static bool tee_end(MultipartSink* sink, bool ok) {
+    MultipartTeeSink* self = (MultipartTeeSink*)sink;
+    bool all_ok = ok;
+    for (size_t i = 0; i < self->num_sinks; i++) {
+        if (!self->sinks[i]->end(self->sinks[i], ok))
+            all_ok = false;
+    }
+    return all_ok;
+}
+
+void multipart_tee_sink_init(MultipartTeeSink* sink, MultipartSink** sinks, size_t num_sinks) {
+    memset(sink, 0, sizeof(MultipartTeeSink));
+    sink->base.begin = tee_begin;
+    sink->base.write = tee_write;
+    sink->base.end = tee_end;
+    sink->sinks = sinks;
+    sink->num_sinks = num_sinks;
+}
+
+// =============== Gzip stage ========================
+
+// Compresses pending input and forwards the output. flush is Z_NO_FLUSH or Z_FINISH.
+static bool gzip_pump(MultipartGzipSink* self, z_stream* zs, int flush) {
+    unsigned char out[MULTIPART_SINK_BLOCK_SIZE];
+    int ret;
+    do {
+        zs->next_out = out;
+        zs->avail_out = sizeof(out);
+        ret = deflate(zs, flush);
+        if (ret == Z_STREAM_ERROR) {
+            fprintf(stderr, "deflate failed\n");
+            return false;
+        }
+
+        size_t produced = sizeof(out) - zs->avail_out;
+        if (!multipart_sink_write_next(&self->base, out, produced))
+            return false;
+    } while (zs->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return true;
+}
+
+static bool gzip_begin(MultipartSink* sink, const FileHeader* file) {
+    MultipartGzipSink* self = (MultipartGzipSink*)sink;
+    z_stream* zs = (z_stream*)calloc(1, sizeof(z_stream));
+    if (!zs) {
+        perror("Failed to allocate memory for deflate stream");
+        return false;
+    }
+
+    // 15 + 16 selects the gzip wrapper.
+    if (deflateInit2(zs, self->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        free(zs);
+        return false;
+    }
+
+    if (!multipart_sink_begin_next(sink, file)) {
+        deflateEnd(zs);
+        free(zs);
+        return false;
+    }
+    self->stream = zs;
+    return true;
+}
+
+static bool gzip_write(MultipartSink* sink, const void* data, size_t size) {
+    MultipartGzipSink* self = (MultipartGzipSink*)sink;
+    z_stream* zs = (z_stream*)self->stream;
+    zs->next_in = (unsigned char*)data;
+    zs->avail_in = (uInt)size;  // Writes are blocks, far below 4GB.
+    return gzip_pump(self, zs, Z_NO_FLUSH);
+}
+
+static bool gzip_end(MultipartSink* sink, bool ok) {
+    MultipartGzipSink* self = (MultipartGzipSink*)sink;
+    z_stream* zs = (z_stream*)self->stream;
+    if (ok) {
+        zs->next_in = NULL;
+        zs->avail_in = 0;
+        ok = gzip_pump(self, zs, Z_FINISH);
+    }
+
+    deflateEnd(zs);
+    free(zs);
+    self->stream = NULL;
+    return multipart_sink_end_next(sink, ok) && ok;
+}
+
+void multipart_gzip_sink_init(MultipartGzipSink* sink, int level, MultipartSink* next) {
+    memset(sink, 0, sizeof(MultipartGzipSink));
+    sink->base.begin = gzip_begin;
+    sink->base.write = gzip_write;
+    sink->base.end = gzip_end;
+    sink->base.next = next;
+    sink->level = level;
+}
@@ -0,0 +1,439 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_store.c                                                                #
+// Pack-file blob store. Small uploaded files are appended to large segment files and     #
+// located through an append-only index, so storing a file is a sequential append         #
+// instead of a new inode.                                                                #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+// On-disk index record, all integers little-endian:
+//   u32 magic | u32 segment | u64 offset | u64 size | u8 digest[32] | u16 mimetype length |
+//   mimetype bytes | u32 crc32 of everything before it
+#define INDEX_MAGIC 0x4b50504dU  // "MPPK"
+#define INDEX_FIXED_SIZE (4 + 4 + 8 + 8 + MULTIPART_DIGEST_SIZE + 2)
+#define INDEX_MAX_RECORD_SIZE (INDEX_FIXED_SIZE + MAX_MIMETYPE_SIZE + 4)
+
+static uint32_t crc32(const unsigned char* data, size_t size) {
+    uint32_t crc = 0xffffffffU;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320U & (0U - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void put_u16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint16_t get_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Serializes entry into record and returns the record size.
+static size_t encode_record(const MultipartStoreEntry* entry, unsigned char record[INDEX_MAX_RECORD_SIZE]) {
+    size_t mime_len = strlen(entry->mimetype);
+    put_u32(record, INDEX_MAGIC);
+    put_u32(record + 4, entry->segment);
+    put_u64(record + 8, entry->offset);
+    put_u64(record + 16, entry->size);
+    memcpy(record + 24, entry->digest, MULTIPART_DIGEST_SIZE);
+    put_u16(record + 24 + MULTIPART_DIGEST_SIZE, (uint16_t)mime_len);
+    memcpy(record + INDEX_FIXED_SIZE, entry->mimetype, mime_len);
+    put_u32(record + INDEX_FIXED_SIZE + mime_len, crc32(record, INDEX_FIXED_SIZE + mime_len));
+    return INDEX_FIXED_SIZE + mime_len + 4;
+}
+
+static void segment_path(const MultipartStore* store, uint32_t segment, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s/segment-%06u.pack", store->dir, segment);
+}
+
+// Makes room for one more entry.
+static bool reserve_entry(MultipartStore* store) {
+    if (store->num_entries >= store->entries_capacity) {
+        size_t new_capacity = store->entries_capacity ? store->entries_capacity * 2 : 64;
+        MultipartStoreEntry* entries =
+            (MultipartStoreEntry*)realloc(store->entries, new_capacity * sizeof(MultipartStoreEntry));
+        if (!entries) {
+            perror("Failed to allocate memory for store entries");
+            return false;
+        }
+        store->entries = entries;
+        store->entries_capacity = new_capacity;
+    }
+    return true;
+}
+
+static bool append_entry(MultipartStore* store, const MultipartStoreEntry* entry) {
+    if (!reserve_entry(store))
+        return false;
+    store->entries[store->num_entries++] = *entry;
+    return true;
+}
+
+// Makes room for one more encoded index record.
+static bool reserve_record(MultipartStore* store) {
+    if (store->pending_size + INDEX_MAX_RECORD_SIZE > store->pending_capacity) {
+        size_t new_capacity = store->pending_capacity ? store->pending_capacity * 2 : 64 * INDEX_MAX_RECORD_SIZE;
+        unsigned char* pending = (unsigned char*)realloc(store->pending, new_capacity);
+        if (!pending) {
+            perror("Failed to allocate memory for pending index records");
+            return false;
+        }
+        store->pending = pending;
+        store->pending_capacity = new_capacity;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const void* data, size_t size, off_t offset) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool open_segment(MultipartStore* store, uint32_t segment, off_t size) {
+    char path[PATH_MAX];
+    segment_path(store, segment, path);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to open segment");
+        return false;
+    }
+
+    // Drop bytes that were appended after the last indexed entry.
+    if (ftruncate(fd, size) != 0) {
+        perror("Failed to truncate segment");
+        close(fd);
+        return false;
+    }
+
+    if (store->segment_fd >= 0)
+        close(store->segment_fd);
+
+    store->segment_fd = fd;
+    store->segment = segment;
+    store->segment_offset = (uint64_t)size;
+    return true;
+}
+
+// Loads the index, dropping a torn or corrupt tail left by a crash.
+static bool recover_index(MultipartStore* store) {
+    struct stat st;
+    if (fstat(store->index_fd, &st) != 0) {
+        perror("fstat");
+        return false;
+    }
+
+    size_t index_size = (size_t)st.st_size;
+    unsigned char* index = (unsigned char*)malloc(index_size ? index_size : 1);
+    if (!index) {
+        perror("Failed to allocate memory for index");
+        return false;
+    }
+
+    if (pread(store->index_fd, index, index_size, 0) != (ssize_t)index_size) {
+        perror("Failed to read index");
+        free(index);
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos + INDEX_FIXED_SIZE + 4 <= index_size) {
+        const unsigned char* record = index + pos;
+        size_t mime_len = get_u16(record + 24 + MULTIPART_DIGEST_SIZE);
+        if (get_u32(record) != INDEX_MAGIC || mime_len >= MAX_MIMETYPE_SIZE ||
+            pos + INDEX_FIXED_SIZE + mime_len + 4 > index_size) {
+            break;
+        }
+
+        if (get_u32(record + INDEX_FIXED_SIZE + mime_len) != crc32(record, INDEX_FIXED_SIZE + mime_len))
+            break;
+
+        MultipartStoreEntry entry = {0};
+        entry.id = store->num_entries;
+        entry.segment = get_u32(record + 4);
+        entry.offset = get_u64(record + 8);
+        entry.size = get_u64(record + 16);
+        memcpy(entry.digest, record + 24, MULTIPART_DIGEST_SIZE);
+        memcpy(entry.mimetype, record + INDEX_FIXED_SIZE, mime_len);
+        entry.mimetype[mime_len] = '\0';
+
+        if (!append_entry(store, &entry)) {
+            free(index);
+            return false;
+        }
+        pos += INDEX_FIXED_SIZE + mime_len + 4;
+    }
+    free(index);
+
+    if (pos != index_size) {
+        fprintf(stderr, "Truncating %zu bytes of damaged index in %s\n", index_size - pos, store->dir);
+        if (ftruncate(store->index_fd, (off_t)pos) != 0 || fdatasync(store->index_fd) != 0) {
+            perror("Failed to truncate index");
+            return false;
+        }
+    }
+    store->index_size = pos;
+
+    // Resume appending right after the last indexed entry.
+    uint32_t segment = 0;
+    off_t segment_size = 0;
+    if (store->num_entries > 0) {
+        const MultipartStoreEntry* last = &store->entries[store->num_entries - 1];
+        segment = last->segment;
+        segment_size = (off_t)(last->offset + last->size);
+    }
+    return open_segment(store, segment, segment_size);
+}
+
+bool multipart_store_open(MultipartStore* store, const char* dir, size_t segment_size, size_t sync_every) {
+    memset(store, 0, sizeof(MultipartStore));
+    store->segment_fd = -1;
+    store->index_fd = -1;
+    store->segment_size = segment_size ? segment_size : MULTIPART_STORE_SEGMENT_SIZE;
+    store->sync_every = sync_every ? sync_every : 1;
+
+    if (strlen(dir) >= sizeof(store->dir)) {
+        fprintf(stderr, "store directory path is too long\n");
+        return false;
+    }
+    strcpy(store->dir, dir);
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create store directory");
+        return false;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index.pack", dir);
+    store->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store->index_fd < 0) {
+        perror("Failed to open store index");
+        return false;
+    }
+
+    if (pthread_mutex_init(&store->lock, NULL) != 0) {
+        fprintf(stderr, "Failed to initialize store lock\n");
+        close(store->index_fd);
+        store->index_fd = -1;
+        return false;
+    }
+
+    if (!recover_index(store)) {
+        multipart_store_close(store);
+        return false;
+    }
+    return true;
+}
+
+// Makes pending entries durable. Segment data is synced before the index records that point
+// to it are written, so the index never references bytes that are not on disk. On failure the
+// records stay pending and the index is cut back to its last synced length, so the next sync
+// writes each record once.
+static bool store_sync_locked(MultipartStore* store) {
+    if (store->num_pending == 0)
+        return true;
+
+    if (fdatasync(store->segment_fd) != 0) {
+        perror("Failed to sync segment");
+        return false;
+    }
+
+    if (!write_all(store->index_fd, store->pending, store->pending_size) || fdatasync(store->index_fd) != 0) {
+        perror("Failed to write store index");
+        if (ftruncate(store->index_fd, (off_t)store->index_size) != 0)
+            perror("Failed to truncate index");
+        return false;
+    }
+
+    store->index_size += store->pending_size;
+    store->pending_size = 0;
+    store->num_pending = 0;
+    return true;
+}
+
+bool multipart_store_put(MultipartStore* store, const FileHeader* file, const char* body, uint64_t* id) {
+    bool ok = false;
+    MultipartStoreEntry entry = {0};
+    entry.size = file->size;
+    strncpy(entry.mimetype, file->mimetype, MAX_MIMETYPE_SIZE - 1);
+    if (!multipart_sha256(body + file->offset, file->size, entry.digest))
+        return false;
+
+    pthread_mutex_lock(&store->lock);
+
+    // Roll over to a new segment when this file would not fit.
+    if (store->segment_offset > 0 && store->segment_offset + file->size > store->segment_size) {
+        // Entries must not point into a segment that is not durable.
+        if (!store_sync_locked(store) || !open_segment(store, store->segment + 1, 0))
+            goto unlock;
+    }
+
+    // Nothing can fail after the bytes are written, so a failed put leaves no trace.
+    if (!reserve_entry(store) || !reserve_record(store))
+        goto unlock;
+
+    entry.id = store->num_entries;
+    entry.segment = store->segment;
+    entry.offset = store->segment_offset;
+
+    if (!pwrite_all(store->segment_fd, body + file->offset, file->size, (off_t)entry.offset)) {
+        perror("Failed to append to segment");
+        // Realign the segment with what the index knows about.
+        if (ftruncate(store->segment_fd, (off_t)store->segment_offset) != 0)
+            perror("Failed to truncate segment");
+        goto unlock;
+    }
+
+    store->entries[store->num_entries++] = entry;
+    store->segment_offset += file->size;
+    store->pending_size += encode_record(&entry, store->pending + store->pending_size);
+    store->num_pending++;
+
+    // The entry is stored from here on; a failed sync leaves it pending for the next one.
+    if (store->num_pending >= store->sync_every)
+        store_sync_locked(store);
+
+    ok = true;
+    if (id)
+        *id = entry.id;
+
+unlock:
+    pthread_mutex_unlock(&store->lock);
+    return ok;
+}
+
+bool multipart_store_sync(MultipartStore* store) {
+    pthread_mutex_lock(&store->lock);
+    bool ok = store_sync_locked(store);
+    pthread_mutex_unlock(&store->lock);
+    return ok;
+}
+
+bool multipart_store_get(MultipartStore* store, uint64_t id, MultipartStoreEntry* entry) {
+    bool found = false;
+    pthread_mutex_lock(&store->lock);
+    if (id < store->num_entries) {
+        *entry = store->entries[id];
+        found = true;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return found;
+}
+
+bool multipart_store_read(const MultipartStore* store, const MultipartStoreEntry* entry, char* buffer) {
+    char path[PATH_MAX];
+    segment_path(store, entry->segment, path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open segment");
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < entry->size) {
+        ssize_t n = pread(fd, buffer + done, entry->size - done, (off_t)(entry->offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            perror("Failed to read segment");
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+
+    close(fd);
+    return true;
+}
+
+void multipart_store_close(MultipartStore* store) {
+    if (store->index_fd >= 0) {
+        store_sync_locked(store);
+        pthread_mutex_destroy(&store->lock);
+        close(store->index_fd);
+        store->index_fd = -1;
+    }
+
+    if (store->segment_fd >= 0) {
+        close(store->segment_fd);
+        store->segment_fd = -1;
+    }
+
+    free(store->entries);
+    free(store->pending);
+    store->entries = NULL;
+    store->pending = NULL;
+    store->num_entries = 0;
+    store->entries_capacity = 0;
+    store->num_pending = 0;
+    store->pending_size = 0;
+    store->pending_capacity = 0;
+}
@@ -0,0 +1,131 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_stream.c                                                               #
+// Read handles over a file part, whether its bytes are in the body buffer or in a spool  #
+// file or memfd. Consumers read, pread, map it or get a FILE* without copying it out.   #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+void multipart_stream_from_body(MultipartStream* stream, const FileHeader* file, const char* body) {
+    memset(stream, 0, sizeof(MultipartStream));
+    stream->data = body + file->offset;
+    stream->fd = -1;
+    stream->size = file->size;
+}
+
+void multipart_stream_from_fd(MultipartStream* stream, const FileHeader* file, int fd, off_t body_offset) {
+    memset(stream, 0, sizeof(MultipartStream));
+    stream->fd = fd;
+    stream->base = body_offset + (off_t)file->offset;
+    stream->size = file->size;
+}
+
+ssize_t multipart_stream_pread(MultipartStream* stream, void* buf, size_t size, size_t offset) {
+    if (offset >= stream->size)
+        return 0;
+    if (size > stream->size - offset)
+        size = stream->size - offset;
+
+    if (stream->data) {
+        memcpy(buf, stream->data + offset, size);
+        return (ssize_t)size;
+    }
+
+    ssize_t n;
+    do {
+        n = pread(stream->fd, buf, size, stream->base + (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+ssize_t multipart_stream_read(MultipartStream* stream, void* buf, size_t size) {
+    ssize_t n = multipart_stream_pread(stream, buf, size, stream->pos);
+    if (n > 0)
+        stream->pos += n;
+    return n;
+}
+
+const char* multipart_stream_map(MultipartStream* stream) {
+    if (stream->data)
+        return stream->data;
+
+    if (stream->map)
+        return (const char*)stream->map + stream->map_offset;
+
+    // mmap offsets must be page aligned, map from the page holding the first byte.
+    off_t page = sysconf(_SC_PAGESIZE);
+    size_t delta = (size_t)(stream->base % page);
+    size_t length = delta + stream->size;
+    if (length == 0)
+        length = 1;
+
+    void* map = mmap(NULL, length, PROT_READ, MAP_SHARED, stream->fd, stream->base - (off_t)delta);
+    if (map == MAP_FAILED) {
+        perror("Failed to map file part");
+        return NULL;
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+
+    stream->map = map;
+    stream->map_size = length;
+    stream->map_offset = delta;
+    return (const char*)map + delta;
+}
+
+// =============== FILE* adapter =====================
+
+static ssize_t cookie_read(void* cookie, char* buf, size_t size) {
+    return multipart_stream_read((MultipartStream*)cookie, buf, size);
+}
+
+static int cookie_seek(void* cookie, off64_t* offset, int whence) {
+    MultipartStream* stream = (MultipartStream*)cookie;
+    off64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = (off64_t)stream->pos;
+            break;
+        case SEEK_END:
+            base = (off64_t)stream->size;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (*offset < -base) {
+        errno = EINVAL;
+        return -1;
+    }
+    stream->pos = (size_t)(base + *offset);
+    *offset = (off64_t)stream->pos;
+    return 0;
+}
+
+FILE* multipart_stream_fopen(MultipartStream* stream) {
+    cookie_io_functions_t io = {.read = cookie_read, .write = NULL, .seek = cookie_seek, .close = NULL};
+    FILE* f = fopencookie(stream, "r", io);
+    if (!f)
+        perror("Failed to open stream");
+    return f;
+}
+
+void multipart_stream_close(MultipartStream* stream) {
+    if (stream->map)
+        munmap(stream->map, stream->map_size);
+    stream->map = NULL;
+    stream->map_size = 0;
+    stream->map_offset = 0;
+}
@@ -0,0 +1,299 @@
+// ========================================================================================
+// Licence: MIT                                                                           #
+// File: multipart_tar.c                                                                  #
+// Streams a parsed form into a ustar archive: one entry per file plus a "fields" entry   #
+// with all the fields. File bytes are copied in the kernel with copy_file_range or       #
+// sendfile when the request body is backed by a file.                                    #
+//=========================================================================================
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "multipart.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_SIZE 155
+
+// POSIX ustar header.
+typedef struct TarHeader {
+    char name[TAR_NAME_SIZE];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[TAR_PREFIX_SIZE];
+    char padding[12];
+} TarHeader;
+
+_Static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "tar header must be one block");
+
+static bool tar_write(MultipartTarSink* sink, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(sink->fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write tar stream");
+            return false;
+        }
+        p += n;
+        size -= n;
+        sink->written += n;
+    }
+    return true;
+}
+
+static bool tar_pad(MultipartTarSink* sink, uint64_t size) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t remainder = size % TAR_BLOCK_SIZE;
+    return remainder == 0 || tar_write(sink, zeros, TAR_BLOCK_SIZE - remainder);
+}
+
+// Writes value as a null-terminated octal number, or in the GNU base-256 encoding if it does not fit.
+static void tar_number(char* field, size_t width, uint64_t value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)value);
+        return;
+    }
+
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0 && value > 0; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Copies s into a tar name field, replacing path separators so a filename can not name a subdirectory.
+static void tar_name(char* field, size_t width, const char* s) {
+    size_t i = 0;
+    for (; s[i] && i < width; i++)
+        field[i] = s[i] == '/' ? '_' : s[i];
+}
+
+static bool tar_write_block_header(MultipartTarSink* sink, const char* prefix, const char* name, uint64_t size,
+                                   char typeflag) {
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+
+    tar_name(header.name, sizeof(header.name), name);
+    strncpy(header.prefix, prefix, sizeof(header.prefix) - 1);
+    memcpy(header.mode, "0000644", 8);
+    tar_number(header.uid, sizeof(header.uid), 0);
+    tar_number(header.gid, sizeof(header.gid), 0);
+    tar_number(header.size, sizeof(header.size), size);
+    tar_number(header.mtime, sizeof(header.mtime), (uint64_t)sink->mtime);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    // The checksum is computed with the checksum field set to spaces.
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    unsigned int sum = 0;
+    const unsigned char* bytes = (const unsigned char*)&header;
+    for (size_t i = 0; i < sizeof(header); i++)
+        sum += bytes[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+
+    return tar_write(sink, &header, sizeof(header));
+}
+
+// Writes a pax extended header carrying the full path of the next entry, for names that do not
+// fit the 100 byte name field. Readers without pax support fall back to the truncated name.
+static bool tar_write_pax_path(MultipartTarSink* sink, const char* prefix, const char* name) {
+    char path[TAR_PREFIX_SIZE + MAX_FILENAME_SIZE + 2];
+    size_t length = 0;
+    if (prefix[0] != '\0')
+        length = (size_t)snprintf(path, sizeof(path), "%s/", prefix);
+    size_t name_length = strlen(name);
+    if (length + name_length >= sizeof(path)) {
+        fprintf(stderr, "Tar entry name is too long: %s\n", name);
+        return false;
+    }
+    tar_name(path + length, name_length, name);
+    length += name_length;
+
+    // A record is "<length> path=<path>\n" where length counts the whole record, its own digits included.
+    size_t base = length + sizeof(" path=\n") - 1;
+    size_t digits = 1;
+    for (size_t limit = 10; base + digits >= limit; limit *= 10)
+        digits++;
+    size_t record_length = base + digits;
+
+    char record[sizeof(path) + 32];
+    int n = snprintf(record, sizeof(record), "%zu path=%.*s\n", record_length, (int)length, path);
+    if (n < 0 || (size_t)n != record_length) {
+        fprintf(stderr, "Failed to format pax header for %s\n", name);
+        return false;
+    }
+
+    return tar_write_block_header(sink, "", "PaxHeader", record_length, 'x') &&
+           tar_write(sink, record, record_length) && tar_pad(sink, record_length);
+}
+
+static bool tar_write_header(MultipartTarSink* sink, const char* prefix, const char* name, uint64_t size) {
+    // "", "." and ".." would name the entry's directory or its parent instead of a file in it.
+    if (strcmp(name, "") == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        name = "_";
+    if (strlen(name) > TAR_NAME_SIZE && !tar_write_pax_path(sink, prefix, name))
+        return false;
+    return tar_write_block_header(sink, prefix, name, size, '0');
+}
+
+// Copies size bytes at offset in the body file to the archive without going through user space.
+static bool tar_copy_from_body_fd(MultipartTarSink* sink, off_t offset, size_t size) {
+    bool use_sendfile = false;
+    while (size > 0) {
+        ssize_t n;
+        if (!use_sendfile) {
+            n = copy_file_range(sink->body_fd, &offset, sink->fd, NULL, size, 0);
+            // Not a regular file pair or not supported on this filesystem.
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_sendfile = true;
+                continue;
+            }
+        } else {
+            n = sendfile(sink->fd, sink->body_fd, &offset, size);
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            perror("Failed to copy file into tar stream");
+            return false;
+        }
+        size -= n;
+        sink->written += n;
+    }
+    return true;
+}
+
+void multipart_tar_open(MultipartTarSink* sink, int fd, int body_fd, off_t body_offset) {
+    memset(sink, 0, sizeof(MultipartTarSink));
+    sink->fd = fd;
+    sink->body_fd = body_fd;
+    sink->body_offset = body_offset;
+    sink->mtime = time(NULL);
+}
+
+bool multipart_tar_add_file(const FileHeader* file, const char* body, void* userdata) {
+    MultipartTarSink* sink = (MultipartTarSink*)userdata;
+
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "files/%zu", sink->num_files++);
+    if (!tar_write_header(sink, prefix, file->filename, file->size))
+        return false;
+
+    bool ok;
+    if (sink->body_fd >= 0)
+        ok = tar_copy_from_body_fd(sink, sink->body_offset + (off_t)file->offset, file->size);
+    else
+        ok = tar_write(sink, body + file->offset, file->size);
+
+    return ok && tar_pad(sink, file->size);
+}
+
+// Makes room for extra more bytes in the fields buffer.
+static bool fields_reserve(MultipartTarSink* sink, size_t extra) {
+    if (sink->fields && sink->fields_size + extra <= sink->fields_capacity)
+        return true;
+
+    size_t new_capacity = sink->fields_capacity ? sink->fields_capacity * 2 : 1024;
+    while (new_capacity < sink->fields_size + extra)
+        new_capacity *= 2;
+
+    char* fields = (char*)realloc(sink->fields, new_capacity);
+    if (!fields) {
+        perror("Failed to allocate memory for tar fields");
+        return false;
+    }
+    sink->fields = fields;
+    sink->fields_capacity = new_capacity;
+    return true;
+}
+
+// Appends s to the fields buffer, percent-encoded as in application/x-www-form-urlencoded.
+// The caller reserves 3 bytes per character of s.
+static void append_urlencoded(MultipartTarSink* sink, const char* s) {
+    static const char digits[] = "0123456789ABCDEF";
+    char* out = sink->fields + sink->fields_size;
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '-' ||
+            *p == '_' || *p == '.' || *p == '*') {
+            *out++ = (char)*p;
+        } else if (*p == ' ') {
+            *out++ = '+';
+        } else {
+            *out++ = '%';
+            *out++ = digits[*p >> 4];
+            *out++ = digits[*p & 0x0f];
+        }
+    }
+    sink->fields_size = out - sink->fields;
+}
+
+bool multipart_tar_add_field(const FormField* field, void* userdata) {
+    MultipartTarSink* sink = (MultipartTarSink*)userdata;
+    if (!fields_reserve(sink, (strlen(field->name) + strlen(field->value)) * 3 + 2))
+        return false;
+
+    if (sink->fields_size > 0)
+        sink->fields[sink->fields_size++] = '&';
+
+    append_urlencoded(sink, field->name);
+    sink->fields[sink->fields_size++] = '=';
+    append_urlencoded(sink, field->value);
+    return true;
+}
+
+bool multipart_tar_finish(MultipartTarSink* sink) {
+    static const char end_of_archive[2 * TAR_BLOCK_SIZE];
+    bool ok = tar_write_header(sink, "", "fields", sink->fields_size) &&
+              tar_write(sink, sink->fields, sink->fields_size) && tar_pad(sink, sink->fields_size) &&
+              tar_write(sink, end_of_archive, sizeof(end_of_archive));
+
+    free(sink->fields);
+    sink->fields = NULL;
+    sink->fields_size = 0;
+    sink->fields_capacity = 0;
+    return ok;
+}
+
+bool multipart_tar_write_form(const MultipartForm* form, const char* body, int fd, int body_fd, off_t body_offset) {
+    MultipartTarSink sink;
+    multipart_tar_open(&sink, fd, body_fd, body_offset);
+
+    for (size_t i = 0; i < form->num_fields; i++) {
+        if (!multipart_tar_add_field(&form->fields[i], &sink)) {
+            free(sink.fields);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < form->num_files; i++) {
+        if (!multipart_tar_add_file(form->files[i], body, &sink)) {
+            free(sink.fields);
+            return false;
+        }
+    }
+    return multipart_tar_finish(&sink);
+}
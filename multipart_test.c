@@ -1,10 +1,46 @@
 #include "multipart.h"
 #include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 static void test_unterminated_body();
+static void test_tree_hash();
+static void test_content_defined_chunking();
+static void test_save_file_encrypted();
+static void test_pack_store();
+static void test_tar_sink();
+static void test_sink_pipeline();
+static void test_save_file_direct();
+static void test_save_file_sparse();
+static void test_pipe_file();
+static void test_stream();
+static void test_body_buffer();
+static void test_s3_sink();
+static void test_save_scheduler();
+static void test_retry_cache();
+static void test_validate();
+static void test_matcher();
+static void test_proxy();
+static void test_decode();
+static void test_clamd_sink();
+static void test_byteranges();
+static void test_related();
+static void test_form_json();
+static void test_csv_sink();
+static void test_context_pool();
+static void test_boundary_search();
 
 int main() {
     // Read in form text with a multipart/form with username,password and an image.
@@ -110,6 +146,31 @@ int main() {
     assert(form.files == NULL);
 
     test_unterminated_body();
+    test_tree_hash();
+    test_content_defined_chunking();
+    test_save_file_encrypted();
+    test_pack_store();
+    test_tar_sink();
+    test_sink_pipeline();
+    test_save_file_direct();
+    test_save_file_sparse();
+    test_pipe_file();
+    test_stream();
+    test_body_buffer();
+    test_s3_sink();
+    test_save_scheduler();
+    test_retry_cache();
+    test_validate();
+    test_matcher();
+    test_proxy();
+    test_decode();
+    test_clamd_sink();
+    test_byteranges();
+    test_related();
+    test_form_json();
+    test_csv_sink();
+    test_context_pool();
+    test_boundary_search();
     printf("All tests passed\n");
     return EXIT_SUCCESS;
 }
@@ -147,3 +208,2148 @@ void test_unterminated_body() {
 
     printf("Test with non-null terminated body passed\n");
 }
+
+// Expected digests were computed with Python's hashlib.
+void test_tree_hash() {
+    char hex[MULTIPART_DIGEST_SIZE * 2 + 1];
+    unsigned char digest[MULTIPART_DIGEST_SIZE];
+
+    char a[1000];
+    memset(a, 'a', sizeof(a));
+    assert(multipart_sha256(a, sizeof(a), digest));
+    multipart_digest_to_hex(digest, hex);
+    assert(strcmp(hex, "41edece42d63e8d9bf515a9ba6932e1c20cbc9f5a5d134645adb5db1b9737ea3") == 0);
+
+    // Fed in uneven pieces, the incremental API gives the same digest.
+    MultipartSha256 sha;
+    unsigned char incremental[MULTIPART_DIGEST_SIZE];
+    assert(multipart_sha256_init(&sha));
+    assert(multipart_sha256_update(&sha, a, 1) && multipart_sha256_update(&sha, a + 1, 700) &&
+           multipart_sha256_update(&sha, a + 701, sizeof(a) - 701));
+    assert(multipart_sha256_final(&sha, incremental));
+    assert(memcmp(incremental, digest, MULTIPART_DIGEST_SIZE) == 0);
+
+    // 3 full chunks and a partial one.
+    size_t size = 3 * MULTIPART_TREE_CHUNK_SIZE + 12345;
+    char* body = malloc(size);
+    assert(body);
+    for (size_t i = 0; i < size; i++) {
+        body[i] = (char)((i * 31 + 7) & 0xff);
+    }
+
+    FileHeader file = {.offset = 0, .size = size};
+    assert(multipart_tree_hash_file(&file, body, 3));
+    assert(file.has_tree_hash);
+    multipart_digest_to_hex(file.tree_hash, hex);
+    assert(strcmp(hex, "986ec33aee76bf1f1feec01ee8abc862451bb0d4440b2e6b9284022ff8c47702") == 0);
+
+    // The root must not depend on the number of threads.
+    unsigned char single[MULTIPART_DIGEST_SIZE];
+    assert(multipart_tree_hash(body, size, 1, single));
+    assert(memcmp(single, file.tree_hash, MULTIPART_DIGEST_SIZE) == 0);
+
+    free(body);
+    printf("Tree hash test passed\n");
+}
+
+#define TEST_BOUNDARY "--WebKitFormBoundaryS3sDR2atmc8KJS5U"
+
+// Builds a request body with a username field and a single file with the given contents.
+// The returned buffer must be freed by the caller.
+static char* build_form(const char* file_data, size_t file_size, size_t* body_size) {
+    const char* head = TEST_BOUNDARY
+        "\r\n"
+        "Content-Disposition: form-data; name=\"username\"\r\n\r\n"
+        "nabiizy\r\n" TEST_BOUNDARY
+        "\r\n"
+        "Content-Disposition: form-data; name=\"file\"; filename=\"data.bin\"\r\n"
+        "Content-Type: application/octet-stream\r\n\r\n";
+    const char* tail = "\r\n" TEST_BOUNDARY "--\r\n";
+
+    size_t head_len = strlen(head);
+    size_t tail_len = strlen(tail);
+    char* body = malloc(head_len + file_size + tail_len);
+    assert(body);
+
+    memcpy(body, head, head_len);
+    memcpy(body + head_len, file_data, file_size);
+    memcpy(body + head_len + file_size, tail, tail_len);
+    *body_size = head_len + file_size + tail_len;
+    return body;
+}
+
+// Fills buf with deterministic pseudo-random bytes.
+static void fill_random(char* buf, size_t size, uint64_t seed) {
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        buf[i] = (char)(seed >> 56);
+    }
+}
+
+static size_t count_shared_chunks(const FileHeader* a, const FileHeader* b) {
+    size_t shared = 0;
+    for (size_t i = 0; i < a->num_chunks; i++) {
+        for (size_t j = 0; j < b->num_chunks; j++) {
+            if (memcmp(a->chunks[i].digest, b->chunks[j].digest, MULTIPART_DIGEST_SIZE) == 0) {
+                shared++;
+                break;
+            }
+        }
+    }
+    return shared;
+}
+
+void test_content_defined_chunking() {
+    size_t file_size = 512 * 1024;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 42);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+
+    MultipartOptions options = {.chunk_files = true};
+    MultipartForm form = {0};
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    assert(form.num_files == 1);
+    assert(strcmp(multipart_get_field_value(&form, "username"), "nabiizy") == 0);
+
+    FileHeader* file = form.files[0];
+    assert(file->num_chunks > 1);
+
+    // Chunks must be contiguous and cover the whole file.
+    size_t offset = file->offset;
+    for (size_t i = 0; i < file->num_chunks; i++) {
+        MultipartChunk* chunk = &file->chunks[i];
+        assert(chunk->offset == offset);
+        assert(chunk->size <= MULTIPART_CDC_MAX_SIZE);
+        if (i + 1 < file->num_chunks)
+            assert(chunk->size >= MULTIPART_CDC_MIN_SIZE);
+
+        unsigned char digest[MULTIPART_DIGEST_SIZE];
+        assert(multipart_sha256(body + chunk->offset, chunk->size, digest));
+        assert(memcmp(digest, chunk->digest, MULTIPART_DIGEST_SIZE) == 0);
+        offset += chunk->size;
+    }
+    assert(offset == file->offset + file->size);
+
+    // Parsing without chunking must find the same file.
+    MultipartForm plain = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &plain) == MULTIPART_OK);
+    assert(plain.files[0]->offset == file->offset && plain.files[0]->size == file->size);
+    assert(plain.files[0]->chunks == NULL);
+    multipart_free_form(&plain);
+
+    // Inserting bytes in the middle of the file only changes the chunks around the edit.
+    size_t edit = file_size / 2;
+    char* edited = malloc(file_size + 3);
+    assert(edited);
+    memcpy(edited, file_data, edit);
+    memcpy(edited + edit, "xyz", 3);
+    memcpy(edited + edit + 3, file_data + edit, file_size - edit);
+
+    size_t edited_body_size;
+    char* edited_body = build_form(edited, file_size + 3, &edited_body_size);
+    MultipartForm edited_form = {0};
+    assert(multipart_parse_form_ex(edited_body, edited_body_size, TEST_BOUNDARY, &edited_form, &options) ==
+           MULTIPART_OK);
+    assert(count_shared_chunks(file, edited_form.files[0]) + 2 >= file->num_chunks);
+
+    multipart_free_form(&edited_form);
+    multipart_free_form(&form);
+    free(edited_body);
+    free(edited);
+    free(body);
+    free(file_data);
+    printf("Content-defined chunking test passed\n");
+}
+
+static bool test_key(const FileHeader* file, unsigned char key[MULTIPART_AES_KEY_SIZE], void* userdata) {
+    (void)file;
+    memcpy(key, userdata, MULTIPART_AES_KEY_SIZE);
+    return true;
+}
+
+static bool refuse_key(const FileHeader* file, unsigned char key[MULTIPART_AES_KEY_SIZE], void* userdata) {
+    (void)file;
+    (void)key;
+    (void)userdata;
+    return false;
+}
+
+void test_save_file_encrypted() {
+    size_t file_size = 200 * 1024 + 17;  // Not a multiple of the block size.
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 7);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = multipart_get_file(&form, "file");
+    assert(file);
+
+    unsigned char key[MULTIPART_AES_KEY_SIZE];
+    fill_random((char*)key, sizeof(key), 99);
+
+    const char* path = "form_upload_encrypted.bin";
+    assert(multipart_save_file_encrypted(file, body, path, test_key, key));
+
+    char* plaintext = NULL;
+    size_t plaintext_size = 0;
+    assert(multipart_decrypt_file(path, key, &plaintext, &plaintext_size));
+    assert(plaintext_size == file->size);
+    assert(memcmp(plaintext, body + file->offset, file->size) == 0);
+    free(plaintext);
+
+    // A refused key leaves the saved file alone.
+    assert(!multipart_save_file_encrypted(file, body, path, refuse_key, NULL));
+    assert(multipart_decrypt_file(path, key, &plaintext, &plaintext_size));
+    assert(plaintext_size == file->size);
+    free(plaintext);
+
+    // A wrong key must fail authentication.
+    key[0] ^= 1;
+    assert(!multipart_decrypt_file(path, key, &plaintext, &plaintext_size));
+
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Encrypted save test passed\n");
+}
+
+void test_pack_store() {
+    const char* dir = "form_upload_store";
+    size_t file_size = 3000;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 3);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    // Segments of 8000 bytes hold two files each.
+    MultipartStore store;
+    assert(multipart_store_open(&store, dir, 8000, 4));
+    for (uint64_t i = 0; i < 5; i++) {
+        uint64_t id;
+        assert(multipart_store_put(&store, file, body, &id));
+        assert(id == i);
+    }
+    multipart_store_close(&store);
+
+    // Simulate a torn index write.
+    FILE* index = fopen("form_upload_store/index.pack", "ab");
+    assert(index);
+    fwrite("MPPKgarbage", 1, 11, index);
+    fclose(index);
+
+    assert(multipart_store_open(&store, dir, 8000, 4));
+    assert(store.num_entries == 5);
+
+    MultipartStoreEntry entry;
+    assert(multipart_store_get(&store, 4, &entry));
+    assert(entry.segment == 2 && entry.offset == 0 && entry.size == file->size);
+    assert(strcmp(entry.mimetype, "application/octet-stream") == 0);
+    assert(!multipart_store_get(&store, 5, &entry));
+
+    char* contents = malloc(file->size);
+    assert(contents);
+    assert(multipart_store_get(&store, 3, &entry));
+    assert(multipart_store_read(&store, &entry, contents));
+    assert(memcmp(contents, body + file->offset, file->size) == 0);
+
+    unsigned char digest[MULTIPART_DIGEST_SIZE];
+    assert(multipart_sha256(contents, file->size, digest));
+    assert(memcmp(digest, entry.digest, MULTIPART_DIGEST_SIZE) == 0);
+
+    // Appends continue after the recovered entries, at the recorded offset whatever the
+    // position of the segment descriptor.
+    assert(lseek(store.segment_fd, 123, SEEK_SET) == 123);
+    uint64_t id;
+    assert(multipart_store_put(&store, file, body, &id));
+    assert(id == 5);
+    assert(multipart_store_get(&store, 5, &entry));
+    assert(entry.segment == 2 && entry.offset == file->size);
+    memset(contents, 0, file->size);
+    assert(multipart_store_read(&store, &entry, contents));
+    assert(memcmp(contents, body + file->offset, file->size) == 0);
+    multipart_store_close(&store);
+
+    remove("form_upload_store/index.pack");
+    remove("form_upload_store/segment-000000.pack");
+    remove("form_upload_store/segment-000001.pack");
+    remove("form_upload_store/segment-000002.pack");
+    remove(dir);
+
+    free(contents);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Pack store test passed\n");
+}
+
+// Checks that archive holds the test form: files/0/data.bin then the fields entry.
+static void check_tar_archive(const char* path, const char* body, const FileHeader* file) {
+    FILE* f = fopen(path, "rb");
+    assert(f);
+
+    char block[512];
+    assert(fread(block, 1, 512, f) == 512);
+    assert(strcmp(block, "data.bin") == 0);
+    assert(strcmp(block + 345, "files/0") == 0);
+    assert(strtoull(block + 124, NULL, 8) == file->size);
+
+    char* contents = malloc(file->size);
+    assert(contents);
+    assert(fread(contents, 1, file->size, f) == file->size);
+    assert(memcmp(contents, body + file->offset, file->size) == 0);
+    free(contents);
+
+    fseek(f, (512 - file->size % 512) % 512, SEEK_CUR);
+    assert(fread(block, 1, 512, f) == 512);
+    assert(strcmp(block, "fields") == 0);
+    assert(fread(block, 1, 512, f) == 512);
+    assert(strcmp(block, "username=nabiizy") == 0);
+    fclose(f);
+}
+
+void test_tar_sink() {
+    size_t file_size = 5000;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 5);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+
+    // Archive while parsing.
+    const char* path = "form_upload.tar";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    MultipartTarSink sink;
+    multipart_tar_open(&sink, fd, -1, 0);
+    MultipartOptions options = {
+        .on_field = multipart_tar_add_field,
+        .on_file = multipart_tar_add_file,
+        .userdata = &sink,
+    };
+
+    MultipartForm form = {0};
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    assert(multipart_tar_finish(&sink));
+    assert(sink.written % 512 == 0);
+    close(fd);
+    check_tar_archive(path, body, form.files[0]);
+
+    // Same archive from a file-backed body.
+    const char* body_path = "form_upload_body.bin";
+    FILE* f = fopen(body_path, "wb");
+    assert(f);
+    fwrite("junk", 1, 4, f);
+    fwrite(body, 1, body_size, f);
+    fclose(f);
+
+    int body_fd = open(body_path, O_RDONLY);
+    assert(body_fd >= 0);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(multipart_tar_write_form(&form, NULL, fd, body_fd, 4));
+    close(fd);
+    close(body_fd);
+    check_tar_archive(path, body, form.files[0]);
+
+    // A name longer than the ustar name field is carried in a pax header.
+    FileHeader long_file = *form.files[0];
+    memset(long_file.filename, 'n', 120);
+    long_file.filename[60] = '/';
+    long_file.filename[120] = '\0';
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    multipart_tar_open(&sink, fd, -1, 0);
+    assert(multipart_tar_add_file(&long_file, body, &sink) && multipart_tar_finish(&sink));
+    close(fd);
+
+    char block[512];
+    f = fopen(path, "rb");
+    assert(f && fread(block, 1, 512, f) == 512);
+    assert(block[156] == 'x' && strtoull(block + 124, NULL, 8) == 138);
+    assert(fread(block, 1, 512, f) == 512);
+    char record[160];
+    snprintf(record, sizeof(record), "138 path=files/0/%.60s_%.59s\n", long_file.filename, long_file.filename + 61);
+    assert(memcmp(block, record, 138) == 0);
+    assert(fread(block, 1, 512, f) == 512);
+    assert(block[156] == '0' && strtoull(block + 124, NULL, 8) == long_file.size);
+    fclose(f);
+
+    // Names that would point at the entry's directory or its parent get a placeholder.
+    const char* dot_names[] = {"..", ".", ""};
+    for (size_t i = 0; i < 3; i++) {
+        FileHeader dot_file = *form.files[0];
+        strcpy(dot_file.filename, dot_names[i]);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        multipart_tar_open(&sink, fd, -1, 0);
+        assert(multipart_tar_add_file(&dot_file, body, &sink) && multipart_tar_finish(&sink));
+        close(fd);
+
+        f = fopen(path, "rb");
+        assert(f && fread(block, 1, 512, f) == 512);
+        assert(strcmp(block, "_") == 0 && strcmp(block + 345, "files/0") == 0);
+        fclose(f);
+    }
+
+    remove(body_path);
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Tar sink test passed\n");
+}
+
+typedef struct CountingState {
+    size_t calls;
+    size_t bytes;
+} CountingState;
+
+static bool count_bytes(const FileHeader* file, const void* data, size_t size, void* userdata) {
+    (void)file;
+    (void)data;
+    CountingState* state = userdata;
+    state->calls++;
+    state->bytes += size;
+    return true;
+}
+
+void test_sink_pipeline() {
+    size_t file_size = 300 * 1024;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    // Compressible: random bytes only in the first half.
+    fill_random(file_data, file_size / 2, 11);
+    memset(file_data + file_size / 2, 'z', file_size - file_size / 2);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+
+    // digest -> tee(gzip -> fd, callback)
+    const char* path = "form_upload_sink.gz";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    MultipartFdSink output;
+    MultipartGzipSink gzip;
+    MultipartCallbackSink counter;
+    MultipartTeeSink tee;
+    MultipartDigestSink digest;
+    CountingState state = {0};
+
+    multipart_fd_sink_init(&output, fd);
+    multipart_gzip_sink_init(&gzip, 6, &output.base);
+    multipart_callback_sink_init(&counter, count_bytes, &state);
+    MultipartSink* branches[] = {&gzip.base, &counter.base};
+    multipart_tee_sink_init(&tee, branches, 2);
+    multipart_digest_sink_init(&digest, &tee.base);
+
+    MultipartOptions options = {.on_file = multipart_sink_on_file, .userdata = &digest};
+    MultipartForm form = {0};
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    close(fd);
+
+    FileHeader* file = form.files[0];
+    assert(state.bytes == file->size);
+    assert(state.calls == (file->size + MULTIPART_SINK_BLOCK_SIZE - 1) / MULTIPART_SINK_BLOCK_SIZE);
+
+    unsigned char expected[MULTIPART_DIGEST_SIZE];
+    assert(multipart_sha256(body + file->offset, file->size, expected));
+    assert(memcmp(expected, digest.digest, MULTIPART_DIGEST_SIZE) == 0);
+    assert(output.written < file->size);
+
+    // The gzip output must inflate back to the file.
+    gzFile gz = gzopen(path, "rb");
+    assert(gz);
+    char* inflated = malloc(file->size + 1);
+    assert(inflated);
+    assert(gzread(gz, inflated, file->size + 1) == (int)file->size);
+    assert(memcmp(inflated, body + file->offset, file->size) == 0);
+    gzclose(gz);
+
+    free(inflated);
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Sink pipeline test passed\n");
+}
+
+// Reads a whole file into a malloc'ed buffer.
+static char* read_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(*size + 1);
+    assert(data);
+    assert(fread(data, 1, *size, f) == *size);
+    fclose(f);
+    return data;
+}
+
+void test_save_file_direct() {
+    size_t file_size = 3 * MULTIPART_DIRECT_BUFFER_SIZE + 1000;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 13);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    const char* path = "form_upload_direct.bin";
+    assert(multipart_save_file_direct(file, body, path, true));
+
+    size_t saved_size;
+    char* saved = read_file(path, &saved_size);
+    assert(saved_size == file->size);
+    assert(memcmp(saved, body + file->offset, file->size) == 0);
+
+    free(saved);
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Direct save test passed\n");
+}
+
+void test_save_file_sparse() {
+    // Mostly zeros with a few islands of data, one of them straddling two blocks.
+    size_t file_size = 4 * 1024 * 1024;
+    char* file_data = calloc(1, file_size);
+    assert(file_data);
+    fill_random(file_data + 100, 5000, 17);
+    fill_random(file_data + 2 * 1024 * 1024 + 4000, 200, 19);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    const char* path = "form_upload_sparse.bin";
+    size_t holes = 0;
+    assert(multipart_save_file_sparse(file, body, path, &holes));
+    assert(holes >= file_size - 5 * MULTIPART_SPARSE_BLOCK_SIZE);
+
+    size_t saved_size;
+    char* saved = read_file(path, &saved_size);
+    assert(saved_size == file->size);
+    assert(memcmp(saved, body + file->offset, file->size) == 0);
+
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert((size_t)st.st_blocks * 512 < file->size / 4);
+
+    free(saved);
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Sparse save test passed\n");
+}
+
+void test_pipe_file() {
+    // Larger than the default pipe capacity, so feeding has to wait for the command.
+    size_t file_size = 300 * 1024 + 7;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 23);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    const char* path = "form_upload_pipe.bin";
+    char* cat_argv[] = {"sh", "-c", "cat > form_upload_pipe.bin", NULL};
+    int status = -1;
+    assert(multipart_pipe_file_to_command(file, body, cat_argv, &status));
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    size_t saved_size;
+    char* saved = read_file(path, &saved_size);
+    assert(saved_size == file->size);
+    assert(memcmp(saved, body + file->offset, file->size) == 0);
+    free(saved);
+
+    // A command that does not read its input fails the call without raising SIGPIPE.
+    char* true_argv[] = {"true", NULL};
+    assert(!multipart_pipe_file_to_command(file, body, true_argv, &status));
+
+    // Splice from a spooled body file into a pipe.
+    FileHeader small = *file;
+    small.size = 4096;
+    int body_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(body_fd >= 0);
+    assert(write(body_fd, body, body_size) == (ssize_t)body_size);
+
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(multipart_pipe_file_from_fd(&small, body_fd, 0, fds[1]));
+    char out[4096];
+    assert(read(fds[0], out, sizeof(out)) == (ssize_t)sizeof(out));
+    assert(memcmp(out, body + file->offset, sizeof(out)) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    close(body_fd);
+    remove(path);
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Pipe file test passed\n");
+}
+
+// Reads the whole stream in odd sized pieces through every access path and compares it to expected.
+static void check_stream(MultipartStream* stream, const char* expected, size_t size) {
+    char* buf = malloc(size + 1);
+    assert(buf);
+
+    size_t total = 0;
+    ssize_t n;
+    while ((n = multipart_stream_read(stream, buf + total, 1000)) > 0)
+        total += n;
+    assert(n == 0 && total == size);
+    assert(memcmp(buf, expected, size) == 0);
+
+    assert(multipart_stream_pread(stream, buf, 10, size - 4) == 4);
+    assert(memcmp(buf, expected + size - 4, 4) == 0);
+
+    const char* map = multipart_stream_map(stream);
+    assert(map && memcmp(map, expected, size) == 0);
+
+    FILE* f = multipart_stream_fopen(stream);
+    assert(f);
+    assert(fseek(f, 100, SEEK_SET) == 0);
+    assert(fread(buf, 1, size, f) == size - 100);
+    assert(memcmp(buf, expected + 100, size - 100) == 0);
+    assert(fseek(f, -8, SEEK_END) == 0 && ftell(f) == (long)size - 8);
+    fclose(f);
+
+    free(buf);
+}
+
+void test_stream() {
+    size_t file_size = 20000;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 29);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    MultipartStream stream;
+    multipart_stream_from_body(&stream, file, body);
+    check_stream(&stream, body + file->offset, file->size);
+    multipart_stream_close(&stream);
+
+    // Same part with the body spooled to a file, at an unaligned offset.
+    const char* path = "form_upload_spool.bin";
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(pwrite(fd, body, body_size, 123) == (ssize_t)body_size);
+    multipart_stream_from_fd(&stream, file, fd, 123);
+    check_stream(&stream, body + file->offset, file->size);
+    multipart_stream_close(&stream);
+    close(fd);
+    remove(path);
+
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("Stream test passed\n");
+}
+
+void test_body_buffer() {
+    size_t file_size = 5 * 1024 * 1024 + 3;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 31);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+
+    MultipartBodyBuffer buffer;
+    assert(multipart_body_init(&buffer, 0));
+
+    // Receive the body twice, in uneven pieces, to exercise growth and reuse.
+    for (int round = 0; round < 2; round++) {
+        size_t received = 0;
+        while (received < body_size) {
+            size_t n = body_size - received < 70000 ? body_size - received : 70000;
+            char* dst = multipart_body_reserve(&buffer, n);
+            assert(dst);
+            memcpy(dst, body + received, n);
+            multipart_body_commit(&buffer, n);
+            received += n;
+        }
+        assert(buffer.size == body_size && buffer.capacity >= body_size);
+        assert(memcmp(buffer.data, body, body_size) == 0);
+
+        MultipartForm form = {0};
+        assert(multipart_parse_form(buffer.data, buffer.size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+        assert(form.num_files == 1 && form.files[0]->size >= file_size);
+        multipart_free_form(&form);
+
+        multipart_body_reset(&buffer);
+        assert(buffer.size == 0);
+    }
+
+    assert(multipart_body_append(&buffer, "abc", 3) && buffer.size == 3);
+    multipart_body_free(&buffer);
+    assert(buffer.data == NULL);
+
+    // A freed buffer is mapped again on the next append, and a size that can not fit fails.
+    assert(multipart_body_append(&buffer, "abc", 3) && buffer.size == 3);
+    assert(buffer.capacity >= MULTIPART_BODY_INITIAL_SIZE && memcmp(buffer.data, "abc", 3) == 0);
+    assert(multipart_body_reserve(&buffer, SIZE_MAX - 1) == NULL);
+    multipart_body_free(&buffer);
+
+    free(body);
+    free(file_data);
+    printf("Body buffer test passed\n");
+}
+
+// Minimal in-process stand-in for an S3 endpoint, serving one connection at a time.
+typedef struct FakeS3 {
+    int listen_fd;
+    char port[16];
+    pthread_t thread;
+    size_t fail_part;  // Part number to answer with an error, 0 for none.
+    char* parts[64];
+    size_t part_sizes[64];
+    char* object;  // Assembled by CompleteMultipartUpload.
+    size_t object_size;
+    size_t num_parts;
+    bool signed_ok;  // Every request carried a SigV4 Authorization header.
+    bool aborted;
+} FakeS3;
+
+// Reads one HTTP request. Returns the raw request; body points into it.
+static char* fake_s3_read(int fd, char** body, size_t* body_size) {
+    size_t capacity = 4096, size = 0, need = 0;
+    char* buf = malloc(capacity + 1);
+    assert(buf);
+    for (;;) {
+        if (size == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity + 1);
+            assert(buf);
+        }
+        ssize_t n = recv(fd, buf + size, capacity - size, 0);
+        assert(n >= 0);
+        size += n;
+        buf[size] = '\0';
+
+        char* end = strstr(buf, "\r\n\r\n");
+        if (end && need == 0) {
+            const char* cl = strstr(buf, "Content-Length: ");
+            assert(cl);
+            need = (end + 4 - buf) + strtoul(cl + 16, NULL, 10);
+        }
+        if ((end && size >= need) || n == 0) {
+            *body = end + 4;
+            *body_size = size - (end + 4 - buf);
+            return buf;
+        }
+    }
+}
+
+static void fake_s3_respond(int fd, const char* status, const char* headers, const char* body) {
+    char response[1024];
+    int len = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\n%sContent-Length: %zu\r\n\r\n%s", status,
+                       headers, strlen(body), body);
+    assert(send(fd, response, len, MSG_NOSIGNAL) == len);
+}
+
+static void* fake_s3_serve(void* arg) {
+    FakeS3* s3 = arg;
+    bool done = false;
+    while (!done) {
+        int fd = accept(s3->listen_fd, NULL, NULL);
+        assert(fd >= 0);
+
+        char* body;
+        size_t body_size;
+        char* request = fake_s3_read(fd, &body, &body_size);
+        if (!strstr(request, "Authorization: AWS4-HMAC-SHA256 Credential=AKID/") ||
+            !strstr(request, "/us-east-1/s3/aws4_request, SignedHeaders=host;x-amz-content-sha256;x-amz-date"))
+            s3->signed_ok = false;
+
+        size_t part;
+        if (strncmp(request, "POST /bucket/up%20loads/data.bin?uploads= ", 42) == 0) {
+            fake_s3_respond(fd, "200 OK", "", "<Result><UploadId>id/1+2</UploadId></Result>");
+        } else if (sscanf(request, "PUT /bucket/up%%20loads/data.bin?partNumber=%zu&uploadId=id%%2F1%%2B2 ", &part) ==
+                       1 &&
+                   part >= 1 && part <= 64) {
+            if (part == s3->fail_part) {
+                fake_s3_respond(fd, "500 Internal Server Error", "", "<Error></Error>");
+            } else {
+                s3->parts[part - 1] = malloc(body_size);
+                assert(s3->parts[part - 1]);
+                memcpy(s3->parts[part - 1], body, body_size);
+                s3->part_sizes[part - 1] = body_size;
+                char etag[64];
+                snprintf(etag, sizeof(etag), "ETag: \"etag%zu\"\r\n", part);
+                fake_s3_respond(fd, "200 OK", etag, "");
+            }
+        } else if (strncmp(request, "POST /bucket/up%20loads/data.bin?uploadId=id%2F1%2B2 ", 52) == 0) {
+            // Assemble the parts listed in the request, in order.
+            for (size_t i = 0; i < 64; i++) {
+                char entry[96];
+                snprintf(entry, sizeof(entry), "<Part><PartNumber>%zu</PartNumber><ETag>\"etag%zu\"</ETag></Part>",
+                         i + 1, i + 1);
+                if (!strstr(body, entry))
+                    break;
+                s3->object = realloc(s3->object, s3->object_size + s3->part_sizes[i]);
+                assert(s3->object);
+                memcpy(s3->object + s3->object_size, s3->parts[i], s3->part_sizes[i]);
+                s3->object_size += s3->part_sizes[i];
+                s3->num_parts++;
+            }
+            fake_s3_respond(fd, "200 OK", "", "<CompleteMultipartUploadResult/>");
+            done = true;
+        } else if (strncmp(request, "DELETE /bucket/up%20loads/data.bin?uploadId=id%2F1%2B2 ", 54) == 0) {
+            s3->aborted = true;
+            fake_s3_respond(fd, "204 No Content", "", "");
+            done = true;
+        } else {
+            fake_s3_respond(fd, "400 Bad Request", "", "<Error></Error>");
+        }
+        free(request);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void fake_s3_start(FakeS3* s3, size_t fail_part) {
+    memset(s3, 0, sizeof(FakeS3));
+    s3->fail_part = fail_part;
+    s3->signed_ok = true;
+    s3->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(s3->listen_fd >= 0);
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    assert(bind(s3->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(s3->listen_fd, 16) == 0);
+    assert(getsockname(s3->listen_fd, (struct sockaddr*)&addr, &len) == 0);
+    snprintf(s3->port, sizeof(s3->port), "%d", ntohs(addr.sin_port));
+    assert(pthread_create(&s3->thread, NULL, fake_s3_serve, s3) == 0);
+}
+
+static void fake_s3_stop(FakeS3* s3) {
+    pthread_join(s3->thread, NULL);
+    close(s3->listen_fd);
+}
+
+static void fake_s3_free(FakeS3* s3) {
+    for (size_t i = 0; i < 64; i++)
+        free(s3->parts[i]);
+    free(s3->object);
+}
+
+void test_s3_sink() {
+    // RFC 4231 test case 2.
+    unsigned char mac[MULTIPART_DIGEST_SIZE];
+    char hex[MULTIPART_DIGEST_SIZE * 2 + 1];
+    const char* data = "what do ya want for nothing?";
+    assert(multipart_hmac_sha256("Jefe", 4, data, strlen(data), mac));
+    multipart_digest_to_hex(mac, hex);
+    assert(strcmp(hex, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843") == 0);
+
+    size_t file_size = 300 * 1024 + 5;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 37);
+
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    FileHeader* file = form.files[0];
+
+    FakeS3 s3;
+    fake_s3_start(&s3, 0);
+    MultipartS3Config config = {
+        .host = "127.0.0.1",
+        .port = s3.port,
+        .region = "us-east-1",
+        .access_key = "AKID",
+        .secret_key = "secret",
+        .bucket = "bucket",
+        .part_size = 64 * 1024,
+        .max_parallel = 3,
+    };
+
+    // Parts under the S3 minimum are refused before anything is uploaded.
+    MultipartS3Sink sink;
+    multipart_s3_sink_init(&sink, &config, "up loads/");
+    assert(!multipart_sink_feed(&sink.base, file, body));
+    assert(s3.num_parts == 0 && s3.object == NULL && !s3.aborted);
+
+    // The fake store has no minimum.
+    config.min_part_size = 1;
+    multipart_s3_sink_init(&sink, &config, "up loads/");
+    assert(multipart_sink_feed(&sink.base, file, body));
+    fake_s3_stop(&s3);
+
+    assert(s3.signed_ok && !s3.aborted);
+    assert(s3.num_parts == (file->size + config.part_size - 1) / config.part_size);
+    assert(s3.object_size == file->size);
+    assert(memcmp(s3.object, body + file->offset, file->size) == 0);
+    fake_s3_free(&s3);
+
+    // A failed part aborts the upload.
+    fake_s3_start(&s3, 3);
+    config.port = s3.port;
+    multipart_s3_sink_init(&sink, &config, "up loads/");
+    assert(!multipart_sink_feed(&sink.base, file, body));
+    fake_s3_stop(&s3);
+    assert(s3.aborted && s3.object == NULL);
+    fake_s3_free(&s3);
+
+    multipart_free_form(&form);
+    free(body);
+    free(file_data);
+    printf("S3 sink test passed\n");
+}
+
+typedef struct SchedResults {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t completed;
+    size_t failed;
+    size_t gated;  // Workers held in the callback of a gate file.
+    bool open;     // Lets the held workers go.
+    size_t num_small;
+    size_t small_size;
+    size_t small_on_disk;  // Small files fully written when the big file completed.
+} SchedResults;
+
+static void sched_done(const FileHeader* file, const char* path, bool ok, void* userdata) {
+    SchedResults* results = userdata;
+    pthread_mutex_lock(&results->lock);
+    if (!ok)
+        results->failed++;
+    if (strncmp(path, "form_upload_sched_gate", 22) == 0) {
+        results->gated++;
+        pthread_cond_broadcast(&results->changed);
+        while (!results->open)
+            pthread_cond_wait(&results->changed, &results->lock);
+    } else if (file->size > MULTIPART_SCHED_SLICE_SIZE) {
+        // With one write in flight per device, every write picked before the last slice of the big
+        // file has completed by now.
+        char small_path[64];
+        struct stat st;
+        for (size_t i = 0; i < results->num_small; i++) {
+            snprintf(small_path, sizeof(small_path), "form_upload_sched_%zu.bin", i);
+            if (stat(small_path, &st) == 0 && (size_t)st.st_size == results->small_size)
+                results->small_on_disk++;
+        }
+    }
+    results->completed++;
+    pthread_mutex_unlock(&results->lock);
+}
+
+typedef struct SchedFailure {
+    bool ok;
+    size_t other_written;  // Bytes of the other upload on disk when the failed save completed.
+} SchedFailure;
+
+static void sched_failed_done(const FileHeader* file, const char* path, bool ok, void* userdata) {
+    (void)file;
+    (void)path;
+    SchedFailure* failure = userdata;
+    struct stat st;
+    failure->ok = ok;
+    failure->other_written = stat("form_upload_sched_other.bin", &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+void test_save_scheduler() {
+    // One upload with a big file and another with many small ones.
+    size_t big_size = 8 * MULTIPART_SCHED_SLICE_SIZE + 11;
+    char* big_data = malloc(big_size);
+    assert(big_data);
+    fill_random(big_data, big_size, 41);
+    size_t big_body_size;
+    char* big_body = build_form(big_data, big_size, &big_body_size);
+    MultipartForm big_form = {0};
+    assert(multipart_parse_form(big_body, big_body_size, TEST_BOUNDARY, &big_form) == MULTIPART_OK);
+
+    char small_data[1000];
+    fill_random(small_data, sizeof(small_data), 43);
+    size_t small_body_size;
+    char* small_body = build_form(small_data, sizeof(small_data), &small_body_size);
+    MultipartForm small_form = {0};
+    assert(multipart_parse_form(small_body, small_body_size, TEST_BOUNDARY, &small_form) == MULTIPART_OK);
+
+    const size_t num_workers = 4;
+    const size_t num_small = 20;
+    MultipartSaveScheduler sched;
+    assert(multipart_sched_init(&sched, num_workers, 1));
+    SchedResults results = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                            .changed = PTHREAD_COND_INITIALIZER,
+                            .num_small = num_small,
+                            .small_size = small_form.files[0]->size};
+
+    // Every worker is held in the callback of a gate file until all saves are queued, so the order
+    // only depends on the scheduling.
+    char path[64];
+    for (size_t i = 0; i < num_workers; i++) {
+        MultipartSaveQueue* gate = multipart_sched_queue(&sched, 1);
+        assert(gate);
+        snprintf(path, sizeof(path), "form_upload_sched_gate_%zu.bin", i);
+        assert(multipart_sched_save(&sched, gate, small_form.files[0], small_body, path, sched_done, &results));
+        multipart_sched_queue_release(&sched, gate);
+    }
+    pthread_mutex_lock(&results.lock);
+    while (results.gated < num_workers)
+        pthread_cond_wait(&results.changed, &results.lock);
+    pthread_mutex_unlock(&results.lock);
+
+    MultipartSaveQueue* big_queue = multipart_sched_queue(&sched, 1);
+    MultipartSaveQueue* small_queue = multipart_sched_queue(&sched, 1);
+    assert(big_queue && small_queue);
+    assert(multipart_sched_save(&sched, big_queue, big_form.files[0], big_body, "form_upload_sched_big.bin", sched_done,
+                                &results));
+    for (size_t i = 0; i < num_small; i++) {
+        snprintf(path, sizeof(path), "form_upload_sched_%zu.bin", i);
+        assert(multipart_sched_save(&sched, small_queue, small_form.files[0], small_body, path, sched_done, &results));
+    }
+    multipart_sched_queue_release(&sched, big_queue);
+    multipart_sched_queue_release(&sched, small_queue);
+
+    pthread_mutex_lock(&results.lock);
+    results.open = true;
+    pthread_cond_broadcast(&results.changed);
+    pthread_mutex_unlock(&results.lock);
+    multipart_sched_wait(&sched);
+
+    assert(results.completed == num_workers + num_small + 1 && results.failed == 0);
+    // The small files were not stuck behind the big one.
+    assert(results.small_on_disk == num_small);
+
+    size_t saved_size;
+    char* saved = read_file("form_upload_sched_big.bin", &saved_size);
+    assert(saved_size == big_form.files[0]->size);
+    assert(memcmp(saved, big_body + big_form.files[0]->offset, saved_size) == 0);
+    free(saved);
+    remove("form_upload_sched_big.bin");
+
+    for (size_t i = 0; i < num_small; i++) {
+        snprintf(path, sizeof(path), "form_upload_sched_%zu.bin", i);
+        saved = read_file(path, &saved_size);
+        assert(saved_size == small_form.files[0]->size);
+        assert(memcmp(saved, small_body + small_form.files[0]->offset, saved_size) == 0);
+        free(saved);
+        remove(path);
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+        snprintf(path, sizeof(path), "form_upload_sched_gate_%zu.bin", i);
+        remove(path);
+    }
+
+    multipart_sched_destroy(&sched);
+
+    // A save whose write fails stops taking turns: it completes after its first slice instead of
+    // alternating with the other upload until all of its slices have been tried.
+    assert(multipart_sched_init(&sched, 1, 1));
+    results.gated = 0;
+    results.open = false;
+    MultipartSaveQueue* gate = multipart_sched_queue(&sched, 1);
+    assert(gate);
+    assert(multipart_sched_save(&sched, gate, small_form.files[0], small_body, "form_upload_sched_gate_0.bin",
+                                sched_done, &results));
+    multipart_sched_queue_release(&sched, gate);
+    pthread_mutex_lock(&results.lock);
+    while (results.gated < 1)
+        pthread_cond_wait(&results.changed, &results.lock);
+    pthread_mutex_unlock(&results.lock);
+
+    SchedFailure failure = {.ok = true};
+    MultipartSaveQueue* failing_queue = multipart_sched_queue(&sched, 1);
+    MultipartSaveQueue* other_queue = multipart_sched_queue(&sched, 1);
+    assert(failing_queue && other_queue);
+    assert(multipart_sched_save(&sched, failing_queue, big_form.files[0], big_body, "/dev/full", sched_failed_done,
+                                &failure));
+    assert(multipart_sched_save(&sched, other_queue, big_form.files[0], big_body, "form_upload_sched_other.bin",
+                                NULL, NULL));
+    multipart_sched_queue_release(&sched, failing_queue);
+    multipart_sched_queue_release(&sched, other_queue);
+
+    pthread_mutex_lock(&results.lock);
+    results.open = true;
+    pthread_cond_broadcast(&results.changed);
+    pthread_mutex_unlock(&results.lock);
+    multipart_sched_wait(&sched);
+
+    assert(!failure.ok);
+    assert(failure.other_written <= MULTIPART_SCHED_SLICE_SIZE);
+    saved = read_file("form_upload_sched_other.bin", &saved_size);
+    assert(saved_size == big_form.files[0]->size);
+    free(saved);
+    remove("form_upload_sched_other.bin");
+    remove("form_upload_sched_gate_0.bin");
+
+    multipart_sched_destroy(&sched);
+    multipart_free_form(&big_form);
+    multipart_free_form(&small_form);
+    free(big_body);
+    free(small_body);
+    free(big_data);
+    printf("Save scheduler test passed\n");
+}
+
+void test_retry_cache() {
+    MultipartRetryCache cache;
+    assert(multipart_cache_init(&cache, 2));
+
+    char file_data[3000];
+    char* bodies[3];
+    size_t body_sizes[3];
+    for (int i = 0; i < 3; i++) {
+        fill_random(file_data, sizeof(file_data), 47 + i);
+        bodies[i] = build_form(file_data, sizeof(file_data), &body_sizes[i]);
+    }
+
+    // First request is parsed and its save recorded.
+    unsigned char digest[MULTIPART_DIGEST_SIZE];
+    bool hit = true;
+    MultipartForm form = {0};
+    assert(multipart_cache_parse(&cache, bodies[0], body_sizes[0], TEST_BOUNDARY, &form, digest, &hit) ==
+           MULTIPART_OK);
+    assert(!hit && form.num_files == 1);
+    MultipartSha256 sha;
+    unsigned char expected[MULTIPART_DIGEST_SIZE];
+    assert(multipart_sha256_init(&sha));
+    assert(multipart_sha256_update(&sha, bodies[0], body_sizes[0]));
+    assert(multipart_sha256_update(&sha, TEST_BOUNDARY, strlen(TEST_BOUNDARY)));
+    assert(multipart_sha256_final(&sha, expected));
+    assert(memcmp(digest, expected, sizeof(expected)) == 0);
+    char path[64];
+    assert(!multipart_cache_saved_path(&cache, digest, 0, path, sizeof(path)));
+    assert(multipart_cache_record_path(&cache, digest, 0, "uploads/data.bin"));
+    assert(!multipart_cache_record_path(&cache, digest, 1, "uploads/none.bin"));
+
+    // The retry comes from the cache with the same form and saved location.
+    char* retry = malloc(body_sizes[0]);
+    assert(retry);
+    memcpy(retry, bodies[0], body_sizes[0]);
+    unsigned char retry_digest[MULTIPART_DIGEST_SIZE];
+    MultipartForm cached = {0};
+    assert(multipart_cache_parse(&cache, retry, body_sizes[0], TEST_BOUNDARY, &cached, retry_digest, &hit) ==
+           MULTIPART_OK);
+    assert(hit && memcmp(digest, retry_digest, sizeof(digest)) == 0);
+    assert(cached.num_files == 1 && cached.num_fields == form.num_fields);
+    assert(cached.files[0]->offset == form.files[0]->offset && cached.files[0]->size == form.files[0]->size);
+    assert(strcmp(multipart_get_field_value(&cached, "username"), "nabiizy") == 0);
+    assert(multipart_cache_saved_path(&cache, retry_digest, 0, path, sizeof(path)));
+    assert(strcmp(path, "uploads/data.bin") == 0);
+    multipart_free_form(&cached);
+    multipart_free_form(&form);
+    free(retry);
+
+    // Two more bodies evict the least recently used one.
+    for (int i = 1; i < 3; i++) {
+        assert(multipart_cache_parse(&cache, bodies[i], body_sizes[i], TEST_BOUNDARY, &form, retry_digest, &hit) ==
+               MULTIPART_OK);
+        assert(!hit);
+        multipart_free_form(&form);
+    }
+    assert(cache.num_entries == 2 && cache.hits == 1 && cache.misses == 3);
+    assert(!multipart_cache_saved_path(&cache, digest, 0, path, sizeof(path)));
+
+    multipart_cache_free(&cache);
+    for (int i = 0; i < 3; i++)
+        free(bodies[i]);
+    printf("Retry cache test passed\n");
+}
+
+void test_validate() {
+    char file_data[5000];
+    fill_random(file_data, sizeof(file_data), 53);
+    size_t body_size;
+    char* body = build_form(file_data, sizeof(file_data), &body_size);
+
+    // Same verdict and counts as the parser.
+    MultipartSummary summary;
+    assert(multipart_validate(body, body_size, TEST_BOUNDARY, NULL, &summary) == MULTIPART_OK);
+    MultipartForm form = {0};
+    assert(multipart_parse_form(body, body_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    assert(summary.num_fields == form.num_fields && summary.num_files == form.num_files);
+    assert(summary.total_file_bytes == form.files[0]->size && summary.max_file_size == form.files[0]->size);
+    assert(summary.total_value_bytes == strlen("nabiizy"));
+    multipart_free_form(&form);
+
+    // Part limit.
+    MultipartOptions options = {.max_parts = 1};
+    assert(multipart_validate(body, body_size, TEST_BOUNDARY, &options, &summary) == TOO_MANY_PARTS);
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == TOO_MANY_PARTS);
+    options.max_parts = 2;
+    assert(multipart_validate(body, body_size, TEST_BOUNDARY, &options, &summary) == MULTIPART_OK);
+
+    // Every truncation of the body is rejected or validates like it parses, without reading past
+    // the end (each prefix is copied to an exact-size allocation for the sanitizers).
+    for (size_t len = 0; len < 400; len++) {
+        char* prefix = malloc(len ? len : 1);
+        assert(prefix);
+        memcpy(prefix, body, len);
+        MultipartCode validated = multipart_validate(prefix, len, TEST_BOUNDARY, NULL, &summary);
+        MultipartCode parsed = multipart_parse_form(prefix, len, TEST_BOUNDARY, &form);
+        assert(validated == parsed);
+        if (parsed == MULTIPART_OK)
+            multipart_free_form(&form);
+        free(prefix);
+    }
+
+    // A field name over MAX_FIELD_NAME_SIZE.
+    char long_name[MAX_FIELD_NAME_SIZE + 200];
+    int n = snprintf(long_name, sizeof(long_name),
+                     TEST_BOUNDARY "\r\nContent-Disposition: form-data; name=\"%0*d\"\r\n\r\nx\r\n" TEST_BOUNDARY
+                                   "--\r\n",
+                     MAX_FIELD_NAME_SIZE + 10, 0);
+    assert(multipart_validate(long_name, n, TEST_BOUNDARY, NULL, &summary) == FIELD_NAME_TOO_LONG);
+
+    free(body);
+    printf("Validate test passed\n");
+}
+
+typedef struct MatchLog {
+    size_t count;
+    size_t patterns[16];
+    size_t offsets[16];
+    size_t parts[16];
+    bool files[16];
+} MatchLog;
+
+static bool log_scan_match(size_t pattern, size_t offset, void* userdata) {
+    MatchLog* log = (MatchLog*)userdata;
+    assert(log->count < 16);
+    log->patterns[log->count] = pattern;
+    log->offsets[log->count++] = offset;
+    return true;
+}
+
+static bool log_form_match(const MultipartMatch* match, void* userdata) {
+    MatchLog* log = (MatchLog*)userdata;
+    assert(log->count < 16);
+    log->patterns[log->count] = match->pattern;
+    log->offsets[log->count] = match->offset;
+    log->parts[log->count] = match->part_index;
+    log->files[log->count++] = match->is_file;
+    return true;
+}
+
+static bool stop_on_match(const MultipartMatch* match, void* userdata) {
+    (void)match;
+    (void)userdata;
+    return false;
+}
+
+void test_matcher() {
+    // Overlapping patterns, all reported in order of their end.
+    const char* words[] = {"he", "she", "his", "hers"};
+    MultipartMatcher matcher;
+    assert(multipart_matcher_init(&matcher, words, NULL, 4, false));
+    MatchLog log = {0};
+    assert(multipart_matcher_scan(&matcher, "ushers", 6, log_scan_match, &log));
+    assert(log.count == 3);
+    assert(log.patterns[0] == 1 && log.offsets[0] == 1);  // she
+    assert(log.patterns[1] == 0 && log.offsets[1] == 2);  // he
+    assert(log.patterns[2] == 3 && log.offsets[2] == 2);  // hers
+    memset(&log, 0, sizeof(log));
+    assert(multipart_matcher_scan(&matcher, "USHERS", 6, log_scan_match, &log) && log.count == 0);
+    multipart_matcher_free(&matcher);
+
+    // Signatures in a field value and in the head of a file, case-insensitive.
+    const char* signatures[] = {"union select", "<script", "/etc/passwd"};
+    assert(multipart_matcher_init(&matcher, signatures, NULL, 3, true));
+
+    char file_data[3000];
+    memset(file_data, 'a', sizeof(file_data));
+    memcpy(file_data + 10, "<SCRIPT>", 8);
+    memcpy(file_data + 2000, "/etc/passwd", 11);  // Past the default inspection window.
+    size_t body_size;
+    char* body = build_form(file_data, sizeof(file_data), &body_size);
+    // Overwrite the 7 bytes of the username value, a prefix of a signature does not match.
+    char* value = body + strlen(TEST_BOUNDARY "\r\nContent-Disposition: form-data; name=\"username\"\r\n\r\n");
+    assert(memcmp(value, "nabiizy", 7) == 0);
+    memcpy(value, "UNION S", 7);
+
+    MultipartOptions options = {.matcher = &matcher, .on_match = log_form_match, .userdata = &log};
+    MultipartForm form = {0};
+    memset(&log, 0, sizeof(log));
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    assert(log.count == 1);
+    assert(log.patterns[0] == 1 && log.parts[0] == 1 && log.files[0]);
+    assert(log.offsets[0] == form.files[0]->offset + 10);
+    multipart_free_form(&form);
+
+    // A wider window finds the signature further in; the validator reports the same matches.
+    options.inspect_file_bytes = 4096;
+    memset(&log, 0, sizeof(log));
+    MultipartSummary summary;
+    assert(multipart_validate(body, body_size, TEST_BOUNDARY, &options, &summary) == MULTIPART_OK);
+    assert(log.count == 2 && log.patterns[1] == 2 && log.files[1]);
+
+    // Signature in a field, and a callback that rejects the body.
+    memcpy(value, "x UNION", 7);
+    options.inspect_file_bytes = 0;
+    multipart_matcher_free(&matcher);
+    const char* sql[] = {"union"};
+    assert(multipart_matcher_init(&matcher, sql, NULL, 1, true));
+    memset(&log, 0, sizeof(log));
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    assert(log.count == 1 && log.parts[0] == 0 && !log.files[0] && log.offsets[0] == (size_t)(value - body + 2));
+    multipart_free_form(&form);
+    options.on_match = stop_on_match;
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == CALLBACK_ABORTED);
+
+    multipart_matcher_free(&matcher);
+    free(body);
+    printf("Matcher test passed\n");
+}
+
+// Drops the password, replaces the username and keeps everything else.
+static MultipartProxyAction proxy_filter(const MultipartProxyPart* part, const char** data, size_t* size,
+                                         void* userdata) {
+    size_t* num_parts = (size_t*)userdata;
+    (*num_parts)++;
+    if (strcmp(part->name, "password") == 0)
+        return MULTIPART_PROXY_DROP;
+    if (strcmp(part->name, "username") == 0) {
+        assert(part->filename == NULL && part->size == 7);
+        *data = "anonymous";
+        *size = 9;
+        return MULTIPART_PROXY_REPLACE;
+    }
+    if (strcmp(part->name, "abort") == 0)
+        return MULTIPART_PROXY_ABORT;
+    assert(part->filename && strcmp(part->filename, "data.bin") == 0);
+    return MULTIPART_PROXY_KEEP;
+}
+
+// Proxies body to a file or pipe, then parses the output and checks the filtered form.
+static void check_proxy(const char* body, size_t body_size, int body_fd, bool to_pipe, const char* file_data,
+                        size_t file_size) {
+    const char* path = "form_upload_proxy.bin";
+    int fds[2] = {-1, -1};
+    int out_fd;
+    if (to_pipe) {
+        assert(pipe(fds) == 0);
+        out_fd = fds[1];
+    } else {
+        out_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(out_fd >= 0);
+    }
+
+    size_t num_parts = 0;
+    assert(multipart_proxy_form(body, body_size, TEST_BOUNDARY, out_fd, body_fd, 0, proxy_filter, &num_parts) ==
+           MULTIPART_OK);
+    assert(num_parts == 3);
+
+    size_t out_size;
+    char* out;
+    if (to_pipe) {
+        close(fds[1]);
+        out = malloc(body_size + 64);
+        assert(out);
+        out_size = 0;
+        ssize_t n;
+        while ((n = read(fds[0], out + out_size, body_size + 64 - out_size)) > 0)
+            out_size += n;
+        close(fds[0]);
+    } else {
+        close(out_fd);
+        out = read_file(path, &out_size);
+        remove(path);
+    }
+
+    MultipartForm form = {0};
+    assert(multipart_parse_form(out, out_size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+    assert(form.num_fields == 1 && form.num_files == 1);
+    assert(strcmp(multipart_get_field_value(&form, "username"), "anonymous") == 0);
+    assert(multipart_get_field_value(&form, "password") == NULL);
+    FileHeader* file = multipart_get_file(&form, "file");
+    assert(file && memcmp(out + file->offset, file_data, file_size) == 0);
+    multipart_free_form(&form);
+    free(out);
+}
+
+void test_proxy() {
+    char file_data[20000];
+    fill_random(file_data, sizeof(file_data), 71);
+
+    // A password field after the file, and a preamble the proxy does not forward.
+    size_t form_size;
+    char* form_body = build_form(file_data, sizeof(file_data), &form_size);
+    const char* preamble = "preamble\r\n";
+    const char* password = TEST_BOUNDARY "\r\nContent-Disposition: form-data; name=\"password\"\r\n\r\nsecret\r\n";
+    size_t tail_size = strlen("\r\n" TEST_BOUNDARY "--\r\n");
+    size_t body_size = strlen(preamble) + form_size - tail_size + 2 + strlen(password) + tail_size - 2;
+    char* body = malloc(body_size);
+    assert(body);
+    char* p = body;
+    memcpy(p, preamble, strlen(preamble));
+    p += strlen(preamble);
+    memcpy(p, form_body, form_size - tail_size + 2);  // Up to the CRLF ending the file.
+    p += form_size - tail_size + 2;
+    char* password_part = p;
+    memcpy(p, password, strlen(password));
+    p += strlen(password);
+    memcpy(p, TEST_BOUNDARY "--\r\n", tail_size - 2);
+    free(form_body);
+
+    // From memory with writev, then from a spooled body with sendfile and splice.
+    check_proxy(body, body_size, -1, false, file_data, sizeof(file_data));
+    check_proxy(body, body_size, -1, true, file_data, sizeof(file_data));
+    const char* spool = "form_upload_spool.bin";
+    int body_fd = open(spool, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(body_fd >= 0);
+    assert(write(body_fd, body, body_size) == (ssize_t)body_size);
+    check_proxy(body, body_size, body_fd, false, file_data, sizeof(file_data));
+    check_proxy(body, body_size, body_fd, true, file_data, sizeof(file_data));
+    close(body_fd);
+    remove(spool);
+
+    // A truncated body and a callback abort.
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd >= 0);
+    size_t num_parts = 0;
+    assert(multipart_proxy_form(body, body_size - tail_size, TEST_BOUNDARY, null_fd, -1, 0, proxy_filter,
+                                &num_parts) == INVALID_FORM_BOUNDARY);
+    char* name = (char*)memchr(password_part + strlen(TEST_BOUNDARY), '"', strlen(password)) + 1;
+    memcpy(name, "abort\"  ", 8);  // Same length as password".
+    assert(multipart_proxy_form(body, body_size, TEST_BOUNDARY, null_fd, -1, 0, proxy_filter, &num_parts) ==
+           CALLBACK_ABORTED);
+
+    // Only Content-Disposition names a part: the password is dropped, not kept as "keep".
+    const char* disguised = TEST_BOUNDARY "\r\nContent-Type: text/plain; name=\"keep\"\r\n"
+                                          "content-disposition: form-data; name=\"password\"\r\n\r\nsecret\r\n"
+                                          TEST_BOUNDARY "--\r\n";
+    num_parts = 0;
+    assert(multipart_proxy_form(disguised, strlen(disguised), TEST_BOUNDARY, null_fd, -1, 0, proxy_filter,
+                                &num_parts) == MULTIPART_OK);
+    assert(num_parts == 1);
+    close(null_fd);
+
+    free(body);
+    printf("Proxy test passed\n");
+}
+
+// Compresses data with zlib. window_bits selects gzip (31), zlib (15) or raw deflate (-15).
+// repeat compresses data that many times in a row, for building bombs without the plain bytes.
+static char* compress_body(const char* data, size_t size, int window_bits, size_t repeat, size_t* out_size) {
+    z_stream zs = {0};
+    assert(deflateInit2(&zs, 9, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    size_t capacity = deflateBound(&zs, size) * repeat + 64;
+    char* out = malloc(capacity);
+    assert(out);
+    zs.next_out = (unsigned char*)out;
+    zs.avail_out = capacity;
+    for (size_t i = 0; i < repeat; i++) {
+        zs.next_in = (unsigned char*)data;
+        zs.avail_in = size;
+        assert(deflate(&zs, i + 1 == repeat ? Z_FINISH : Z_NO_FLUSH) != Z_STREAM_ERROR);
+        assert(zs.avail_in == 0);
+    }
+    *out_size = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+void test_decode() {
+    assert(multipart_parse_content_encoding(NULL) == MULTIPART_ENCODING_IDENTITY);
+    assert(multipart_parse_content_encoding(" GZip ") == MULTIPART_ENCODING_GZIP);
+    assert(multipart_parse_content_encoding("x-gzip") == MULTIPART_ENCODING_GZIP);
+    assert(multipart_parse_content_encoding("deflate") == MULTIPART_ENCODING_DEFLATE);
+    assert(multipart_parse_content_encoding("zstd") == MULTIPART_ENCODING_ZSTD);
+    assert(multipart_parse_content_encoding("gzip, br") == MULTIPART_ENCODING_UNSUPPORTED);
+
+    char file_data[100000];
+    fill_random(file_data, sizeof(file_data) / 2, 83);
+    memset(file_data + sizeof(file_data) / 2, 'z', sizeof(file_data) / 2);
+    size_t body_size;
+    char* body = build_form(file_data, sizeof(file_data), &body_size);
+
+    MultipartBodyBuffer decoded;
+    assert(multipart_body_init(&decoded, 0));
+
+    // gzip fed a few bytes at a time as if received from a socket, zlib and raw deflate at once.
+    const int window_bits[] = {15 + 16, 15, -15};
+    for (size_t i = 0; i < 3; i++) {
+        size_t compressed_size;
+        char* compressed = compress_body(body, body_size, window_bits[i], 1, &compressed_size);
+        multipart_body_reset(&decoded);
+        MultipartDecoder decoder;
+        assert(multipart_decoder_init(&decoder, i == 0 ? MULTIPART_ENCODING_GZIP : MULTIPART_ENCODING_DEFLATE,
+                                      &decoded, 0, 0));
+        // deflate starts with a single byte, before the wrapper can be told.
+        size_t step = i == 0 ? 777 : compressed_size;
+        for (size_t off = 0, n; off < compressed_size; off += n) {
+            n = compressed_size - off < step ? compressed_size - off : step;
+            if (i > 0 && off == 0)
+                n = 1;
+            assert(multipart_decoder_write(&decoder, compressed + off, n) == MULTIPART_OK);
+        }
+        assert(multipart_decoder_finish(&decoder) == MULTIPART_OK);
+        multipart_decoder_free(&decoder);
+
+        assert(decoded.size == body_size && memcmp(decoded.data, body, body_size) == 0);
+        MultipartForm form = {0};
+        assert(multipart_parse_form(decoded.data, decoded.size, TEST_BOUNDARY, &form) == MULTIPART_OK);
+        assert(memcmp(decoded.data + form.files[0]->offset, file_data, sizeof(file_data)) == 0);
+        multipart_free_form(&form);
+
+        // A truncated stream is detected once the body ends.
+        multipart_body_reset(&decoded);
+        assert(multipart_decode_body(i == 0 ? "gzip" : "deflate", compressed, compressed_size / 2, &decoded, 0, 0) ==
+               DECODE_FAILED);
+        free(compressed);
+    }
+
+    // A bomb of 256 MiB of zeros stops soon after the ratio is exceeded.
+    size_t zeros_size = 1024 * 1024;
+    char* zeros = calloc(1, zeros_size);
+    assert(zeros);
+    size_t bomb_size;
+    char* bomb = compress_body(zeros, zeros_size, 15 + 16, 256, &bomb_size);
+    multipart_body_reset(&decoded);
+    assert(multipart_decode_body("gzip", bomb, bomb_size, &decoded, 0, 0) == DECODE_LIMIT_EXCEEDED);
+    assert(decoded.size <= MULTIPART_DECODE_RATIO_GRACE + MULTIPART_DECODE_CHUNK_SIZE);
+
+    // The size limit applies even with a generous ratio.
+    multipart_body_reset(&decoded);
+    assert(multipart_decode_body("gzip", bomb, bomb_size, &decoded, 1000000, 4 * 1024 * 1024) ==
+           DECODE_LIMIT_EXCEEDED);
+    assert(decoded.size <= 4 * 1024 * 1024 + MULTIPART_DECODE_CHUNK_SIZE);
+    free(bomb);
+    free(zeros);
+
+    // Garbage, an unknown coding, and identity passing the body through.
+    multipart_body_reset(&decoded);
+    assert(multipart_decode_body("gzip", body, body_size, &decoded, 0, 0) == DECODE_FAILED);
+    assert(multipart_decode_body("br", body, body_size, &decoded, 0, 0) == UNSUPPORTED_ENCODING);
+    assert(multipart_decode_body("deflate", "x", 1, &decoded, 0, 0) == DECODE_FAILED);
+    multipart_body_reset(&decoded);
+    assert(multipart_decode_body(NULL, body, body_size, &decoded, 0, 0) == MULTIPART_OK);
+    assert(decoded.size == body_size && memcmp(decoded.data, body, body_size) == 0);
+
+    multipart_body_free(&decoded);
+    free(body);
+    printf("Decode test passed\n");
+}
+
+// Stand-in for clamd answering INSTREAM scans, flagging streams that contain the EICAR prefix.
+typedef struct FakeClamd {
+    int listen_fd;
+    pthread_t thread;
+    size_t num_scans;  // Connections to serve before exiting.
+    char* received;    // Bytes streamed in the last scan.
+    size_t received_size;
+    bool protocol_ok;
+} FakeClamd;
+
+static bool read_exact(int fd, void* buf, size_t size) {
+    char* p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void* fake_clamd_serve(void* arg) {
+    FakeClamd* clamd = arg;
+    for (size_t i = 0; i < clamd->num_scans; i++) {
+        int fd = accept(clamd->listen_fd, NULL, NULL);
+        assert(fd >= 0);
+
+        char command[10];
+        if (!read_exact(fd, command, sizeof(command)) || memcmp(command, "zINSTREAM", 10) != 0)
+            clamd->protocol_ok = false;
+
+        free(clamd->received);
+        clamd->received = NULL;
+        clamd->received_size = 0;
+        uint32_t length;
+        while (read_exact(fd, &length, sizeof(length)) && (length = ntohl(length)) > 0) {
+            clamd->received = realloc(clamd->received, clamd->received_size + length);
+            assert(clamd->received);
+            if (!read_exact(fd, clamd->received + clamd->received_size, length))
+                clamd->protocol_ok = false;
+            clamd->received_size += length;
+        }
+
+        const char* eicar = "X5O!P%@AP[4\\PZX54(P^)7CC)7}";
+        bool infected = false;
+        for (size_t j = 0; j + strlen(eicar) <= clamd->received_size; j++)
+            infected = infected || memcmp(clamd->received + j, eicar, strlen(eicar)) == 0;
+        const char* reply = infected ? "stream: Eicar-Signature FOUND" : "stream: OK";
+        assert(write(fd, reply, strlen(reply) + 1) == (ssize_t)strlen(reply) + 1);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void fake_clamd_start(FakeClamd* clamd, const char* path, size_t num_scans) {
+    memset(clamd, 0, sizeof(FakeClamd));
+    clamd->num_scans = num_scans;
+    clamd->protocol_ok = true;
+    clamd->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(clamd->listen_fd >= 0);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    assert(bind(clamd->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(clamd->listen_fd, 4) == 0);
+    assert(pthread_create(&clamd->thread, NULL, fake_clamd_serve, clamd) == 0);
+}
+
+void test_clamd_sink() {
+    const char* socket_path = "form_upload_clamd.sock";
+    FakeClamd clamd;
+    fake_clamd_start(&clamd, socket_path, 2);
+
+    // Scan while parsing and saving: clamd -> fd.
+    const char* path = "form_upload_clamd.bin";
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    MultipartFdSink fd_sink;
+    multipart_fd_sink_init(&fd_sink, fd);
+    MultipartClamdSink sink;
+    assert(multipart_clamd_sink_init(&sink, socket_path, &fd_sink.base));
+    MultipartOptions options = {.on_file = multipart_sink_on_file, .userdata = &sink};
+
+    size_t file_size = 200 * 1024 + 7;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 89);
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+    MultipartForm form = {0};
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == MULTIPART_OK);
+    assert(sink.result == MULTIPART_SCAN_CLEAN && sink.fd == -1);
+
+    FileHeader* file = form.files[0];
+    assert(clamd.received_size == file->size && memcmp(clamd.received, body + file->offset, file->size) == 0);
+    size_t saved_size;
+    char* saved = read_file(path, &saved_size);
+    assert(saved_size == file->size && memcmp(saved, body + file->offset, file->size) == 0);
+    free(saved);
+    multipart_free_form(&form);
+    free(body);
+
+    // An infected file fails the pipeline and aborts parsing.
+    memcpy(file_data + 100000, "X5O!P%@AP[4\\PZX54(P^)7CC)7}", 27);
+    body = build_form(file_data, file_size, &body_size);
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == CALLBACK_ABORTED);
+    assert(sink.result == MULTIPART_SCAN_INFECTED && strcmp(sink.signature, "Eicar-Signature") == 0);
+
+    pthread_join(clamd.thread, NULL);
+    assert(clamd.protocol_ok);
+    close(clamd.listen_fd);
+    free(clamd.received);
+
+    // No daemon listening.
+    unlink(socket_path);
+    assert(multipart_parse_form_ex(body, body_size, TEST_BOUNDARY, &form, &options) == CALLBACK_ABORTED);
+    assert(sink.result == MULTIPART_SCAN_ERROR);
+
+    close(fd);
+    remove(path);
+    free(body);
+    free(file_data);
+    printf("Clamd sink test passed\n");
+}
+
+// Builds a multipart/byteranges body with one part per header and range of representation.
+static char* build_byteranges(const char* representation, const char* const* headers, const size_t (*ranges)[2],
+                              size_t count, size_t* body_size) {
+    size_t capacity = 4096;
+    for (size_t i = 0; i < count; i++)
+        capacity += ranges[i][1] - ranges[i][0] + 1;
+    char* body = malloc(capacity);
+    assert(body);
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += snprintf(body + size, capacity - size, "\r\n--THIS_STRING_SEPARATES\r\n%s\r\n\r\n", headers[i]);
+        size_t length = ranges[i][1] - ranges[i][0] + 1;
+        memcpy(body + size, representation + ranges[i][0], length);
+        size += length;
+    }
+    size += snprintf(body + size, capacity - size, "\r\n--THIS_STRING_SEPARATES--\r\n");
+    *body_size = size;
+    return body;
+}
+
+void test_byteranges() {
+    char representation[1000];
+    fill_random(representation, sizeof(representation), 97);
+    char boundary[64];
+    const char* content_type = "multipart/byteranges; boundary=THIS_STRING_SEPARATES";
+    assert(!multipart_parse_boundary_from_header(content_type, boundary, sizeof(boundary)));
+    assert(!multipart_parse_boundary_for_type(content_type, "multipart/byte", boundary, sizeof(boundary)));
+    assert(multipart_parse_boundary_for_type(content_type, "multipart/", boundary, sizeof(boundary)));
+    assert(multipart_parse_boundary_for_type(content_type, "multipart/byteranges", boundary, sizeof(boundary)));
+
+    const char* headers[] = {
+        "Content-Type: application/pdf\r\nContent-Range: bytes 0-99/1000",
+        "content-range: bytes 500-999/*",
+    };
+    const size_t ranges_in[][2] = {{0, 99}, {500, 999}};
+    size_t body_size;
+    char* body = build_byteranges(representation, headers, ranges_in, 2, &body_size);
+
+    MultipartByteRanges ranges;
+    assert(multipart_parse_byteranges(body, body_size, boundary, &ranges) == MULTIPART_OK);
+    assert(ranges.num_ranges == 2);
+    MultipartByteRange* r = &ranges.ranges[0];
+    assert(r->first == 0 && r->last == 99 && r->complete_length == 1000 && r->size == 100);
+    assert(strcmp(r->content_type, "application/pdf") == 0);
+    assert(memcmp(body + r->offset, representation, r->size) == 0);
+    r = &ranges.ranges[1];
+    assert(r->first == 500 && r->last == 999 && r->complete_length == 0 && r->content_type[0] == '\0');
+    assert(memcmp(body + r->offset, representation + 500, r->size) == 0);
+    multipart_free_byteranges(&ranges);
+
+    // Truncated bodies never parse.
+    for (size_t len = 0; len < body_size; len += 7)
+        assert(multipart_parse_byteranges(body, len, boundary, &ranges) != MULTIPART_OK);
+    free(body);
+
+    // A part whose length does not match its Content-Range, or without one.
+    const char* bad[] = {"Content-Range: bytes 0-98/1000", "Content-Type: text/plain", "Content-Range: bytes 0-99/50"};
+    for (size_t i = 0; i < 3; i++) {
+        body = build_byteranges(representation, &bad[i], ranges_in, 1, &body_size);
+        assert(multipart_parse_byteranges(body, body_size, boundary, &ranges) == INVALID_CONTENT_RANGE);
+        free(body);
+    }
+    printf("Byte ranges test passed\n");
+}
+
+void test_related() {
+    const char* content_type =
+        "multipart/related; type=\"application/xop+xml\"; start-info=\"application/soap+xml; action=\\\"up\\\"\"; "
+        "boundary=\"uuid:5d1c; x\"; start=\"<root.message@example.org>\"";
+    char boundary[64], start[MULTIPART_CONTENT_ID_SIZE], start_info[64];
+    assert(multipart_parse_boundary_for_type(content_type, "multipart/related", boundary, sizeof(boundary)));
+    assert(strcmp(boundary, "--uuid:5d1c; x") == 0);
+    assert(multipart_header_param(content_type, "START", start, sizeof(start)));
+    assert(strcmp(start, "<root.message@example.org>") == 0);
+    assert(multipart_header_param(content_type, "start-info", start_info, sizeof(start_info)));
+    assert(strcmp(start_info, "application/soap+xml; action=\"up\"") == 0);
+    assert(!multipart_header_param(content_type, "info", start_info, sizeof(start_info)));
+    assert(!multipart_header_param(content_type, "start", start, 8));
+
+    // An envelope referencing 40 binary attachments, listed after it.
+    enum { NUM_ATTACHMENTS = 40 };
+    char attachments[NUM_ATTACHMENTS][300];
+    size_t capacity = 4096 + NUM_ATTACHMENTS * 512;
+    char* body = malloc(capacity);
+    assert(body);
+    size_t second_id = 0;
+    size_t size = snprintf(body, capacity,
+                           "--uuid:5d1c; x\r\nContent-Type: application/xop+xml; type=\"application/soap+xml\"\r\n"
+                           "Content-ID: <root.message@example.org>\r\n\r\n<soap:Envelope/>");
+    for (int i = 0; i < NUM_ATTACHMENTS; i++) {
+        fill_random(attachments[i], sizeof(attachments[i]), 200 + i);
+        if (i == 1)
+            second_id = size;
+        size += snprintf(body + size, capacity - size,
+                         "\r\n--uuid:5d1c; x\r\nContent-Type: application/octet-stream\r\n"
+                         "Content-Transfer-Encoding: binary\r\ncontent-id:  <part%d/file@example.org>\r\n\r\n", i);
+        memcpy(body + size, attachments[i], sizeof(attachments[i]));
+        size += sizeof(attachments[i]);
+    }
+    size += snprintf(body + size, capacity - size, "\r\n--uuid:5d1c; x--\r\n");
+
+    MultipartRelated related;
+    assert(multipart_parse_related(body, size, boundary, &related) == MULTIPART_OK);
+    assert(related.num_parts == NUM_ATTACHMENTS + 1);
+    assert(related.index_size >= related.num_parts * 2);
+
+    const MultipartRelatedPart* root = multipart_related_root(&related, start);
+    assert(root == &related.parts[0] && root == multipart_related_root(&related, NULL));
+    assert(strncmp(root->content_type, "application/xop+xml", 19) == 0);
+    assert(root->size == 16 && memcmp(body + root->offset, "<soap:Envelope/>", 16) == 0);
+
+    for (int i = 0; i < NUM_ATTACHMENTS; i++) {
+        char id[64], href[64];
+        snprintf(id, sizeof(id), "part%d/file@example.org", i);
+        snprintf(href, sizeof(href), "cid:part%d%%2Ffile%%40example.org", i);
+        const MultipartRelatedPart* part = multipart_related_find(&related, id);
+        assert(part == &related.parts[i + 1] && strcmp(part->content_id, id) == 0);
+        assert(multipart_related_find(&related, href) == part);
+        assert(part->size == sizeof(attachments[i]) && memcmp(body + part->offset, attachments[i], part->size) == 0);
+        const char* headers = body + part->headers_offset;
+        assert(strncmp(headers, "Content-Type: application/octet-stream\r\n", 40) == 0);
+        assert(memcmp(headers + part->headers_size - 2, "\r\n", 2) == 0);
+    }
+    assert(multipart_related_find(&related, "<part0/file@example.org>") == &related.parts[1]);
+    assert(multipart_related_find(&related, "part40/file@example.org") == NULL);
+    assert(multipart_related_find(&related, "cid:part0") == NULL);
+    assert(multipart_related_find(&related, "cid:part0%00") == NULL);
+    multipart_free_related(&related);
+
+    // Bodies cut before the closing boundary never parse.
+    for (size_t len = 0; len + 4 < size; len += 97)
+        assert(multipart_parse_related(body, len, boundary, &related) != MULTIPART_OK);
+
+    // Content-IDs are unique.
+    char* dup = memchr(body + second_id, '<', size - second_id);
+    memcpy(dup, "<part0/", 7);
+    assert(multipart_parse_related(body, size, boundary, &related) == DUPLICATE_CONTENT_ID);
+    free(body);
+
+    const char* empty_id = "--b\r\nContent-ID: <>\r\n\r\nx\r\n--b--";
+    assert(multipart_parse_related(empty_id, strlen(empty_id), "--b", &related) == INVALID_CONTENT_ID);
+    printf("Related test passed\n");
+}
+
+void test_form_json() {
+    FormField fields[2] = {0};
+    strcpy(fields[0].name, "user");
+    strcpy(fields[0].value, "caf\xc3\xa9 \"quoted\" back\\slash\ttab\x01 and a long plain ASCII tail");
+    strcpy(fields[1].name, "bad utf8");
+    strcpy(fields[1].value, "\xff\xc0\xaf\xed\xa0\x80\xf0\x9f\x98\x80");
+    FileHeader file = {.offset = 120, .size = 18446744073709551615ULL};
+    strcpy(file.field_name, "upload");
+    strcpy(file.filename, "report.pdf");
+    strcpy(file.mimetype, "application/pdf");
+    file.has_tree_hash = true;
+    file.tree_hash[0] = 0xab;
+    FileHeader* files[1] = {&file};
+    MultipartForm form = {.files = files, .num_files = 1, .fields = fields, .num_fields = 2};
+
+    const char* expected =
+        "{\"fields\":[{\"name\":\"user\",\"value\":\"caf\xc3\xa9 \\\"quoted\\\" back\\\\slash\\ttab\\u0001 and a long "
+        "plain ASCII tail\"},{\"name\":\"bad utf8\",\"value\":\"\\ufffd\\ufffd\\ufffd\\ufffd\\ufffd\\ufffd"
+        "\xf0\x9f\x98\x80\"}],\"files\":[{\"field_name\":\"upload\",\"filename\":\"report.pdf\","
+        "\"mimetype\":\"application/pdf\",\"offset\":120,\"size\":18446744073709551615,\"tree_hash\":"
+        "\"ab00000000000000000000000000000000000000000000000000000000000000\"}]}";
+    char json[1024];
+    size_t length = multipart_form_to_json(&form, json, sizeof(json));
+    assert(length == strlen(expected) && strcmp(json, expected) == 0);
+
+    // Truncated output is still terminated and reports the full length.
+    char small[32];
+    assert(multipart_form_to_json(&form, small, sizeof(small)) == length);
+    assert(strlen(small) == sizeof(small) - 1 && strncmp(small, expected, sizeof(small) - 1) == 0);
+    assert(multipart_form_to_json(&form, NULL, 0) == length);
+
+    MultipartForm empty = {0};
+    assert(multipart_form_to_json(&empty, json, sizeof(json)) == 24);
+    assert(strcmp(json, "{\"fields\":[],\"files\":[]}") == 0);
+    printf("Form JSON test passed\n");
+}
+
+typedef struct CsvRows {
+    char text[512];  // Rows as field|field;
+    size_t length;
+    uint64_t rows;
+    uint64_t stop_at;  // Row at which the callback fails, 0 for never.
+} CsvRows;
+
+static bool collect_csv_row(const FileHeader* file, const MultipartCsvField* fields, size_t num_fields, uint64_t row,
+                            void* userdata) {
+    (void)file;
+    CsvRows* rows = userdata;
+    assert(row == rows->rows);
+    rows->rows++;
+    for (size_t i = 0; i < num_fields; i++) {
+        assert(rows->length + fields[i].size + 2 < sizeof(rows->text));
+        memcpy(rows->text + rows->length, fields[i].data, fields[i].size);
+        rows->length += fields[i].size;
+        rows->text[rows->length++] = i + 1 < num_fields ? '|' : ';';
+    }
+    rows->text[rows->length] = '\0';
+    return rows->stop_at == 0 || row + 1 < rows->stop_at;
+}
+
+// Feeds csv to sink in blocks of block_size bytes.
+static bool feed_csv(MultipartCsvSink* sink, const char* csv, size_t block_size) {
+    FileHeader file = {.size = strlen(csv)};
+    if (!sink->base.begin(&sink->base, &file))
+        return false;
+    bool ok = true;
+    for (size_t pos = 0; ok && pos < file.size; pos += block_size) {
+        size_t n = file.size - pos < block_size ? file.size - pos : block_size;
+        ok = sink->base.write(&sink->base, csv + pos, n);
+    }
+    return sink->base.end(&sink->base, ok) && ok;
+}
+
+void test_csv_sink() {
+    const char* csv =
+        "id,name,comment\r\n"
+        "1,plain text that is longer than sixteen bytes,\"quoted, with \"\"quotes\"\"\r\nand a newline\"\r\n"
+        "\r\n"
+        "2,,\"\"\n"
+        "3,\"cr\r\",tail\"x\n"
+        "4,last";
+    const char* expected =
+        "id|name|comment;"
+        "1|plain text that is longer than sixteen bytes|quoted, with \"quotes\"\r\nand a newline;"
+        "2||;"
+        "3|cr\r|tail\"x;"
+        "4|last;";
+
+    // Every block size splits rows, quotes and CRLFs differently.
+    size_t block_sizes[] = {1, 2, 3, 7, 16, 17, 4096};
+    for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+        CsvRows rows = {0};
+        MultipartCsvSink sink;
+        multipart_csv_sink_init(&sink, 0, collect_csv_row, &rows, NULL);
+        assert(feed_csv(&sink, csv, block_sizes[i]));
+        assert(rows.rows == 5 && sink.num_rows == 5);
+        assert(strcmp(rows.text, expected) == 0);
+    }
+
+    // Other delimiters, and the bytes still reach the next stage.
+    CsvRows rows = {0};
+    CountingState passed = {0};
+    MultipartCsvSink sink;
+    MultipartCallbackSink counter;
+    multipart_callback_sink_init(&counter, count_bytes, &passed);
+    multipart_csv_sink_init(&sink, ';', collect_csv_row, &rows, &counter.base);
+    assert(feed_csv(&sink, "a;b,c\n", 4));
+    assert(strcmp(rows.text, "a|b,c;") == 0 && passed.calls == 2 && passed.bytes == 6);
+
+    // Unterminated quotes, long rows and callback failures fail the pipeline.
+    multipart_csv_sink_init(&sink, ',', collect_csv_row, &(CsvRows){0}, NULL);
+    assert(!feed_csv(&sink, "a,\"b\n", 3));
+    multipart_csv_sink_init(&sink, ',', collect_csv_row, &(CsvRows){0}, NULL);
+    sink.max_row_size = 8;
+    assert(feed_csv(&sink, "1234,567\n", 3));
+    assert(!feed_csv(&sink, "1234,5678\n", 3));
+    assert(!feed_csv(&sink, ",,,,,,,,,\n", 3));
+    multipart_csv_sink_init(&sink, ',', collect_csv_row, &(CsvRows){.stop_at = 2}, NULL);
+    assert(!feed_csv(&sink, "a\nb\nc\n", 1));
+    printf("CSV sink test passed\n");
+}
+
+typedef struct PoolWorker {
+    pthread_t thread;
+    MultipartContextPool* pool;
+    const char* body;
+    size_t body_size;
+    size_t file_size;
+    int iterations;
+    int parsed;
+} PoolWorker;
+
+static bool init_pool_context(MultipartContext* context, void* userdata) {
+    atomic_int* live = userdata;
+    atomic_fetch_add(live, 1);
+    context->userdata = live;
+    return true;
+}
+
+static void destroy_pool_context(MultipartContext* context, void* userdata) {
+    assert(context->userdata == userdata);
+    atomic_fetch_sub((atomic_int*)userdata, 1);
+}
+
+static void* pool_worker(void* arg) {
+    PoolWorker* worker = arg;
+    char boundary[] = TEST_BOUNDARY;
+    for (int i = 0; i < worker->iterations; i++) {
+        MultipartContext* context;
+        while ((context = multipart_context_acquire(worker->pool)) == NULL)
+            sched_yield();
+
+        // Nobody else holds this context until it is released.
+        assert(context->form.num_fields == 0 && context->form.num_files == 0 && context->body.size == 0);
+        assert(multipart_body_append(&context->body, worker->body, worker->body_size));
+        assert(multipart_parse_form(context->body.data, context->body.size, boundary, &context->form) == MULTIPART_OK);
+        assert(context->form.num_fields == 1 && context->form.num_files == 1);
+        assert(context->form.files[0]->size == worker->file_size + 2);
+        worker->parsed++;
+        multipart_context_release(worker->pool, context);
+    }
+    return NULL;
+}
+
+void test_context_pool() {
+    size_t file_size = 1000;
+    char* file_data = malloc(file_size);
+    assert(file_data);
+    fill_random(file_data, file_size, 99);
+    size_t body_size;
+    char* body = build_form(file_data, file_size, &body_size);
+
+    atomic_int live = 0;
+    MultipartContextPool pool;
+    assert(multipart_context_pool_init(&pool, 3, 4096, init_pool_context, destroy_pool_context, &live));
+    assert(atomic_load(&live) == 3);
+    assert(((uintptr_t)&pool.contexts[1] & 63) == 0);
+
+    // The pool runs dry, and a released context comes back with its arrays.
+    MultipartContext* a = multipart_context_acquire(&pool);
+    MultipartContext* b = multipart_context_acquire(&pool);
+    MultipartContext* c = multipart_context_acquire(&pool);
+    assert(a == &pool.contexts[0] && b && c && b != c && multipart_context_acquire(&pool) == NULL);
+    char boundary[] = TEST_BOUNDARY;
+    assert(multipart_parse_form(body, body_size, boundary, &a->form) == MULTIPART_OK);
+    FormField* fields = a->form.fields;
+    FileHeader** files = a->form.files;
+    multipart_context_release(&pool, c);
+    multipart_context_release(&pool, a);
+    assert(multipart_context_acquire(&pool) == a);
+    assert(a->form.fields == fields && a->form.files == files && a->form.num_fields == 0);
+    assert(multipart_parse_form(body, body_size, boundary, &a->form) == MULTIPART_OK);
+    assert(a->form.fields == fields && a->form.num_fields == 1 && a->form.num_files == 1);
+    multipart_context_release(&pool, a);
+    multipart_context_release(&pool, b);
+
+    // A copy of a form without fields has no fields array, parsing into it keeps the files array.
+    MultipartForm parsed = {0};
+    assert(multipart_parse_form(body, body_size, boundary, &parsed) == MULTIPART_OK);
+    parsed.num_fields = 0;
+    MultipartForm files_only = {0};
+    assert(multipart_copy_form(&parsed, &files_only) == MULTIPART_OK);
+    assert(files_only.fields == NULL && files_only.files != NULL);
+    files = files_only.files;
+    assert(multipart_parse_form(body, body_size, boundary, &files_only) == MULTIPART_OK);
+    assert(files_only.files == files && files_only.fields != NULL);
+    assert(files_only.num_files == 1 && files_only.num_fields == 1);
+    multipart_free_form(&files_only);
+    multipart_free_form(&parsed);
+
+    // Without body_capacity, the body is mapped on first use.
+    MultipartContextPool lazy;
+    assert(multipart_context_pool_init(&lazy, 1, 0, NULL, NULL, NULL));
+    MultipartContext* context = multipart_context_acquire(&lazy);
+    assert(context && context->body.data == NULL);
+    assert(multipart_body_append(&context->body, body, body_size) && context->body.size == body_size);
+    multipart_context_release(&lazy, context);
+    assert(multipart_context_acquire(&lazy) == context && context->body.size == 0);
+    multipart_context_pool_free(&lazy);
+
+    // More threads than contexts.
+    PoolWorker workers[6];
+    for (int i = 0; i < 6; i++) {
+        workers[i] = (PoolWorker){
+            .pool = &pool, .body = body, .body_size = body_size, .file_size = file_size, .iterations = 200};
+        assert(pthread_create(&workers[i].thread, NULL, pool_worker, &workers[i]) == 0);
+    }
+    for (int i = 0; i < 6; i++) {
+        pthread_join(workers[i].thread, NULL);
+        assert(workers[i].parsed == 200);
+    }
+
+    // Every context is back.
+    for (int i = 0; i < 3; i++)
+        assert(multipart_context_acquire(&pool) != NULL);
+    assert(multipart_context_acquire(&pool) == NULL);
+    multipart_context_pool_free(&pool);
+    assert(atomic_load(&live) == 0);
+
+    free(body);
+    free(file_data);
+    printf("Context pool test passed\n");
+}
+
+static const char* naive_search(const char* haystack, size_t length, const char* needle, size_t needle_length) {
+    for (size_t i = 0; i + needle_length <= length; i++) {
+        if (memcmp(haystack + i, needle, needle_length) == 0)
+            return haystack + i;
+    }
+    return NULL;
+}
+
+void test_boundary_search() {
+    size_t size = 4096;
+    char* haystack = malloc(size);
+    assert(haystack);
+    char needle[80] = "--";
+    for (size_t i = 2; i < sizeof(needle); i++)
+        needle[i] = (char)('A' + i % 26);
+
+    for (int k = MULTIPART_SEARCH_MEMMEM; k < MULTIPART_SEARCH_NUM_KERNELS; k++) {
+        if (!multipart_search_set_kernel((MultipartSearchKernel)k))
+            continue;
+        assert(multipart_search_kernel(40) == (MultipartSearchKernel)k);
+
+        // Needles of every class placed at the start, around vector widths and at the end, over
+        // haystacks of few distinct bytes so near misses are frequent.
+        size_t lengths[] = {1, 2, 3, 15, 16, 17, 31, 33, 48, 49, 72};
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            size_t n = lengths[l];
+            for (size_t trial = 0; trial < 40; trial++) {
+                size_t length = (trial * 97) % size;
+                fill_random(haystack, length, (int)(trial + l * 100));
+                for (size_t i = 0; i < length; i++)
+                    haystack[i] = needle[(unsigned char)haystack[i] % (n < 4 ? n : 4)];
+                if (length >= n && trial % 4 != 0) {
+                    size_t pos = trial % 3 == 0 ? length - n : (trial * 13) % (length - n + 1);
+                    memcpy(haystack + pos, needle, n);
+                }
+                const char* expected = naive_search(haystack, length, needle, n);
+                assert(multipart_search(haystack, length, needle, n) == expected);
+            }
+        }
+
+        // Parsing uses the selected kernel.
+        size_t file_size = 3000;
+        char* file_data = malloc(file_size);
+        assert(file_data);
+        fill_random(file_data, file_size, 5);
+        size_t body_size;
+        char* body = build_form(file_data, file_size, &body_size);
+        char boundary[] = TEST_BOUNDARY;
+        MultipartForm form = {0};
+        assert(multipart_parse_form(body, body_size, boundary, &form) == MULTIPART_OK);
+        assert(form.num_files == 1 && memcmp(body + form.files[0]->offset, file_data, file_size) == 0);
+        multipart_free_form(&form);
+        free(body);
+        free(file_data);
+    }
+    assert(!multipart_search_set_kernel(MULTIPART_SEARCH_NUM_KERNELS));
+
+    // The environment overrides the timing.
+    setenv("MULTIPART_SEARCH_KERNEL", "MEMCHR", 1);
+    multipart_search_autotune();
+    for (size_t n = 1; n < 100; n += 30)
+        assert(multipart_search_kernel(n) == MULTIPART_SEARCH_MEMCHR);
+    unsetenv("MULTIPART_SEARCH_KERNEL");
+    multipart_search_autotune();
+    for (size_t n = 1; n < 100; n += 30) {
+        MultipartSearchKernel kernel = multipart_search_kernel(n);
+        assert(kernel != MULTIPART_SEARCH_AUTO && multipart_search_kernel_available(kernel));
+        printf("Boundary search for %zu bytes: %s\n", n, multipart_search_kernel_name(kernel));
+    }
+    free(haystack);
+    printf("Boundary search test passed\n");
+}